@@ -7,6 +7,7 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 */
 
 
+#define _GNU_SOURCE
 #include "version.h"
 #include "net.h"
 #include <getopt.h>
@@ -23,8 +24,24 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <semaphore.h>
+#include <signal.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/sysinfo.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #include "cprefresh.h"
+#include "uring.h"
+#include "ringbuf.h"
+#include "trace.h"
+#include "multistream.h"
+#include "shmring.h"
+#include "shmmem.h"
+#include "stream.h"
 
 /* help page */
 /* vim hint to remove resp. add quotes:
@@ -70,6 +87,40 @@ void usage( ) {
 "\n"
 "  --port-to-write=intval, -p intval\n"
 "      the network port number to which data are written instead of stdout.\n"
+"      The program listens for IPv6 and IPv4 connections on this port.\n"
+"\n"
+"  --socket-path=path, -u path\n"
+"      instead of a network port listen on a UNIX domain socket with this\n"
+"      path. If sender and receiver run on the same machine this avoids\n"
+"      the overhead of TCP (use 'playhrt --socket-path=path' or 'bufhrt\n"
+"      --host-to-read=path' on the receiving side).\n"
+"\n"
+"  --udp-host=hname, -j hname\n"
+"  --udp-port=intval, -k intval\n"
+"      in default mode send the data as UDP datagrams (one per loop) to\n"
+"      this host and port. Each datagram gets its send time (option\n"
+"      SO_TXTIME) and the kernel sends it at that time, so 'bufhrt' only\n"
+"      wakes up every few loops (see --txtime-ahead) and queues the next\n"
+"      datagrams. This needs a network interface with the 'fq' or 'etf'\n"
+"      queueing discipline (e.g., 'tc qdisc replace dev lo root fq'),\n"
+"      otherwise the datagrams are sent immediately. Datagrams which\n"
+"      missed their send time are reported (with 'etf').\n"
+"\n"
+"  --txtime-ahead=intval, -l intval\n"
+"      with --udp-host the number of loops to queue per wakeup.\n"
+"      Default is 20.\n"
+"\n"
+"  --txtime-tai, -t\n"
+"      with --udp-host use CLOCK_TAI for the send times, as needed by\n"
+"      the 'etf' queueing discipline ('fq' needs the default, the\n"
+"      monotonic clock).\n"
+"\n"
+"  --kernel-pacing[=intval], -q [intval]\n"
+"      with --port-to-write let the kernel spread the data evenly over\n"
+"      time (option SO_MAX_PACING_RATE of the connection, set to the\n"
+"      bytes per second including the extra bytes). Then 'bufhrt'\n"
+"      writes intval (default 10) loops of data at once, so it wakes up\n"
+"      that many times less often. See the script 'compare_pacing'.\n"
 "\n"
 "  --outfile=fname, -o fname\n"
 "      write to this file instead of stdout.\n"
@@ -95,7 +146,8 @@ void usage( ) {
 "  --host-to-read=hname, -H hname\n"
 "      the name or ip-address of a machine. If given, you have to specify\n"
 "      --port-to-read as well. In this case data are not read from stdin\n"
-"      but from this host and port.\n"
+"      but from this host and port. If hname starts with a slash it is\n"
+"      the path of a UNIX domain socket and no port is needed.\n"
 "\n"
 "  --port-to-read=intval, -P intval\n"
 "      a port number, see --host-to-read.\n"
@@ -112,10 +164,21 @@ void usage( ) {
 "      quality than using 'catloop' and a pipe to 'bufhrt' with --stdin\n"
 "      input. We have made good experience with using three shared memory\n"
 "      chunks whose combined length is a bit smaller than the CPUs\n"
-"      L1-cache. In this mode 'bufhrt' does not combine data from\n"
-"      several memory files as output in one loop. Therefore,\n"
-"      'writeloop' should be used with a '--file-size' parameter\n"
-"      which is a multiple of the output per loop of 'bufhrt'.\n"
+"      L1-cache. The output of a loop can combine data from several\n"
+"      memory files (written with 'writev'), so the '--file-size' of\n"
+"      'writeloop' need not fit to the output per loop of 'bufhrt'. A\n"
+"      memory file is given back to 'writeloop' as soon as it is\n"
+"      completely written. A sample format stored by 'writeloop\n"
+"      --format' or '--framed' is skipped (and shown with --verbose), a\n"
+"      change of the format is an error.\n"
+"\n"
+"  --ring <name>\n"
+"      input is read from a ring buffer in shared memory written by\n"
+"      'writeloop --ring'. The name must be specified after all other\n"
+"      options. The output is written directly from the ring; in contrast\n"
+"      to --shared no semaphores are used, the programs only synchronize\n"
+"      when the ring is empty or full. With 'writeloop --readers=...'\n"
+"      bufhrt is one of several readers, the writer waits for it.\n"
 "\n"
 "  --input-size=intval, -i intval\n"
 "      the number of bytes to be read per loop (when needed). The default\n"
@@ -128,16 +191,108 @@ void usage( ) {
 "      per second (negativ for fewer and positive for more bytes).\n"
 "      The program adjusts the duration of the read-sleep-write rounds.\n"
 "\n"
+"  --auto-extra-bytes[=intval], -A [intval]\n"
+"      with network output adjust the extra bytes per second (see\n"
+"      above, the value of --extra-bytes-per-second is the start value)\n"
+"      automatically. 64 times per second the number of bytes queued\n"
+"      in the kernel for the connection is sampled, every eight seconds\n"
+"      a line is fitted to the samples and the duration of the loops is\n"
+"      corrected such that the queue neither grows nor shrinks and\n"
+"      slowly moves to the given depth in bytes (default is the depth\n"
+"      found in the first eight seconds). When the value has settled it\n"
+"      is printed, such that it can be given with\n"
+"      --extra-bytes-per-second in later runs.\n"
+"\n"
 "  --interval, -I\n"
 "      use interval mode, typically together with a large --buffer-size.\n"
 "      Per interval the buffer is filled without writing data, and then\n"
 "      the buffer content is written out in a sleep-write loop (without\n"
 "      reading input). See below for an example.\n"
 "\n"
+"  --double-buffer, -B\n"
+"      with --interval use two buffers of half the --buffer-size. A\n"
+"      separate thread fills one buffer while the other one is written\n"
+"      out in the sleep-write loop, so that the output is continuous and\n"
+"      filling and writing overlap in time.\n"
+"\n"
+"  --mmap-input, -Y\n"
+"      with --interval and a regular input --file, map the file into\n"
+"      memory window by window instead of reading it into the buffer.\n"
+"      Each window is one interval, the mapping is read-only and each\n"
+"      chunk is copied to a small buffer and refreshed there.\n"
+"      Without --buffer-size the window size is the size of the file,\n"
+"      but at most half of the free RAM.\n"
+"\n"
+"  --shared-out, -X\n"
+"      write the output into shared memory segments like 'writeloop\n"
+"      --shared' does, their names are given as arguments after the\n"
+"      options (at least two). A consumer like 'catloop --shared' or\n"
+"      'bufhrt --shared' reads them, so no pipe and no extra 'writeloop'\n"
+"      process is needed. Cannot be combined with --shared or another\n"
+"      output.\n"
+"\n"
+"  --shared-size=intval, -Z intval\n"
+"      with --shared-out, the size of the segments (default 64000).\n"
+"\n"
+"  --force-shm, -x\n"
+"      with --shared-out, reuse semaphores left over from former runs.\n"
+"\n"
+"  --hugetlbfs=dir, -J dir\n"
+"      with --shared or --shared-out, the segments are files in this\n"
+"      directory on a hugetlbfs mount (see 'writeloop').\n"
+"\n"
+"  --huge-pages, -Q\n"
+"      with --shared or --shared-out, ask for transparent huge pages.\n"
+"\n"
+"  --lock-memory, -E\n"
+"      with --shared or --shared-out, lock the segments in memory.\n"
+"\n"
+"  --populate, -y\n"
+"      with --shared or --shared-out, prefault the segments when they\n"
+"      are mapped, so that no page fault happens in the timed loop. With\n"
+"      --verbose the page faults during the loop are shown at the end.\n"
+"\n"
 "  --dsync, -d\n"
 "      output file will be opened with O_DSYNC option, this is a hint to\n"
 "      the system to write data to the hardware immediately.\n"
 "\n"
+"  --direct, -D\n"
+"      with --interval and --outfile write the output file with O_DIRECT,\n"
+"      that is without the page cache, and allocate the size of the\n"
+"      input file in advance. For this the output per loop is rounded up\n"
+"      to a multiple of the page size and the duration of the loops is\n"
+"      adjusted. The tail of the file is written without O_DIRECT. With\n"
+"      --verbose the latencies of the writes are reported.\n"
+"\n"
+"  --splice, -z\n"
+"      in default mode (not with --shared or --interval) hand the refreshed\n"
+"      pages of the buffer to the kernel with 'vmsplice' instead of copying\n"
+"      them with 'write'. If the output is a pipe the pages go there\n"
+"      directly, for a network connection or a file they go through an\n"
+"      internal pipe and 'splice'. The buffer is enlarged if necessary,\n"
+"      such that data are not overwritten while the kernel still refers\n"
+"      to them, and for network output the send buffer is fixed (see\n"
+"      --out-net-buffer-size, default with this option is 65536). For\n"
+"      other outputs (e.g., a terminal) 'write' is used.\n"
+"\n"
+"  --io-uring, -G\n"
+"      in default mode use an io_uring for the main loop: the write of\n"
+"      a chunk is linked behind a timeout at the wakeup time and the\n"
+"      next read (if needed) is queued at the same time. So, there is\n"
+"      one system call per loop instead of up to three. With --verbose\n"
+"      the delays of the write completions are reported. Not used\n"
+"      together with --splice or --reconnect.\n"
+"\n"
+"  --reconnect[=oldest|live], -R\n"
+"      with network output keep the listening socket open when the client\n"
+"      disconnects, and wait for a new connection instead of exiting\n"
+"      (in default mode and with --shared). With 'oldest' (the default)\n"
+"      input is paused and output resumes with the oldest data not yet\n"
+"      written. With 'live' input is read at the usual pace and the data\n"
+"      are dropped until the next client connects. The time until a\n"
+"      reconnect and the number of dropped bytes are reported. (Data\n"
+"      already queued in the kernel for the lost connection are gone.)\n"
+"\n"
 "  --in-net-buffer-size=intval, -K intval\n"
 "  --out-net-buffer-size=intval, -L intval\n"
 "      this if for finetuning only. It specifies the buffer size to\n"
@@ -146,6 +301,43 @@ void usage( ) {
 "      the program is running can be checked with 'netstat -tpn'.\n"
 "      Usually the operation system chooses sensible values itself.\n"
 "\n"
+"  --trace=fname, -T fname\n"
+"      in default mode and with --shared write a record for each loop\n"
+"      to the file fname: the wakeup time and the actual time after\n"
+"      sleeping, the duration of the write, the number of bytes written\n"
+"      and left in the buffer, and flags for underruns and short reads\n"
+"      and writes. The file is created with its full size in advance and\n"
+"      mapped to memory, so recording does not need system calls. Use\n"
+"      the 'tracehrt' program to analyse the file. Underruns are not\n"
+"      reported on stderr with this option. (With --io-uring the time\n"
+"      of the write completion is recorded instead of the wakeup.)\n"
+"\n"
+"  --trace-loops=intval, -U intval\n"
+"      the number of records in the trace file, when more loops are\n"
+"      done the oldest records are overwritten. Default is the number\n"
+"      of loops in 10 minutes.\n"
+"\n"
+"  --streams=file, -N file\n"
+"      serve many independent streams in one process. Each non-empty\n"
+"      line of the file describes one stream with entries key=value:\n"
+"      'input' and 'output' (a file name or host:port of a network\n"
+"      connection), 'bytes-per-second', and optionally\n"
+"      'loops-per-second' (default 1000), 'extra-bytes-per-second',\n"
+"      'buffer-size' and 'cpu'. Text after a '#' is ignored. All other\n"
+"      options except --cpus, --wheel-tick and --verbose are ignored.\n"
+"\n"
+"  --cpus=list, -C list\n"
+"      with --streams, a list like 0,2-3 of CPUs. Each CPU gets one\n"
+"      timer thread, the streams are distributed round robin (or as\n"
+"      given by their 'cpu' entry). By default one thread is used.\n"
+"\n"
+"  --wheel-tick=nsec, -W nsec\n"
+"      with --streams, the deadlines of the streams of one CPU are kept\n"
+"      in a timing wheel with this granularity (default 100000). All\n"
+"      deadlines within a tick are served by a single wakeup at its\n"
+"      start. With --verbose the deviations from the deadlines are\n"
+"      reported per stream, and the saved wakeups per CPU.\n"
+"\n"
 "  --verbose, -v\n"
 "      print some information during startup and operation.\n"
 "\n"
@@ -180,7 +372,7 @@ void usage( ) {
 "         --bytes-per-second=6144000\n"
 "\n"
 "  And here is an example how 'bufhrt' can work together with 'writeloop'\n"
-"  (note that the memory file size is 6 * 1536, 6 times the data to be\n"
+"  (the memory file size need not be a multiple of the 1536 bytes\n"
 "  written per loop).\n"
 "\n"
 "  ...(filter)... | writeloop --block-size=1536 \\\n"
@@ -193,31 +385,494 @@ void usage( ) {
   );
 }
 
+/* data shared with the reading thread in double-buffered interval mode,
+   buffer k is owned by the reader between sem_wait(&empty[k]) and
+   sem_post(&full[k]), and by the writer otherwise */
+struct dbuf {
+    int ifd;
+    long len, ilen;
+    char *buf[2];
+    long fill[2];
+    sem_t empty[2], full[2];
+    long long icount;
+};
+
+/* the reading thread: fill the buffers alternately, a buffer with
+   fill 0 marks the end of input */
+void *dbufreader(void *arg)
+{
+    struct dbuf *d = (struct dbuf*)arg;
+    int k;
+    long n, s;
+
+    for (k = 0; 1; k = 1-k) {
+        sem_wait(&d->empty[k]);
+        for (d->fill[k] = 0; d->fill[k] < d->len; d->fill[k] += s) {
+            n = d->len - d->fill[k];
+            if (n > d->ilen)
+                n = d->ilen;
+            /* clean only the part we read into */
+            memclean(d->buf[k] + d->fill[k], n);
+            s = read(d->ifd, d->buf[k] + d->fill[k], n);
+            if (s < 0) {
+                fprintf(stderr, "bufhrt: Read error.\n");
+                exit(18);
+            }
+            if (s == 0)
+                break;
+            d->icount += s;
+        }
+        sem_post(&d->full[k]);
+        if (d->fill[k] == 0)
+            return NULL;
+    }
+}
+
+/* automatic adjustment of the extra bytes per second from the depth
+   of the queue of the output socket */
+#define AUTOSAMPLES 512
+#define AUTOTAU 30.0
+struct autoextra {
+    long every;       /* sample every .. loops */
+    long target;      /* wanted queue depth, < 0: mean of first samples */
+    int n, stable, reported;
+    double t0, st, sq, stt, stq;
+    double extrabps, avg;
+};
+
+/* takes a sample of the queue depth at time mtime, after AUTOSAMPLES
+   samples a line is fitted and extrabps corrected, returns new nsec */
+long autoextra(struct autoextra *ae, int fd, struct timespec *mtime,
+               long outpersec, long loopspersec, long nsec, int verbose)
+{
+    int q;
+    double t, slope, mean, corr;
+
+    if (ioctl(fd, SIOCOUTQ, &q) < 0)
+        return nsec;
+    /* sums for least squares line through the samples */
+    t = mtime->tv_sec + 0.000000001*mtime->tv_nsec;
+    if (ae->n == 0) {
+        ae->t0 = t;
+        ae->st = ae->sq = ae->stt = ae->stq = 0.0;
+    }
+    t -= ae->t0;
+    ae->st += t;
+    ae->sq += q;
+    ae->stt += t*t;
+    ae->stq += t*q;
+    ae->n++;
+    if (ae->n < AUTOSAMPLES)
+        return nsec;
+    ae->n = 0;
+    slope = (AUTOSAMPLES*ae->stq - ae->st*ae->sq) /
+            (AUTOSAMPLES*ae->stt - ae->st*ae->st);
+    mean = ae->sq/AUTOSAMPLES;
+    if (ae->target < 0) {
+        ae->target = (long)mean;
+        if (verbose)
+            fprintf(stderr, "bufhrt: Target depth of output queue: %ld bytes.\n",
+                            ae->target);
+    }
+    /* a growing queue means that we send too fast, the second term
+       moves the queue slowly to the target depth; we only correct half
+       of the error to damp the noise in the samples */
+    corr = slope + (mean - ae->target)/AUTOTAU;
+    ae->extrabps -= corr/2;
+    ae->avg = 0.75*ae->avg + 0.25*ae->extrabps;
+    if (verbose)
+        fprintf(stderr, "bufhrt: Output queue %.0f bytes, trend %.1f bytes/sec,"
+                        " extra bytes per second %.2f.\n",
+                        mean, slope, ae->extrabps);
+    /* settled if the corrections are within 200 ppm a few times */
+    if (corr < 0.0002*outpersec && corr > -0.0002*outpersec) {
+        ae->stable++;
+        if (ae->stable == 4 && !ae->reported) {
+            fprintf(stderr, "bufhrt: Extra bytes per second settled at %.1f "
+                            "(use --extra-bytes-per-second=%.1f).\n",
+                            ae->avg, ae->avg);
+            ae->reported = 1;
+        }
+    } else {
+        ae->stable = 0;
+    }
+    return (long)(1000000000.0*outpersec/(outpersec+ae->extrabps)/loopspersec);
+}
+
+/* latencies of the writes with --direct */
+struct wlat {
+    long n, slow, min, max;
+    long long sum;
+};
+
+/* write with --direct output: the file is opened with O_DIRECT which
+   needs aligned memory, length and file offset (pos); after a short
+   write the bytes up to the next aligned offset are written without
+   O_DIRECT, and an unaligned rest of the chunk is left for the next
+   loop; only before the tail of the file (last is set) O_DIRECT is
+   switched off for good; the duration of the write is recorded, nsec
+   is the duration of a loop */
+ssize_t directwrite(int fd, char *ptr, long len, long long pos, int last,
+                    long align, int *odirect, struct wlat *wl, long nsec)
+{
+    ssize_t s, r;
+    long d, head, rest;
+    int fl;
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    s = 0;
+    rest = len;
+    if (*odirect) {
+        fl = fcntl(fd, F_GETFL);
+        head = (align - pos % align) % align;
+        if (head > len)
+            head = len;
+        if (head > 0) {
+            fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+            s = write(fd, ptr, head);
+            fcntl(fd, F_SETFL, fl);
+            if (s < head)
+                goto done;
+        }
+        rest = len - s;
+        if (last && (rest % align != 0 || (uintptr_t)(ptr+s) % align != 0)) {
+            fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+            *odirect = 0;
+        } else if ((uintptr_t)(ptr+s) % align == 0) {
+            rest -= rest % align;
+        } else {
+            /* cannot happen with our buffers, write through the cache */
+            fcntl(fd, F_SETFL, fl & ~O_DIRECT);
+            r = write(fd, ptr+s, rest);
+            fcntl(fd, F_SETFL, fl);
+            rest = 0;
+            if (r < 0)
+                s = (s > 0) ? s : r;
+            else
+                s += r;
+        }
+    }
+    if (rest > 0) {
+        r = write(fd, ptr+s, rest);
+        if (r < 0)
+            s = (s > 0) ? s : r;
+        else
+            s += r;
+    }
+done:
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    d = (t1.tv_sec-t0.tv_sec)*1000000000 + t1.tv_nsec-t0.tv_nsec;
+    wl->n++;
+    wl->sum += d;
+    if (d < wl->min) wl->min = d;
+    if (d > wl->max) wl->max = d;
+    if (d > nsec) wl->slow++;
+    return s;
+}
+
+/* output into shared memory segments in the format of 'writeloop' */
+struct shmout {
+    int n, cur, locked;
+    long size, fill;
+    char *mems[100];
+    sem_t *sems[100], *semsw[100];
+};
+
+/* creates segments and semaphores as 'writeloop --shared' does */
+void shmout_open(struct shmout *so, char **names, int n, long size, int force)
+{
+    int i, fd, flag;
+    char tmpname[300];
+
+    if (n > 100) {
+        fprintf(stderr, "bufhrt: Too many names for --shared-out.\n");
+        exit(33);
+    }
+    flag = force ? O_CREAT : O_CREAT | O_EXCL;
+    for (i = 0; i < n; i++) {
+        if (strlen(names[i]) > 290) {
+            fprintf(stderr, "bufhrt: Name %s is too long.\n", names[i]);
+            exit(33);
+        }
+        sprintf(tmpname, "%s.TMP", names[i]);
+        if (force) {
+            /* start with fresh values of the semaphores */
+            sem_unlink(names[i]);
+            sem_unlink(tmpname);
+        }
+        if ((so->sems[i] = sem_open(names[i], flag, 0666, 0)) == SEM_FAILED) {
+            fprintf(stderr, "bufhrt: Cannot open semaphore %s (use "
+                            "--force-shm?).\n", names[i]);
+            exit(33);
+        }
+        if ((so->semsw[i] = sem_open(tmpname, flag, 0666, 0)) == SEM_FAILED) {
+            fprintf(stderr, "bufhrt: Cannot open semaphore %s.\n", tmpname);
+            exit(33);
+        }
+        sem_post(so->semsw[i]);
+        if ((fd = shmmem_open(names[i], O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) == -1 ||
+            (force && ftruncate(fd, 0) == -1) ||
+            ftruncate(fd, shmmem_size(sizeof(int)+size)) == -1) {
+            fprintf(stderr, "bufhrt: Cannot create shared memory %s.\n",
+                            names[i]);
+            exit(33);
+        }
+        so->mems[i] = shmmem_map(fd, sizeof(int)+size, PROT_READ | PROT_WRITE);
+        close(fd);
+        if (so->mems[i] == MAP_FAILED) {
+            fprintf(stderr, "bufhrt: Cannot map shared memory %s.\n", names[i]);
+            exit(33);
+        }
+    }
+    so->n = n;
+    so->size = size;
+    so->cur = 0;
+    so->fill = 0;
+    so->locked = 0;
+}
+
+/* copies a chunk into the segments, a full segment is handed over to
+   the reader; waits if the reader has not yet taken the next segment */
+ssize_t shmout_write(struct shmout *so, char *ptr, size_t len)
+{
+    size_t done, c;
+    char *dst;
+
+    for (done = 0; done < len; done += c) {
+        if (! so->locked) {
+            while (sem_wait(so->semsw[so->cur]) != 0) ;
+            so->locked = 1;
+        }
+        c = len - done;
+        if (c > so->size - so->fill)
+            c = so->size - so->fill;
+        dst = so->mems[so->cur] + sizeof(int) + so->fill;
+        memclean(dst, c);
+        memcpy(dst, ptr + done, c);
+        so->fill += c;
+        if (so->fill == so->size) {
+            *((int*)(so->mems[so->cur])) = so->fill;
+            sem_post(so->sems[so->cur]);
+            so->locked = 0;
+            so->fill = 0;
+            so->cur = (so->cur + 1) % so->n;
+        }
+    }
+    return len;
+}
+
+/* hands over the last partial segment and an empty one to mark the end */
+void shmout_close(struct shmout *so)
+{
+    if (so->fill > 0) {
+        *((int*)(so->mems[so->cur])) = so->fill;
+        sem_post(so->sems[so->cur]);
+        so->locked = 0;
+        so->cur = (so->cur + 1) % so->n;
+    }
+    if (! so->locked)
+        while (sem_wait(so->semsw[so->cur]) != 0) ;
+    *((int*)(so->mems[so->cur])) = 0;
+    sem_post(so->sems[so->cur]);
+}
+
+/* counts datagrams from the error queue which missed their send time
+   or had an invalid send time */
+void txtimeerrors(int fd, long *missed, long *invalid)
+{
+    char cbuf[256];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *ee;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return;
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            ee = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (ee->ee_origin != SO_EE_ORIGIN_TXTIME)
+                continue;
+            if (ee->ee_code == SO_EE_CODE_TXTIME_MISSED)
+                (*missed)++;
+            else
+                (*invalid)++;
+        }
+    }
+}
+
+/* drops data which are still in the internal splice pipe */
+void resetpipe(int *pfd)
+{
+    close(pfd[0]);
+    close(pfd[1]);
+    if (pipe(pfd) == -1) {
+        fprintf(stderr, "bufhrt: Cannot create pipe for splice.\n");
+        exit(25);
+    }
+}
+
+/* the client at the output has gone, close the connection and
+   drop data which are still in the internal splice pipe */
+void dropclient(int connfd, int *pfd, struct timespec *gone)
+{
+    close(connfd);
+    if (pfd != NULL)
+        resetpipe(pfd);
+    clock_gettime(CLOCK_MONOTONIC, gone);
+    fprintf(stderr, "bufhrt: Client disconnected at %ld sec %ld nsec, "
+                    "waiting for new connection.\n", gone->tv_sec, gone->tv_nsec);
+}
+
+/* let the kernel pace a TCP connection at rate bytes per second */
+void setpacing(int fd, double rate)
+{
+    unsigned int r;
+
+    r = (unsigned int)(rate + 0.5);
+    if (setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &r, sizeof(r)) < 0) {
+        fprintf(stderr, "bufhrt: Cannot set pacing rate of connection.\n"
+                        "   %s\n", strerror(errno));
+        exit(32);
+    }
+}
+
+/* accept a new client after the previous one has gone at time 'gone',
+   returns -1 if listenfd is non-blocking and nobody is waiting */
+int reaccept(int listenfd, struct timespec *gone, long long dropped,
+             double pacing)
+{
+    int fd;
+    struct timespec now;
+
+    fd = accept(listenfd, (struct sockaddr*)NULL, NULL);
+    if (fd == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return -1;
+        fprintf(stderr, "bufhrt: Cannot accept outgoing connection.\n");
+        exit(12);
+    }
+    if (pacing > 0.0)
+        setpacing(fd, pacing);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(stderr, "bufhrt: Client reconnected after %.3lf sec, "
+                    "%lld bytes dropped.\n",
+                    (now.tv_sec-gone->tv_sec)+(now.tv_nsec-gone->tv_nsec)*1e-9,
+                    dropped);
+    return fd;
+}
+
+/* write len bytes from ptr by handing the pages to the kernel:
+   directly into fd if it is a pipe (pfd == NULL), otherwise into
+   the internal pipe pfd and from there with splice into fd; if the
+   splice fails the rest in the internal pipe is dropped, and the
+   bytes which went into fd are returned if there are any */
+ssize_t splicewrite(int fd, int *pfd, void *ptr, size_t len)
+{
+    struct iovec iov;
+    ssize_t s, t, done;
+    int e;
+
+    iov.iov_base = ptr;
+    iov.iov_len = len;
+    if (pfd == NULL)
+        return vmsplice(fd, &iov, 1, 0);
+    s = vmsplice(pfd[1], &iov, 1, 0);
+    if (s <= 0)
+        return s;
+    for (done = 0; done < s; done += t) {
+        t = splice(pfd[0], NULL, fd, NULL, s-done, SPLICE_F_MOVE);
+        if (t <= 0) {
+            e = (t == 0) ? EIO : errno;
+            resetpipe(pfd);
+            errno = e;
+            return (done > 0) ? done : -1;
+        }
+    }
+    return s;
+}
+
 int main(int argc, char *argv[])
 {
-    struct sockaddr_in serv_addr;
-    int listenfd, connfd, ifd, s, moreinput, optval=1, verbose, rate,
+    int listenfd, connfd, ifd, s, moreinput, verbose, rate,
         bytesperframe, optc, interval, shared, innetbufsize,
-        outnetbufsize, dsync;
+        outnetbufsize, dsync, dosplice, spipe[2], *splicepipe, reconnect,
+        resumelive, douring, upending, rqueued, ures, rres, doublebuf, k,
+        mmapin, blenset, autox, tflags, txtai, direct, odirect, prealloc;
     long blen, hlen, ilen, olen, outpersec, loopspersec, nsec, count, wnext,
          badreads, badreadbytes, badwrites, badwritebytes, lcount;
-    long long icount, ocount;
-    void *buf, *iptr, *optr, *max;
-    char *port, *inhost, *inport, *outfile, *infile;
-    struct timespec mtime;
-    double looperr, extraerr, extrabps, off;
-    /* variables for shared memory input */
-    char **fname, *fnames[100], **tmpname, *tmpnames[100], **mem, *mems[100],
-         *ptr;
-    sem_t **sem, *sems[100], **semw, *semsw[100];
-    int fd[100], i, flen, size, c, sz;
+    long long icount, ocount, dropped, totaldropped;
+    long kq, reconnects, wdur, wmin, wmax;
+    long long wsum;
+    socklen_t kqlen;
+    int sndbuf;
+    void *buf, *mbuf, *iptr, *optr, *wptr, *max;
+    struct ringbuf rb;
+    char *port, *sockpath, *inhost, *inport, *outfile, *infile;
+    struct timespec mtime, gone, wstart, wend;
+    struct __kernel_timespec uts;
+    struct uring ring;
+    struct io_uring_sqe *sqe;
+    unsigned long long udata;
+    struct dbuf dbuf;
+    struct autoextra ae;
+    char *tracefile, *udphost, *udpport;
+    long ahead, wakeups, txmissed, txinvalid;
+    long long taioff;
+    uint64_t txt;
+    struct sock_txtime stt;
+    struct msghdr txmsg;
+    struct iovec txiov;
+    struct cmsghdr *txcm;
+    char txcbuf[CMSG_SPACE(sizeof(uint64_t))];
+    struct timespec wtime;
+    long tracelen;
+    struct tracehead *th;
+    struct tracerec *tr;
+    pthread_t dbufthread;
+    long inwaits, psz, win;
+    off_t fsize, foff;
     struct stat sb;
+    struct sysinfo si;
+    double looperr, extraerr, extrabps, off, pacing;
+    long batch, align;
+    struct wlat wl;
+    char *streamsfile;
+    struct mstream *streams;
+    int cpus[MS_MAXCPUS], ncpus, nstreams;
+    long tick;
+    struct shmout so;
+    int shmout, shmforce, memflags;
+    char *hugedir;
+    struct rusage ru;
+    long shmsize;
+    struct shmring sring;
+    int usering;
+    /* variables for shared memory input */
+    char **fname, *fnames[100], **tmpname, *tmpnames[100], *mems[100];
+    sem_t *sems[100], *semsw[100];
+    int fd[100], i, flen, size, c, sz, nseg, hfirst, hnext, nheld, hoff,
+        avail, niov, seglen[100], segoff[100];
+    struct iovec iov[100];
+    struct streamfmt *sfmt, shmfmt;
 
     /* read command line options */
     static struct option longoptions[] = {
         {"port-to-write", required_argument,       0,  'p' },
         /* for backward compatibility */
         {"port", required_argument,       0,  'p' },
+        {"socket-path", required_argument, 0, 'u' },
+        {"udp-host", required_argument, 0, 'j' },
+        {"udp-port", required_argument, 0, 'k' },
+        {"txtime-ahead", required_argument, 0, 'l' },
+        {"txtime-tai", no_argument, 0, 't' },
+        {"kernel-pacing", optional_argument, 0, 'q' },
         {"outfile", required_argument, 0, 'o' },
         {"buffer-size", required_argument,       0,  'b' },
         {"input-size",  required_argument, 0, 'i'},
@@ -226,16 +881,36 @@ int main(int argc, char *argv[])
         {"sample-rate", required_argument, 0,  's' },
         {"sample-format", required_argument, 0, 'f' },
         {"dsync", no_argument, 0, 'd' },
+        {"direct", no_argument, 0, 'D' },
+        {"double-buffer", no_argument, 0, 'B' },
+        {"mmap-input", no_argument, 0, 'Y' },
+        {"splice", no_argument, 0, 'z' },
         {"file", required_argument, 0, 'F' },
         {"host-to-read", required_argument, 0, 'H' },
         {"port-to-read", required_argument, 0, 'P' },
         {"stdin", no_argument, 0, 'S' },
         {"shared", no_argument, 0, 'M' },
+        {"ring", no_argument, 0, 'r' },
+        {"shared-out", no_argument, 0, 'X' },
+        {"shared-size", required_argument, 0, 'Z' },
+        {"force-shm", no_argument, 0, 'x' },
+        {"hugetlbfs", required_argument, 0, 'J' },
+        {"huge-pages", no_argument, 0, 'Q' },
+        {"lock-memory", no_argument, 0, 'E' },
+        {"populate", no_argument, 0, 'y' },
         {"extra-bytes-per-second", required_argument, 0, 'e' },
+        {"auto-extra-bytes", optional_argument, 0, 'A' },
+        {"trace", required_argument, 0, 'T' },
+        {"trace-loops", required_argument, 0, 'U' },
+        {"io-uring", no_argument, 0, 'G' },
+        {"reconnect", optional_argument, 0, 'R' },
         {"in-net-buffer-size", required_argument, 0, 'K' },
         {"out-net-buffer-size", required_argument, 0, 'L' },
         {"overwrite", required_argument, 0, 'O' }, /* not used, ignored */
         {"interval", no_argument, 0, 'I' },
+        {"streams", required_argument, 0, 'N' },
+        {"cpus", required_argument, 0, 'C' },
+        {"wheel-tick", required_argument, 0, 'W' },
         {"verbose", no_argument, 0, 'v' },
         {"version", no_argument, 0, 'V' },
         {"help", no_argument, 0, 'h' },
@@ -248,9 +923,18 @@ int main(int argc, char *argv[])
     }
     /* defaults */
     port = NULL;
+    sockpath = NULL;
     dsync = 0;
+    dosplice = 0;
+    splicepipe = NULL;
+    reconnect = 0;
+    resumelive = 0;
+    douring = 0;
+    doublebuf = 0;
+    mmapin = 0;
     outfile = NULL;
     blen = 65536;
+    blenset = 0;
     /* default input is stdin */
     ifd = 0;
     /* default output is stdout */
@@ -266,6 +950,30 @@ int main(int argc, char *argv[])
     shared = 0;
     interval = 0;
     extrabps = 0.0;
+    autox = 0;
+    ae.target = -1;
+    tracefile = NULL;
+    tracelen = 0;
+    udphost = NULL;
+    udpport = NULL;
+    ahead = 20;
+    txtai = 0;
+    batch = 0;
+    pacing = 0.0;
+    direct = 0;
+    odirect = 0;
+    prealloc = 0;
+    streamsfile = NULL;
+    ncpus = 0;
+    tick = 100000;
+    shmout = 0;
+    usering = 0;
+    shmforce = 0;
+    hugedir = NULL;
+    memflags = 0;
+    shmsize = 64000;
+    so.n = 0;
+    th = NULL;
     innetbufsize = 0;
     outnetbufsize = 0;
     verbose = 0;
@@ -275,9 +983,24 @@ int main(int argc, char *argv[])
         case 'p':
           port = optarg;
           break;
+        case 'u':
+          sockpath = optarg;
+          break;
         case 'd':
           dsync = 1;
           break;
+        case 'D':
+          direct = 1;
+          break;
+        case 'z':
+          dosplice = 1;
+          break;
+        case 'B':
+          doublebuf = 1;
+          break;
+        case 'Y':
+          mmapin = 1;
+          break;
         case 'o':
           outfile = optarg;
           if (dsync) 
@@ -292,6 +1015,7 @@ int main(int argc, char *argv[])
           break;
         case 'b':
           blen = atoi(optarg);
+          blenset = 1;
           break;
         case 'i':
           ilen = atoi(optarg);
@@ -341,6 +1065,50 @@ int main(int argc, char *argv[])
         case 'e':
           extrabps = atof(optarg);
           break;
+        case 'A':
+          autox = 1;
+          if (optarg != NULL)
+             ae.target = atoi(optarg);
+          break;
+        case 'T':
+          tracefile = optarg;
+          break;
+        case 'j':
+          udphost = optarg;
+          break;
+        case 'k':
+          udpport = optarg;
+          break;
+        case 'l':
+          ahead = atol(optarg);
+          if (ahead < 1)
+              ahead = 1;
+          break;
+        case 't':
+          txtai = 1;
+          break;
+        case 'q':
+          batch = (optarg != NULL) ? atol(optarg) : 10;
+          if (batch < 1)
+              batch = 1;
+          break;
+        case 'U':
+          tracelen = atol(optarg);
+          break;
+        case 'G':
+          douring = 1;
+          break;
+        case 'R':
+          reconnect = 1;
+          if (optarg == NULL || strcmp(optarg, "oldest") == 0) {
+             resumelive = 0;
+          } else if (strcmp(optarg, "live") == 0) {
+             resumelive = 1;
+          } else {
+             fprintf(stderr, "bufhrt: --reconnect must be 'oldest' or 'live'.\n");
+             exit(1);
+          }
+          break;
         case 'K':
           innetbufsize = atoi(optarg);
           if (innetbufsize != 0 && innetbufsize < 128)
@@ -356,6 +1124,41 @@ int main(int argc, char *argv[])
         case 'I':
           interval = 1;
           break;
+        case 'r':
+          usering = 1;
+          break;
+        case 'X':
+          shmout = 1;
+          break;
+        case 'Z':
+          shmsize = atol(optarg);
+          break;
+        case 'x':
+          shmforce = 1;
+          break;
+        case 'J':
+          hugedir = optarg;
+          break;
+        case 'Q':
+          memflags |= SHMMEM_THP;
+          break;
+        case 'E':
+          memflags |= SHMMEM_LOCK;
+          break;
+        case 'y':
+          memflags |= SHMMEM_POPULATE;
+          break;
+        case 'N':
+          streamsfile = optarg;
+          break;
+        case 'C':
+          ncpus = ms_parsecpus(optarg, cpus);
+          break;
+        case 'W':
+          tick = atol(optarg);
+          if (tick < 1000)
+              tick = 1000;
+          break;
         case 'v':
           verbose = 1;
           break;
@@ -369,6 +1172,21 @@ int main(int argc, char *argv[])
           exit(3);
         }
     }
+    /* many streams in one process, all other options are ignored */
+    if (streamsfile != NULL) {
+        if (! (streams = calloc(MS_MAXSTREAMS, sizeof(struct mstream))) ) {
+            fprintf(stderr, "bufhrt: Cannot allocate streams.\n");
+            exit(6);
+        }
+        nstreams = ms_readconfig(streamsfile, streams);
+        if (verbose)
+            fprintf(stderr, "bufhrt: Serving %d streams on %d timer threads, "
+                            "tick %ld nsec.\n", nstreams,
+                            ncpus > 0 ? (ncpus < nstreams ? ncpus : nstreams) : 1,
+                            tick);
+        ms_run(streams, nstreams, cpus, ncpus, tick, verbose);
+        exit(0);
+    }
     /* check some arguments and set some parameters */
     if (outpersec == 0) {
        if (rate != 0 && bytesperframe != 0) {
@@ -379,7 +1197,7 @@ int main(int argc, char *argv[])
            exit(5);
        }
     }
-    if (inhost != NULL && inport != NULL) {
+    if (inhost != NULL && (inport != NULL || inhost[0] == '/')) {
        ifd = fd_net(inhost, inport);
         if (innetbufsize != 0  &&
             setsockopt(ifd, SOL_SOCKET, SO_RCVBUF, (void*)&innetbufsize, sizeof(int)) < 0) {
@@ -395,8 +1213,14 @@ int main(int argc, char *argv[])
        else if (extrabps > 0.0)
            fprintf(stderr, "+%.1lf", extrabps);
        fprintf(stderr, " bytes per second to ");
-       if (port != NULL)
+       if (udphost != NULL)
+          fprintf(stderr, "UDP %s port %s.\n", udphost, udpport);
+       else if (sockpath != NULL)
+          fprintf(stderr, "socket %s.\n", sockpath);
+       else if (port != NULL)
           fprintf(stderr, "port %s.\n", port);
+       else if (shmout)
+          fprintf(stderr, "shared memory.\n");
        else if (connfd == 1)
           fprintf(stderr, "stdout.\n");
        else
@@ -404,8 +1228,12 @@ int main(int argc, char *argv[])
        fprintf(stderr, "bufhrt: Input from ");
        if (shared)
           fprintf(stderr, "shared memory");
+       else if (usering)
+          fprintf(stderr, "shared memory ring %s", argv[optind]);
        else if (ifd == 0)
           fprintf(stderr, "stdin");
+       else if (inhost != NULL && inhost[0] == '/')
+          fprintf (stderr, "socket %s", inhost);
        else if (inhost != NULL)
           fprintf (stderr, "host %s (port %s)", inhost, inport);
        else
@@ -413,6 +1241,22 @@ int main(int argc, char *argv[])
        fprintf(stderr, ", output in %ld loops per second.\n", loopspersec);
     }
 
+    if (batch > 0 && (port == NULL || interval || udphost != NULL)) {
+        batch = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: --kernel-pacing is only used with TCP "
+                            "output, not in interval mode.\n");
+    }
+    if (batch > 0) {
+        /* the kernel spreads the data, we write larger chunks */
+        loopspersec = loopspersec / batch;
+        if (loopspersec < 1)
+            loopspersec = 1;
+        pacing = outpersec + extrabps;
+        if (verbose)
+            fprintf(stderr, "bufhrt: Kernel pacing at %.1f bytes per second, "
+                            "%ld loops per second.\n", pacing, loopspersec);
+    }
     extraerr = 1.0*outpersec/(outpersec+extrabps);
     nsec = (int) (1000000000*extraerr/loopspersec);
     olen = outpersec/loopspersec;
@@ -433,63 +1277,458 @@ int main(int argc, char *argv[])
            fflush(stderr);
         }
     }
+    /* in splice mode the kernel refers to pages of our buffer until the
+       data are consumed, find out how many bytes it may hold */
+    if (dosplice && (shared || interval || udphost != NULL || shmout)) {
+        dosplice = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: --splice is only used in default mode "
+                            "without UDP or --shared-out.\n");
+    }
+    if (dosplice) {
+        kq = 0;
+        if (port != NULL || sockpath != NULL) {
+            if (outnetbufsize == 0)
+                outnetbufsize = 65536;
+            /* the kernel doubles the given value */
+            kq = 2*outnetbufsize;
+        } else if (fstat(connfd, &sb) == -1) {
+            dosplice = 0;
+        } else if (S_ISFIFO(sb.st_mode)) {
+            kq = fcntl(connfd, F_GETPIPE_SZ);
+        } else if (S_ISSOCK(sb.st_mode)) {
+            kqlen = sizeof(sndbuf);
+            if (getsockopt(connfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &kqlen) == -1)
+                dosplice = 0;
+            else
+                kq = sndbuf;
+        } else if (! S_ISREG(sb.st_mode)) {
+            dosplice = 0;
+        }
+        if (dosplice && (port != NULL || sockpath != NULL ||
+                         ! S_ISFIFO(sb.st_mode))) {
+            if (pipe(spipe) == -1) {
+                fprintf(stderr, "bufhrt: Cannot create pipe for splice.\n");
+                exit(25);
+            }
+            splicepipe = spipe;
+        }
+        if (verbose) {
+            if (dosplice)
+                fprintf(stderr, "bufhrt: Using vmsplice%s for output, kernel "
+                        "may hold %ld bytes.\n",
+                        splicepipe ? " and splice" : "", kq);
+            else
+                fprintf(stderr, "bufhrt: Output does not take pages, "
+                        "using write.\n");
+        }
+    }
+    /* in interval mode a regular input file can be mapped window by
+       window, then we don't need a large buffer */
+    if (mmapin && !interval) {
+        mmapin = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: --mmap-input is only used with --interval.\n");
+    }
+    if (mmapin && (fstat(ifd, &sb) != 0 || !S_ISREG(sb.st_mode))) {
+        mmapin = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: Input is not a regular file, not using "
+                            "--mmap-input.\n");
+    }
+    if (mmapin) {
+        psz = sysconf(_SC_PAGESIZE);
+        fsize = sb.st_size;
+        if (blenset) {
+            win = blen;
+        } else {
+            sysinfo(&si);
+            if ((long long)si.freeram * si.mem_unit / 2 < LONG_MAX/2)
+                win = (long long)si.freeram * si.mem_unit / 2;
+            else
+                win = LONG_MAX/2;
+            if (fsize < win)
+                win = fsize;
+        }
+        /* window offsets must be multiples of the page size */
+        win = ((win+psz-1)/psz)*psz;
+        if (doublebuf) {
+            doublebuf = 0;
+            if (verbose)
+                fprintf(stderr, "bufhrt: --double-buffer is not used with "
+                                "--mmap-input.\n");
+        }
+        blen = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: Mapping input file in windows of %ld bytes.\n",
+                            win);
+    }
+    /* O_DIRECT output needs aligned chunks, so we round the output per
+       loop to a multiple of the page size and adjust the loop duration */
+    if (direct && (!interval || outfile == NULL)) {
+        direct = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: --direct is only used with --interval "
+                            "and --outfile.\n");
+    }
+    if (direct) {
+        align = sysconf(_SC_PAGESIZE);
+        if (align < 4096)
+            align = 4096;
+        olen = ((olen + align - 1) / align) * align;
+        nsec = (long)(1000000000.0*olen/(outpersec+extrabps));
+        if (mmapin)
+            win = ((win + olen - 1) / olen) * olen;
+        close(connfd);
+        connfd = open(outfile, O_WRONLY | O_CREAT | O_DIRECT |
+                               (dsync ? O_DSYNC : 0), 00644);
+        if (connfd == -1) {
+            fprintf(stderr, "bufhrt: Cannot open output file %s with O_DIRECT."
+                            "\n   %s\n", outfile, strerror(errno));
+            exit(3);
+        }
+        odirect = 1;
+        if (fstat(ifd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+            if (fallocate(connfd, 0, 0, sb.st_size) == 0)
+                prealloc = 1;
+            else if (verbose)
+                fprintf(stderr, "bufhrt: Cannot preallocate output file (%s).\n",
+                                strerror(errno));
+        }
+        wl.n = 0;
+        wl.slow = 0;
+        wl.min = 1000000000;
+        wl.max = 0;
+        wl.sum = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: Direct output, %ld bytes per loop, loop "
+                            "duration %ld nsec.\n", olen, nsec);
+    }
     if (blen < 3*(ilen+olen))
         blen = 3*(ilen+olen);
+    if (dosplice && blen < 2*(kq+ilen+2*olen)) {
+        blen = 2*(kq+ilen+2*olen);
+        if (verbose)
+            fprintf(stderr, "bufhrt: Enlarging buffer to %ld bytes for splice.\n",
+                            blen);
+    }
     hlen = blen/2;
     if (olen*loopspersec == outpersec)
         looperr = 0.0;
     else
         looperr = (1.0*outpersec)/loopspersec - 1.0*olen;
+    /* with --direct nsec fits exactly to olen */
+    if (direct)
+        looperr = 0.0;
     moreinput = 1;
     icount = 0;
     ocount = 0;
+    if (udphost != NULL) {
+        if (udpport == NULL || shared || interval) {
+            fprintf(stderr, "bufhrt: --udp-host needs --udp-port and is only "
+                            "used in default mode.\n");
+            exit(1);
+        }
+        if (2*olen > 65000) {
+            fprintf(stderr, "bufhrt: Datagrams would be too large, use more "
+                            "--loops-per-second.\n");
+            exit(1);
+        }
+        if (douring || reconnect || autox) {
+            douring = reconnect = autox = 0;
+            if (verbose)
+                fprintf(stderr, "bufhrt: Not using --io-uring, --reconnect or "
+                                "--auto-extra-bytes with UDP.\n");
+        }
+    }
+    shmmem_config(hugedir, memflags);
+    if (usering && (shared || shmout || interval || udphost != NULL ||
+                    argc-optind != 1)) {
+        fprintf(stderr, "bufhrt: --ring needs one name and cannot be used with "
+                        "--shared, --shared-out, --interval or UDP output.\n");
+        exit(34);
+    }
+    if (shmout) {
+        if (shared || port != NULL || sockpath != NULL || udphost != NULL ||
+            outfile != NULL) {
+            fprintf(stderr, "bufhrt: --shared-out cannot be used with --shared "
+                            "or another output.\n");
+            exit(33);
+        }
+        if (argc-optind < 2 || shmsize < 1024) {
+            fprintf(stderr, "bufhrt: --shared-out needs at least two names and "
+                            "a --shared-size of at least 1024.\n");
+            exit(33);
+        }
+        if (douring) {
+            douring = 0;
+            if (verbose)
+                fprintf(stderr, "bufhrt: Not using --io-uring with "
+                                "--shared-out.\n");
+        }
+        shmout_open(&so, argv+optind, argc-optind, shmsize, shmforce);
+    }
+    if (reconnect && ((port == NULL && sockpath == NULL) || interval)) {
+        reconnect = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: --reconnect is only used with network output,"
+                            " not in interval mode.\n");
+    }
+    if (autox && ((port == NULL && sockpath == NULL) || interval)) {
+        autox = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: --auto-extra-bytes is only used with network"
+                            " output, not in interval mode.\n");
+    }
+    if (autox) {
+        ae.every = loopspersec/64;
+        if (ae.every < 1)
+            ae.every = 1;
+        ae.n = 0;
+        ae.stable = 0;
+        ae.reported = 0;
+        ae.extrabps = extrabps;
+        ae.avg = extrabps;
+    }
+    if (doublebuf && !interval) {
+        doublebuf = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: --double-buffer is only used with --interval.\n");
+    }
+    reconnects = 0;
+    dropped = 0;
+    totaldropped = 0;
 
-    /* we want buf % 8 = 0 */
-    if (! (buf = malloc(blen+ilen+2*olen+8)) ) {
-        fprintf(stderr, "bufhrt: Cannot allocate buffer of length %ld.\n",
-                blen+ilen+olen);
+    if (direct) {
+        /* we need page aligned memory for O_DIRECT */
+        if (posix_memalign(&buf, align, blen+ilen) != 0) {
+            fprintf(stderr, "bufhrt: Cannot allocate buffer of length %ld.\n",
+                    blen+ilen);
+            exit(6);
+        }
+    } else if (interval || shared) {
+        /* we want buf % 8 = 0 */
+        if (! (buf = malloc(blen+ilen+8)) ) {
+            fprintf(stderr, "bufhrt: Cannot allocate buffer of length %ld.\n",
+                    blen+ilen);
+            exit(6);
+        }
+        while (((uintptr_t)buf % 8) != 0) buf++;
+    } else if (ringbuf_init(&rb, blen+ilen) < 0) {
+        /* in default mode a ring buffer, input and output chunks are
+           contiguous also at the wrap around */
+        fprintf(stderr, "bufhrt: Cannot allocate buffer of length %ld.\n   %s\n",
+                blen+ilen, strerror(errno));
         exit(6);
     }
-    while (((uintptr_t)buf % 8) != 0) buf++;
-    buf = buf + 2*olen;
-    max = buf + blen;
-    iptr = buf;
-    optr = buf;
 
     /* outgoing socket */
-    if (port != 0) {
-        listenfd = socket(AF_INET, SOCK_STREAM, 0);
-        if (listenfd < 0) {
-            fprintf(stderr, "bufhrt: Cannot create outgoing socket.\n");
-            exit(9);
-        }
-        if (setsockopt(listenfd,
-                       SOL_SOCKET,SO_REUSEADDR,&optval,sizeof(int)) == -1)
-        {
-            fprintf(stderr, "bufhrt: Cannot set REUSEADDR.\n");
-            exit(10);
-        }
-        if (outnetbufsize != 0 && setsockopt(listenfd,
-                       SOL_SOCKET,SO_SNDBUF,&outnetbufsize,sizeof(int)) == -1)
-        {
-            fprintf(stderr, "bufhrt: Cannot set outgoing network buffer to %d.\n",
-                    outnetbufsize);
-            exit(30);
-        }
-        memset(&serv_addr, '0', sizeof(serv_addr));
-        serv_addr.sin_family = AF_INET;
-        serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-        serv_addr.sin_port = htons(atoi(port));
-        if (bind(listenfd, (struct sockaddr*)&serv_addr,
-                                              sizeof(serv_addr)) == -1) {
-            fprintf(stderr, "bufhrt: Cannot bind outgoing socket.\n");
-            exit(11);
-        }
-        listen(listenfd, 1);
+    if (port != NULL || sockpath != NULL) {
+        listenfd = fd_listen(port, sockpath, outnetbufsize);
         if ((connfd = accept(listenfd, (struct sockaddr*)NULL, NULL)) == -1) {
             fprintf(stderr, "bufhrt: Cannot accept outgoing connection.\n");
             exit(12);
         }
+        if (pacing > 0.0)
+            setpacing(connfd, pacing);
+        if (reconnect) {
+            /* we detect a lost client by the error of write */
+            signal(SIGPIPE, SIG_IGN);
+            /* without waiting client we go on reading input */
+            if (resumelive &&
+                fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) == -1) {
+                fprintf(stderr, "bufhrt: Cannot set listening socket non-blocking.\n");
+                exit(12);
+            }
+        }
+    }
+    /* UDP output with send times */
+    if (udphost != NULL) {
+        connfd = fd_udp(udphost, udpport);
+        /* the socket must hold the queued datagrams */
+        if (outnetbufsize == 0)
+            outnetbufsize = 4*ahead*(2*olen+100);
+        setsockopt(connfd, SOL_SOCKET, SO_SNDBUF, &outnetbufsize, sizeof(int));
+        stt.clockid = txtai ? CLOCK_TAI : CLOCK_MONOTONIC;
+        stt.flags = SOF_TXTIME_REPORT_ERRORS;
+        if (setsockopt(connfd, SOL_SOCKET, SO_TXTIME, &stt, sizeof(stt)) < 0) {
+            fprintf(stderr, "bufhrt: Cannot set SO_TXTIME on UDP socket.\n"
+                            "   %s\n", strerror(errno));
+            exit(31);
+        }
+        /* the send time is given in the control message of each datagram */
+        memset(&txmsg, 0, sizeof(txmsg));
+        txmsg.msg_iov = &txiov;
+        txmsg.msg_iovlen = 1;
+        txmsg.msg_control = txcbuf;
+        txmsg.msg_controllen = sizeof(txcbuf);
+        txcm = CMSG_FIRSTHDR(&txmsg);
+        txcm->cmsg_level = SOL_SOCKET;
+        txcm->cmsg_type = SCM_TXTIME;
+        txcm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        /* our loop uses the monotonic clock */
+        taioff = 0;
+        if (txtai) {
+            clock_gettime(CLOCK_TAI, &wtime);
+            clock_gettime(CLOCK_MONOTONIC, &wend);
+            taioff = (wtime.tv_sec - wend.tv_sec)*1000000000LL
+                     + wtime.tv_nsec - wend.tv_nsec;
+        }
+        if (verbose)
+            fprintf(stderr, "bufhrt: Queueing %ld datagrams per wakeup.\n", ahead);
+    }
+    wakeups = 0;
+    txmissed = 0;
+    txinvalid = 0;
+    /* per loop trace file */
+    if (tracefile != NULL && interval) {
+        tracefile = NULL;
+        if (verbose)
+            fprintf(stderr, "bufhrt: --trace is not used in interval mode.\n");
+    }
+    if (tracefile != NULL) {
+        if (tracelen <= 0)
+            tracelen = 600*loopspersec;
+        if ((th = trace_open(tracefile, tracelen, nsec, olen)) == NULL) {
+            fprintf(stderr, "bufhrt: Cannot create trace file %s.\n   %s\n",
+                            tracefile, strerror(errno));
+            exit(28);
+        }
+    }
+    /* input from a shared memory ring, we write directly from it */
+    if (usering) {
+      while (shmring_attach(&sring, argv[optind]) < 0) {
+          if (errno != ENOENT) {
+              fprintf(stderr, "bufhrt: Cannot open shared memory ring %s (%s).\n",
+                              argv[optind], strerror(errno));
+              exit(34);
+          }
+          usleep(50000);
+      }
+      if (shmring_join(&sring, SHMRING_BLOCK) < 0) {
+          fprintf(stderr, "bufhrt: Too many readers of ring %s.\n",
+                          argv[optind]);
+          exit(34);
+      }
+      badwrites = 0;
+      badwritebytes = 0;
+      clock_gettime(CLOCK_MONOTONIC, &mtime);
+      getrusage(RUSAGE_SELF, &ru);
+      lcount = 0;
+      off = looperr;
+      while (1) {
+         /* once cache is filled and other side is reading we reset time */
+         if (lcount == 100) {
+           clock_gettime(CLOCK_MONOTONIC, &mtime);
+           getrusage(RUSAGE_SELF, &ru);
+         }
+         c = olen;
+         if (off >= 1.0) {
+            off -= 1.0;
+            c++;
+         }
+         /* waits only if the writer is slower than we */
+         avail = shmring_wait_fill(&sring, c);
+         if (avail < c)
+             c = avail;
+         if (c == 0)
+             break;    /* done */
+         optr = shmring_rptr(&sring);
+         mtime.tv_nsec += nsec;
+         if (mtime.tv_nsec > 999999999) {
+           mtime.tv_nsec -= 1000000000;
+           mtime.tv_sec++;
+         }
+         refreshmem((char*)optr, c);
+         refreshmem((char*)optr, c);
+         refreshmem((char*)optr, c);
+         while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                                            &mtime, NULL)
+                != 0) ;
+         /* write a chunk, this comes first after waking from sleep */
+         if (th)
+             clock_gettime(CLOCK_MONOTONIC, &wstart);
+         if (connfd < 0 &&
+             (connfd = reaccept(listenfd, &gone, dropped, pacing)) >= 0) {
+             totaldropped += dropped;
+             dropped = 0;
+         }
+         while (1) {
+             if (connfd < 0) {
+                 /* no client (live resume), drop the chunk */
+                 s = c;
+                 dropped += s;
+                 break;
+             }
+             s = write(connfd, optr, c);
+             if (s >= 0 || ! reconnect ||
+                 (errno != EPIPE && errno != ECONNRESET))
+                 break;
+             dropclient(connfd, NULL, &gone);
+             reconnects++;
+             connfd = -1;
+             if (! resumelive) {
+                 /* pause input until next client is there */
+                 while ((connfd = reaccept(listenfd, &gone, 0, pacing)) < 0) ;
+                 clock_gettime(CLOCK_MONOTONIC, &mtime);
+             }
+         }
+         if (s < 0) {
+             fprintf(stderr, "bufhrt (from ring): Write error: %s.\n",
+                             strerror(errno));
+             exit(15);
+         }
+         if (s < c) {
+             badwrites++;
+             badwritebytes += (c-s);
+             off += (c-s);
+         }
+         shmring_consume(&sring, s);
+         ocount += s;
+         if (th) {
+             clock_gettime(CLOCK_MONOTONIC, &wend);
+             tr = trace_next(th);
+             tr->loop = lcount;
+             tr->target = mtime.tv_sec*1000000000LL + mtime.tv_nsec;
+             tr->wakeup = wstart.tv_sec*1000000000LL + wstart.tv_nsec;
+             tr->wdur = (wend.tv_sec-wstart.tv_sec)*1000000000
+                        + wend.tv_nsec-wstart.tv_nsec;
+             tr->bytes = s;
+             tr->fill = avail - s;
+             tr->flags = (s < c) ? TRACE_SHORTWRITE : 0;
+         }
+         lcount++;
+         off += looperr;
+         if (autox && connfd >= 0 && lcount > 500 && lcount % ae.every == 0) {
+             nsec = autoextra(&ae, connfd, &mtime, outpersec, loopspersec,
+                              nsec, verbose);
+             if (pacing > 0.0) {
+                 pacing = outpersec + ae.extrabps;
+                 setpacing(connfd, pacing);
+             }
+         }
+      }
+      /* done, the last reader removes the ring */
+      if (shmring_leave(&sring))
+          shmring_unlink(argv[optind]);
+      if (th)
+          trace_close(th);
+      close(connfd);
+      shutdown(listenfd, SHUT_RDWR);
+      close(listenfd);
+      if (verbose) {
+        fprintf(stderr, "bufhrt: Loops: %ld, total bytes: %lld out (from ring).\n"
+                        "bufhrt: bad writes: %ld (%ld bytes)\n",
+                        lcount, ocount, badwrites, badwritebytes);
+        shmmem_faults("bufhrt", &ru);
+      }
+      if (verbose && reconnect)
+        fprintf(stderr, "bufhrt: Reconnects: %ld, dropped bytes: %lld.\n",
+                        reconnects, totaldropped+dropped);
+      if (verbose && autox)
+        fprintf(stderr, "bufhrt: Final extra bytes per second: %.1f "
+                        "(average %.1f).\n", ae.extrabps, ae.avg);
+      return 0;
     }
     /* shared memory input */
     if (shared) {
@@ -520,7 +1759,7 @@ int main(int argc, char *argv[])
                  exit(21);
              }
              /* open shared memory */
-             if ((fd[i-optind] = shm_open(fnames[i-optind],
+             if ((fd[i-optind] = shmmem_open(fnames[i-optind],
                                  O_RDWR, S_IRUSR | S_IWUSR)) == -1){
                  fprintf(stderr, "bufhrt: Cannot open shared memory %s.\n", fnames[i-optind]);
                  exit(22);
@@ -533,8 +1772,8 @@ int main(int argc, char *argv[])
                  size = sb.st_size - sizeof(int);
              }
              /* map the memory (will be on page boundary, so 0 mod 8) */
-             mems[i-optind] = mmap(NULL, sizeof(int)+size,
-                             PROT_WRITE | PROT_READ, MAP_SHARED, fd[i-optind], 0);
+             mems[i-optind] = shmmem_map(fd[i-optind], sizeof(int)+size,
+                                         PROT_WRITE | PROT_READ);
              if (mems[i-optind] == MAP_FAILED) {
                  fprintf(stderr, "bufhrt: Cannot map shared memory.");
                  exit(24);
@@ -542,114 +1781,355 @@ int main(int argc, char *argv[])
          }
       }
       fnames[argc-optind] = NULL;
-      fname = fnames;
-      tmpname = tmpnames;
-      mem = mems;
-      sem = sems;
-      semw = semsw;
+      nseg = argc - optind;
+      if (verbose && nseg*size <= olen)
+          fprintf(stderr, "bufhrt: Shared memory (%d bytes) is too small for "
+                          "output per loop, writing less.\n", nseg*size);
+      /* the segments we hold are hfirst, ..., hnext-1 (cyclically),
+         the first one is consumed up to hoff, avail bytes are left */
+      hfirst = 0;
+      hnext = 0;
+      nheld = 0;
+      hoff = 0;
+      avail = 0;
+      flen = 1;
+      shmfmt.magic = 0;
       clock_gettime(CLOCK_MONOTONIC, &mtime);
+      getrusage(RUSAGE_SELF, &ru);
       lcount = 0;
       off = looperr;
-      i = 0; /* counter to update mtime */
       while (1) {
-         i++;
-         if (*fname == NULL) {
-            fname = fnames;
-            tmpname = tmpnames;
-            mem = mems;
-            sem = sems;
-            semw = semsw;
+         /* once cache is filled and other side is reading we reset time */
+         if (lcount == 100) {
+           clock_gettime(CLOCK_MONOTONIC, &mtime);
+           getrusage(RUSAGE_SELF, &ru);
          }
-         /* get lock */
-         sem_wait(*sem);
-         /* find length of relevant memory chunk */
-         flen = *((int*)(*mem));
-         icount += flen;
-         if (flen == 0) {
-             /* done, unlink semaphores and shared memory */
-             fname = fnames;
-             tmpname = tmpnames;
-             while (*fname != NULL) {
-                 shm_unlink(*fname);
-                 sem_unlink(*fname);
-                 sem_unlink(*tmpname);
-                 fname++;
-                 tmpname++;
+         c = olen;
+         if (off >= 1.0) {
+            off -= 1.0;
+            c++;
+         }
+         /* get locks on further segments until we have a full chunk */
+         while (avail < c && flen != 0 && nheld < nseg) {
+             sem_wait(sems[hnext]);
+             flen = *((int*)(mems[hnext]));
+             segoff[hnext] = sizeof(int);
+             if (flen & STREAM_SEGFMT) {
+                 /* format before the data (writeloop --format/--framed),
+                    we cannot pass on a change of it */
+                 sfmt = (struct streamfmt*)(mems[hnext] + sizeof(int));
+                 flen &= ~STREAM_SEGFMT;
+                 segoff[hnext] += sizeof(struct streamfmt);
+                 if (shmfmt.magic == 0) {
+                     shmfmt = *sfmt;
+                     if (verbose)
+                         fprintf(stderr, "bufhrt: Format %u:%s:%u.\n",
+                                 (unsigned)sfmt->rate,
+                                 stream_fmtname(sfmt->format),
+                                 (unsigned)sfmt->channels);
+                 } else if (sfmt->rate != shmfmt.rate ||
+                            sfmt->format != shmfmt.format ||
+                            sfmt->channels != shmfmt.channels) {
+                     fprintf(stderr, "bufhrt: Format changes in shared "
+                                     "memory input are not supported.\n");
+                     exit(35);
+                 }
              }
-             exit(0);
+             icount += flen;
+             if (flen == 0)
+                 break;   /* end of input */
+             seglen[hnext] = flen;
+             avail += flen;
+             nheld++;
+             hnext = (hnext+1) % nseg;
          }
-         /* write shared memory content to output */
-         ptr = *mem + sizeof(int);
-         sz = 0;
-         if (i == 100)
-           clock_gettime(CLOCK_MONOTONIC, &mtime);
-         while (sz < flen) {
-             mtime.tv_nsec += nsec;
-             if (mtime.tv_nsec > 999999999) {
-               mtime.tv_nsec -= 1000000000;
-               mtime.tv_sec++;
+         if (avail < c)
+             c = avail;
+         if (c == 0)
+             break;    /* done */
+         /* the chunk may be spread over several segments */
+         for (niov = 0, sz = 0, k = hfirst; sz < c; niov++) {
+             iov[niov].iov_base = mems[k] + segoff[k] + (niov ? 0 : hoff);
+             iov[niov].iov_len = seglen[k] - (niov ? 0 : hoff);
+             if (iov[niov].iov_len > c - sz)
+                 iov[niov].iov_len = c - sz;
+             sz += iov[niov].iov_len;
+             k = (k+1) % nseg;
+         }
+         mtime.tv_nsec += nsec;
+         if (mtime.tv_nsec > 999999999) {
+           mtime.tv_nsec -= 1000000000;
+           mtime.tv_sec++;
+         }
+         for (k = 0; k < niov; k++) {
+             refreshmem((char*)iov[k].iov_base, iov[k].iov_len);
+             refreshmem((char*)iov[k].iov_base, iov[k].iov_len);
+             refreshmem((char*)iov[k].iov_base, iov[k].iov_len);
+         }
+         while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                                            &mtime, NULL)
+                != 0) ;
+         /* write a chunk, this comes first after waking from sleep */
+         if (th)
+             clock_gettime(CLOCK_MONOTONIC, &wstart);
+         if (connfd < 0 &&
+             (connfd = reaccept(listenfd, &gone, dropped, pacing)) >= 0) {
+             totaldropped += dropped;
+             dropped = 0;
+         }
+         while (1) {
+             if (connfd < 0) {
+                 /* no client (live resume), drop the chunk */
+                 s = c;
+                 dropped += s;
+                 break;
              }
-             if (flen - sz <= olen) {
-                 c = flen - sz;
-                 off += (olen-c);
-             } else {
-                 c = olen;
-                 if (off >= 1.0) {
-                    off -= 1.0;
-                    c++;
-                 }
+             if (niov == 1)
+                 s = write(connfd, iov[0].iov_base, c);
+             else
+                 s = writev(connfd, iov, niov);
+             if (s >= 0 || ! reconnect ||
+                 (errno != EPIPE && errno != ECONNRESET))
+                 break;
+             dropclient(connfd, NULL, &gone);
+             reconnects++;
+             connfd = -1;
+             if (! resumelive) {
+                 /* pause input until next client is there */
+                 while ((connfd = reaccept(listenfd, &gone, 0, pacing)) < 0) ;
+                 clock_gettime(CLOCK_MONOTONIC, &mtime);
              }
-             refreshmem((char*)ptr, c);
-             refreshmem((char*)ptr, c);
-             refreshmem((char*)ptr, c);
-             while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
-                                                                &mtime, NULL)
-                    != 0) ;
-             /* write a chunk, this comes first after waking from sleep */
-             s = write(connfd, ptr, c);
-             if (s < 0) {
-                 fprintf(stderr, "bufhrt (from shared): Write error: %s.\n",
-                                 strerror(errno));
-                 exit(15);
+         }
+         if (s < 0) {
+             fprintf(stderr, "bufhrt (from shared): Write error: %s.\n",
+                             strerror(errno));
+             exit(15);
+         }
+         if (s < c) {
+             badwrites++;
+             badwritebytes += (c-s);
+             off += (c-s);
+         }
+         ocount += s;
+         avail -= s;
+         /* release the segments which are completely written */
+         for (sz = s; sz > 0; ) {
+             k = seglen[hfirst] - hoff;
+             if (sz < k) {
+                 hoff += sz;
+                 break;
              }
-             if (s < c) {
-                 badwrites++;
-                 badwritebytes += (c-s);
-                 off += (c-s);
+             sz -= k;
+             hoff = 0;
+             /* mark as writable */
+             sem_post(semsw[hfirst]);
+             nheld--;
+             hfirst = (hfirst+1) % nseg;
+         }
+         if (th) {
+             clock_gettime(CLOCK_MONOTONIC, &wend);
+             tr = trace_next(th);
+             tr->loop = lcount;
+             tr->target = mtime.tv_sec*1000000000LL + mtime.tv_nsec;
+             tr->wakeup = wstart.tv_sec*1000000000LL + wstart.tv_nsec;
+             tr->wdur = (wend.tv_sec-wstart.tv_sec)*1000000000
+                        + wend.tv_nsec-wstart.tv_nsec;
+             tr->bytes = s;
+             tr->fill = avail;
+             tr->flags = (s < c) ? TRACE_SHORTWRITE : 0;
+         }
+         lcount++;
+         off += looperr;
+         if (autox && connfd >= 0 && lcount > 500 && lcount % ae.every == 0) {
+             nsec = autoextra(&ae, connfd, &mtime, outpersec, loopspersec,
+                              nsec, verbose);
+             if (pacing > 0.0) {
+                 pacing = outpersec + ae.extrabps;
+                 setpacing(connfd, pacing);
              }
-             ocount += c;
-             ptr += c;
-             sz += c;
-             lcount++;
-             off += looperr;
          }
-         /* mark as writable */
-         sem_post(*semw);
-         fname++;
-         tmpname++;
-         mem++;
-         sem++;
-         semw++;
       }
+      /* done, unlink semaphores and shared memory */
+      fname = fnames;
+      tmpname = tmpnames;
+      while (*fname != NULL) {
+          shmmem_unlink(*fname);
+          sem_unlink(*fname);
+          sem_unlink(*tmpname);
+          fname++;
+          tmpname++;
+      }
+      if (th)
+          trace_close(th);
       close(connfd);
       shutdown(listenfd, SHUT_RDWR);
       close(listenfd);
-      if (verbose)
+      if (verbose) {
         fprintf(stderr, "bufhrt: Loops: %ld, total bytes: %lld in (shared mem) %lld out.\n"
                         "bufhrt: bad writes: %ld (%ld bytes)\n",
                         lcount, icount, ocount, badwrites, badwritebytes);
+        shmmem_faults("bufhrt", &ru);
+      }
+      if (verbose && reconnect)
+        fprintf(stderr, "bufhrt: Reconnects: %ld, dropped bytes: %lld.\n",
+                        reconnects, totaldropped+dropped);
+      if (verbose && autox)
+        fprintf(stderr, "bufhrt: Final extra bytes per second: %.1f "
+                        "(average %.1f).\n", ae.extrabps, ae.avg);
       return 0;
     }
 
+    /* double-buffered interval mode */
+    if (interval && doublebuf) {
+        dbuf.ifd = ifd;
+        dbuf.ilen = ilen;
+        dbuf.len = hlen - (hlen % 8);
+        if (direct)
+            dbuf.len = hlen - (hlen % olen);
+        dbuf.buf[0] = buf;
+        dbuf.buf[1] = buf + dbuf.len;
+        dbuf.icount = 0;
+        for (k = 0; k < 2; k++) {
+            sem_init(&dbuf.empty[k], 0, 1);
+            sem_init(&dbuf.full[k], 0, 0);
+        }
+        if (pthread_create(&dbufthread, NULL, dbufreader, &dbuf) != 0) {
+            fprintf(stderr, "bufhrt: Cannot start reading thread.\n");
+            exit(26);
+        }
+        if (verbose)
+            fprintf(stderr, "bufhrt: Double-buffered interval mode, two buffers "
+                            "of %ld bytes.\n", dbuf.len);
+        count = 0;
+        lcount = 0;
+        badwrites = 0;
+        inwaits = 0;
+        clock_gettime(CLOCK_MONOTONIC, &mtime);
+        getrusage(RUSAGE_SELF, &ru);
+        for (k = 0, off = looperr; 1; k = 1-k) {
+            if (sem_trywait(&dbuf.full[k]) != 0) {
+                /* next buffer not yet filled, wait and restart time */
+                if (count > 0)
+                    inwaits++;
+                sem_wait(&dbuf.full[k]);
+                clock_gettime(CLOCK_MONOTONIC, &mtime);
+            }
+            if (dbuf.fill[k] == 0)
+                break;
+            count++;
+            /* write out buffer k while the reader fills the other one,
+               the timing continues across buffers */
+            optr = dbuf.buf[k];
+            iptr = optr + dbuf.fill[k];
+            wnext = (iptr - optr <= olen) ? (iptr - optr) : olen;
+            for (; optr < iptr; lcount++, off+=looperr) {
+                mtime.tv_nsec += nsec;
+                if (mtime.tv_nsec > 999999999) {
+                  mtime.tv_nsec -= 1000000000;
+                  mtime.tv_sec++;
+                }
+                refreshmem((char*)optr, wnext);
+                refreshmem((char*)optr, wnext);
+                refreshmem((char*)optr, wnext);
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                                                   &mtime, NULL)
+                       != 0) ;
+                /* write a chunk, this comes first after waking from sleep */
+                if (direct)
+                    s = directwrite(connfd, optr, wnext, ocount,
+                                    optr + wnext == iptr &&
+                                    dbuf.fill[k] < dbuf.len,
+                                    align, &odirect, &wl, nsec);
+                else if (shmout)
+                    s = shmout_write(&so, optr, wnext);
+                else
+                    s = write(connfd, optr, wnext);
+                if (s < 0) {
+                    fprintf(stderr, "bufhrt: Write error.\n");
+                    exit(15);
+                }
+                if (s < wnext)
+                    badwrites++;
+                ocount += s;
+                optr += s;
+                wnext = olen + wnext - s;
+                if (off >= 1.0) {
+                   off -= 1.0;
+                   wnext++;
+                }
+                if (wnext >= 2*olen) {
+                   fprintf(stderr, "bufhrt: Underrun by %ld (%ld sec %ld nsec).\n",
+                             wnext - 2*olen, mtime.tv_sec, mtime.tv_nsec);
+                   wnext = 2*olen-1;
+                }
+                s = iptr - optr;
+                if (s <= wnext) {
+                    wnext = s;
+                }
+            }
+            /* give the buffer back to the reader */
+            sem_post(&dbuf.empty[k]);
+        }
+        pthread_join(dbufthread, NULL);
+        if (shmout)
+            shmout_close(&so);
+        if (prealloc)
+            ftruncate(connfd, ocount);
+        close(connfd);
+        shutdown(listenfd, SHUT_RDWR);
+        close(listenfd);
+        close(ifd);
+        if (verbose)
+            fprintf(stderr, "bufhrt: Intervals: %ld, loops: %ld, total bytes: "
+                            "%lld in %lld out.\n"
+                            "bufhrt: Bad writes: %ld, waits for input: %ld.\n",
+                            count, lcount, dbuf.icount, ocount, badwrites,
+                            inwaits);
+        if (verbose)
+            shmmem_faults("bufhrt", &ru);
+        if (verbose && direct && wl.n > 0)
+            fprintf(stderr, "bufhrt: Write latency min/avg/max: %ld/%lld/%ld nsec, "
+                            "%ld of %ld writes longer than a loop.\n",
+                            wl.min, wl.sum/wl.n, wl.max, wl.slow, wl.n);
+        exit(0);
+    }
+
     /* interval mode */
     if (interval) {
        count = 0;
+       foff = 0;
+       getrusage(RUSAGE_SELF, &ru);
        while (moreinput) {
           count++;
-          /* fill buffer */
-          memclean(buf, 2*hlen);
-          for (iptr = buf; iptr < buf + 2*hlen - ilen; ) {
-              s = read(ifd, iptr, ilen);
+          if (mmapin) {
+              /* map next window of input file */
+              if (fsize - foff < win)
+                  win = fsize - foff;
+              if (win == 0)
+                  break;
+              mbuf = mmap(NULL, win, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+                          ifd, foff);
+              if (mbuf == MAP_FAILED) {
+                  fprintf(stderr, "bufhrt: Cannot map input file.\n   %s\n",
+                                  strerror(errno));
+                  exit(27);
+              }
+              madvise(mbuf, win, MADV_SEQUENTIAL);
+              iptr = mbuf + win;
+              foff += win;
+              icount += win;
+              if (foff >= fsize)
+                  moreinput = 0;
+          } else
+          /* fill buffer, clean only the part we read into; with --direct
+             fill exactly a multiple of olen, such that all but the last
+             interval are aligned */
+          for (iptr = buf, max = buf + (direct ? 2*hlen - (2*hlen % olen)
+                                                : 2*hlen - ilen);
+               iptr < max; ) {
+              s = (direct && max - iptr < ilen) ? max - iptr : ilen;
+              memclean(iptr, s);
+              s = read(ifd, iptr, s);
               if (s < 0) {
                   fprintf(stderr, "bufhrt: Read error.\n");
                   exit(18);
@@ -663,7 +2143,7 @@ int main(int argc, char *argv[])
           }
 
           /* write out */
-          optr = buf;
+          optr = mmapin ? mbuf : buf;
           wnext = (iptr - optr <= olen) ? (iptr - optr) : olen;
           clock_gettime(CLOCK_MONOTONIC, &mtime);
           for (lcount=0, off=looperr; optr < iptr; lcount++, off+=looperr) {
@@ -674,14 +2154,31 @@ int main(int argc, char *argv[])
                 mtime.tv_nsec -= 1000000000;
                 mtime.tv_sec++;
               }
-              refreshmem((char*)optr, wnext);
-              refreshmem((char*)optr, wnext);
-              refreshmem((char*)optr, wnext);
+              /* the mapped input is read-only, we copy the chunk into
+                 the (small) buffer and refresh and write it from there */
+              wptr = optr;
+              if (mmapin) {
+                  /* keep the alignment of the file offset for --direct */
+                  wptr = buf;
+                  if (direct)
+                      wptr = buf + ((char*)optr - (char*)mbuf) % align;
+                  memcpy(wptr, optr, wnext);
+              }
+              refreshmem((char*)wptr, wnext);
+              refreshmem((char*)wptr, wnext);
+              refreshmem((char*)wptr, wnext);
               while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
                                                                  &mtime, NULL)
                      != 0) ;
               /* write a chunk, this comes first after waking from sleep */
-              s = write(connfd, optr, wnext);
+              if (direct)
+                  s = directwrite(connfd, wptr, wnext, ocount,
+                                  optr + wnext == iptr && !moreinput,
+                                  align, &odirect, &wl, nsec);
+              else if (shmout)
+                  s = shmout_write(&so, wptr, wnext);
+              else
+                  s = write(connfd, wptr, wnext);
               if (s < 0) {
                   fprintf(stderr, "bufhrt: Write error.\n");
                   exit(15);
@@ -703,22 +2200,35 @@ int main(int argc, char *argv[])
                   wnext = s;
               }
           }
+          if (mmapin)
+              munmap(mbuf, iptr - mbuf);
        }
 
+       if (shmout)
+           shmout_close(&so);
+       if (prealloc)
+           ftruncate(connfd, ocount);
        close(connfd);
        shutdown(listenfd, SHUT_RDWR);
        close(listenfd);
        close(ifd);
-       if (verbose)
+       if (verbose) {
            fprintf(stderr, "bufhrt: Intervals: %ld, total bytes: %lld in %lld out.\n",
                             count, icount, ocount);
+           shmmem_faults("bufhrt", &ru);
+       }
+       if (verbose && direct && wl.n > 0)
+           fprintf(stderr, "bufhrt: Write latency min/avg/max: %ld/%lld/%ld nsec, "
+                           "%ld of %ld writes longer than a loop.\n",
+                           wl.min, wl.sum/wl.n, wl.max, wl.slow, wl.n);
        exit(0);
     }
 
     /* default mode, no shared memory input and no interval mode */
     /* fill at least half buffer */
-    memclean(buf, 2*hlen);
-    for (; iptr < buf + 2*hlen - ilen; ) {
+    while (ringbuf_fill(&rb) < blen - ilen) {
+        iptr = ringbuf_wptr(&rb);
+        memclean(iptr, ilen);
         s = read(ifd, iptr, ilen);
         if (s < 0) {
             fprintf(stderr, "bufhrt: Read error.\n");
@@ -729,10 +2239,10 @@ int main(int argc, char *argv[])
             moreinput = 0;
             break;
         }
-        iptr += s;
+        ringbuf_produce(&rb, s);
     }
-    if (iptr - optr < olen)
-        wnext = iptr-optr;
+    if (ringbuf_fill(&rb) < olen)
+        wnext = ringbuf_fill(&rb);
     else
         wnext = olen;
 
@@ -745,60 +2255,248 @@ int main(int argc, char *argv[])
                                            mtime.tv_sec, mtime.tv_nsec);
         fprintf(stderr,
                 "bufhrt:    insize %ld, outsize %ld, buflen %ld, interval %ld nsec\n",
-                                     ilen, olen, blen+ilen+2*olen, nsec);
+                                     ilen, olen, (long)rb.size, nsec);
+    }
+
+    if (douring && (dosplice || reconnect)) {
+        douring = 0;
+        if (verbose)
+            fprintf(stderr, "bufhrt: Not using io_uring with --splice or --reconnect.\n");
+    }
+    if (douring && uring_init(&ring, 8) < 0) {
+        fprintf(stderr, "bufhrt: Cannot set up io_uring (%s), using system calls.\n",
+                        strerror(errno));
+        douring = 0;
     }
+    rqueued = 0;
+    rres = 0;
 
     /* main loop */
+    getrusage(RUSAGE_SELF, &ru);
+    wmin = 1000000000;
+    wmax = 0;
+    wsum = 0;
     badreads = 0;
     badwrites = 0;
     badreadbytes = 0;
     badwritebytes = 0;
     for (count=1, off=looperr; 1; count++, off+=looperr) {
         /* once cache is filled and other side is reading we reset time */
-        if (count == 500) clock_gettime(CLOCK_MONOTONIC, &mtime);
+        if (count == 500) {
+            clock_gettime(CLOCK_MONOTONIC, &mtime);
+            getrusage(RUSAGE_SELF, &ru);
+        }
         mtime.tv_nsec += nsec;
         if (mtime.tv_nsec > 999999999) {
           mtime.tv_nsec -= 1000000000;
           mtime.tv_sec++;
         }
+        optr = ringbuf_rptr(&rb);
         refreshmem((char*)optr, wnext);
         refreshmem((char*)optr, wnext);
         refreshmem((char*)optr, wnext);
-        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &mtime, NULL)
-               != 0) ;
-        /* write a chunk, this comes first after waking from sleep */
-        s = write(connfd, optr, wnext);
+        if (douring) {
+            /* one system call for sleep, write and read: the write is
+               linked behind a timeout at the wakeup time */
+            uts.tv_sec = mtime.tv_sec;
+            uts.tv_nsec = mtime.tv_nsec;
+            sqe = uring_prep(&ring, IORING_OP_TIMEOUT, -1, &uts, 1, 1);
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->off = 0;
+            sqe->timeout_flags = IORING_TIMEOUT_ABS | IORING_TIMEOUT_ETIME_SUCCESS;
+            uring_prep(&ring, IORING_OP_WRITE, connfd, optr, wnext, 2);
+            upending = 2;
+            /* queue the read if buffer will not be half filled */
+            if (moreinput && ringbuf_fill(&rb) - wnext < hlen) {
+                iptr = ringbuf_wptr(&rb);
+                memclean(iptr, ilen);
+                uring_prep(&ring, IORING_OP_READ, ifd, iptr, ilen, 3);
+                rqueued = 1;
+                upending++;
+            }
+            wstart = mtime;
+            uring_submit(&ring, upending);
+            while (upending > 0) {
+                if (! uring_reap(&ring, &udata, &ures)) {
+                    uring_submit(&ring, 1);
+                    continue;
+                }
+                upending--;
+                if (udata == 2) {
+                    s = ures;
+                    if (verbose || th)
+                        clock_gettime(CLOCK_MONOTONIC, &wend);
+                } else if (udata == 3) {
+                    rres = ures;
+                }
+            }
+            if (s == -ECANCELED) {
+                /* kernel does not support IORING_TIMEOUT_ETIME_SUCCESS */
+                douring = 0;
+                uring_exit(&ring);
+                if (verbose)
+                    fprintf(stderr, "bufhrt: io_uring cannot link write to "
+                                    "timeout, using system calls.\n");
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                                    &mtime, NULL) != 0) ;
+                s = write(connfd, optr, wnext);
+                if (verbose || th)
+                    clock_gettime(CLOCK_MONOTONIC, &wend);
+            } else if (s < 0) {
+                errno = -s;
+                s = -1;
+            }
+        } else if (udphost != NULL) {
+            /* the kernel sends the datagram at time mtime, we wake up
+               one loop before the first of 'ahead' datagrams and queue
+               them */
+            if ((count-1) % ahead == 0) {
+                wtime = mtime;
+                wtime.tv_nsec -= nsec;
+                if (wtime.tv_nsec < 0) {
+                    wtime.tv_nsec += 1000000000;
+                    wtime.tv_sec--;
+                }
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                                       &wtime, NULL) != 0) ;
+                wakeups++;
+                txtimeerrors(connfd, &txmissed, &txinvalid);
+            }
+            if (verbose || th)
+                clock_gettime(CLOCK_MONOTONIC, &wstart);
+            txt = mtime.tv_sec*1000000000ULL + mtime.tv_nsec + taioff;
+            memcpy(CMSG_DATA(txcm), &txt, sizeof(uint64_t));
+            txiov.iov_base = optr;
+            txiov.iov_len = wnext;
+            s = sendmsg(connfd, &txmsg, 0);
+            /* no receiver (yet), the datagram is lost */
+            if (s < 0 && errno == ECONNREFUSED)
+                s = wnext;
+            if (verbose || th)
+                clock_gettime(CLOCK_MONOTONIC, &wend);
+        } else {
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &mtime, NULL)
+                   != 0) ;
+            /* write a chunk, this comes first after waking from sleep */
+            if (verbose || th)
+                clock_gettime(CLOCK_MONOTONIC, &wstart);
+            if (connfd < 0 &&
+                (connfd = reaccept(listenfd, &gone, dropped, pacing)) >= 0) {
+                totaldropped += dropped;
+                dropped = 0;
+            }
+            while (1) {
+                if (shmout) {
+                    s = shmout_write(&so, optr, wnext);
+                    break;
+                }
+                if (connfd < 0) {
+                    /* no client (live resume), drop the chunk */
+                    s = wnext;
+                    dropped += s;
+                    break;
+                }
+                if (dosplice)
+                    s = splicewrite(connfd, splicepipe, optr, wnext);
+                else
+                    s = write(connfd, optr, wnext);
+                if (s < 0 && dosplice && errno == EINVAL && ocount == 0) {
+                    /* output does not take pages after all, use write */
+                    if (splicepipe) {
+                        close(spipe[0]);
+                        close(spipe[1]);
+                    }
+                    dosplice = 0;
+                    if (verbose)
+                        fprintf(stderr, "bufhrt: Cannot splice to output, using write.\n");
+                    s = write(connfd, optr, wnext);
+                }
+                if (s >= 0 || ! reconnect ||
+                    (errno != EPIPE && errno != ECONNRESET))
+                    break;
+                dropclient(connfd, dosplice ? splicepipe : NULL, &gone);
+                reconnects++;
+                connfd = -1;
+                if (! resumelive) {
+                    /* pause input until next client is there */
+                    while ((connfd = reaccept(listenfd, &gone, 0, pacing)) < 0) ;
+                    clock_gettime(CLOCK_MONOTONIC, &mtime);
+                }
+            }
+            if (verbose || th)
+                clock_gettime(CLOCK_MONOTONIC, &wend);
+        }
         if (s < 0) {
             fprintf(stderr, "bufhrt: Write error.\n");
             exit(15);
         }
+        if (verbose || th) {
+            /* statistics of the time spent in writing (with io_uring
+               the delay of completion after wakeup time) */
+            wdur = (wend.tv_sec-wstart.tv_sec)*1000000000
+                   + wend.tv_nsec-wstart.tv_nsec;
+            wsum += wdur;
+            if (wdur < wmin) wmin = wdur;
+            if (wdur > wmax) wmax = wdur;
+        }
+        tflags = 0;
         if (s < wnext) {
             badwrites++;
             badwritebytes += (wnext-s);
+            tflags |= TRACE_SHORTWRITE;
+        }
+        if (autox && connfd >= 0 && count > 500 && count % ae.every == 0) {
+            nsec = autoextra(&ae, connfd, &mtime, outpersec, loopspersec,
+                             nsec, verbose);
+            if (pacing > 0.0) {
+                pacing = outpersec + ae.extrabps;
+                setpacing(connfd, pacing);
+            }
         }
         ocount += s;
-        optr += s;
+        ringbuf_consume(&rb, s);
         wnext = olen + wnext - s;
         if (off >= 1.0) {
            off -= 1.0;
            wnext++;
         }
         if (wnext >= 2*olen) {
-           fprintf(stderr, "bufhrt: Underrun by %ld (%ld sec %ld nsec).\n",
-                     wnext - 2*olen, mtime.tv_sec, mtime.tv_nsec);
+           if (th)
+               tflags |= TRACE_UNDERRUN;
+           else
+               fprintf(stderr, "bufhrt: Underrun by %ld (%ld sec %ld nsec).\n",
+                       wnext - 2*olen, mtime.tv_sec, mtime.tv_nsec);
            wnext = 2*olen-1;
         }
-        s = (iptr >= optr ? iptr - optr : iptr+blen-optr);
+        if (th) {
+            tr = trace_next(th);
+            tr->loop = count;
+            tr->target = mtime.tv_sec*1000000000LL + mtime.tv_nsec;
+            /* with io_uring we only know when the write completed */
+            if (douring)
+                tr->wakeup = wend.tv_sec*1000000000LL + wend.tv_nsec;
+            else
+                tr->wakeup = wstart.tv_sec*1000000000LL + wstart.tv_nsec;
+            tr->wdur = wdur;
+            tr->bytes = s;
+            tr->fill = ringbuf_fill(&rb);
+            tr->flags = tflags;
+        }
+        s = ringbuf_fill(&rb);
         if (s <= wnext) {
             wnext = s;
         }
-        if (optr+wnext >= max) {
-            optr -= blen;
-        }
         /* read if buffer not half filled */
-        if (moreinput && (iptr > optr ? iptr-optr : iptr+blen-optr) < hlen) {
-            memclean(iptr, ilen);
-            s = read(ifd, iptr, ilen);
+        if (rqueued || (moreinput && ringbuf_fill(&rb) < hlen)) {
+            if (rqueued) {
+                /* already done in the io_uring */
+                s = rres;
+                rqueued = 0;
+            } else {
+                iptr = ringbuf_wptr(&rb);
+                memclean(iptr, ilen);
+                s = read(ifd, iptr, ilen);
+            }
             if (s < 0) {
                 fprintf(stderr, "bufhrt: Read error.\n");
                 exit(16);
@@ -806,13 +2504,11 @@ int main(int argc, char *argv[])
             if (s < ilen) {
                 badreads++;
                 badreadbytes += (ilen-s);
+                if (th)
+                    tr->flags |= TRACE_SHORTREAD;
             }
             icount += s;
-            iptr += s;
-            if (iptr >= max) {
-                memcpy(buf-2*olen, max-2*olen, iptr-max+2*olen);
-                iptr -= blen;
-            }
+            ringbuf_produce(&rb, s);
             if (s == 0) { /* input complete */
                 moreinput = 0;
             }
@@ -820,6 +2516,21 @@ int main(int argc, char *argv[])
         if (wnext == 0)
             break;    /* done */
     }
+    if (shmout)
+        shmout_close(&so);
+    if (udphost != NULL) {
+        /* wait until the last queued datagram is due, plus one interval,
+           and collect its error report before the socket is closed */
+        wtime = mtime;
+        wtime.tv_nsec += nsec;
+        if (wtime.tv_nsec > 999999999) {
+            wtime.tv_nsec -= 1000000000;
+            wtime.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                               &wtime, NULL) != 0) ;
+        txtimeerrors(connfd, &txmissed, &txinvalid);
+    }
     close(connfd);
     shutdown(listenfd, SHUT_RDWR);
     close(listenfd);
@@ -829,6 +2540,29 @@ int main(int argc, char *argv[])
                         "bufhrt: Bad reads/bytes %ld/%ld and writes/bytes %ld/%ld.\n",
                         count, icount, ocount, badreads, badreadbytes,
                         badwrites, badwritebytes);
+    if (verbose)
+        shmmem_faults("bufhrt", &ru);
+    if (verbose && douring)
+        fprintf(stderr, "bufhrt: Write completion after wakeup time "
+                        "min/avg/max: %ld/%lld/%ld nsec.\n",
+                        wmin, wsum/count, wmax);
+    else if (verbose)
+        fprintf(stderr, "bufhrt: Write duration min/avg/max: %ld/%lld/%ld nsec.\n",
+                        wmin, wsum/count, wmax);
+    if (verbose && reconnect)
+        fprintf(stderr, "bufhrt: Reconnects: %ld, dropped bytes: %lld.\n",
+                        reconnects, totaldropped+dropped);
+    if (verbose && autox)
+        fprintf(stderr, "bufhrt: Final extra bytes per second: %.1f "
+                        "(average %.1f).\n", ae.extrabps, ae.avg);
+    if (udphost != NULL) {
+        if (verbose || txmissed || txinvalid)
+            fprintf(stderr, "bufhrt: Datagrams: %ld, wakeups: %ld (%ld saved), "
+                            "missed send times: %ld, invalid: %ld.\n",
+                            count, wakeups, count-wakeups, txmissed, txinvalid);
+    }
+    if (th)
+        trace_close(th);
     return 0;
 }
 
@@ -19,6 +19,12 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 #include <semaphore.h>
 #include <errno.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include "shmring.h"
+#include "dirwatch.h"
+#include "stream.h"
+#include "shmmem.h"
 
 /* help page */
 /* vim hint to remove resp. add quotes:
@@ -35,6 +41,8 @@ void usage( ) {
 "\n"
 "  This program 'catloop' reads data cyclically from files <file1>, ... \n"
 "  and writes the content to stdout. \n"
+"  It waits until 'writeloop' has renamed the next file into place (the\n"
+"  directories are watched with inotify) and deletes it after reading.\n"
 "\n"
 "  USAGE HINTS\n"
 "  \n"
@@ -59,8 +67,58 @@ void usage( ) {
 "      memory you may need to enlarge '/proc/sys/kernel/shmmax' directly or\n"
 "      via sysctl.\n"
 "\n"
+"  --hugetlbfs=dir, -J dir\n"
+"      (with --shared) the segments are files in this directory on a\n"
+"      hugetlbfs mount, as given to 'writeloop'.\n"
+"\n"
+"  --huge-pages, -Q\n"
+"      (with --shared) ask for transparent huge pages for the segments.\n"
+"\n"
+"  --lock-memory, -E\n"
+"      (with --shared) lock the segments in memory (see 'ulimit -l').\n"
+"\n"
+"  --populate, -y\n"
+"      (with --shared) prefault the segments when they are mapped. With\n"
+"      --verbose the page faults during operation are shown at the end.\n"
+"\n"
+"  --framed, -M\n"
+"      with --shared, write a framed stream: each segment becomes a frame\n"
+"      and a format given by 'writeloop --format' or '--framed' is passed\n"
+"      on, so that 'volrace', 'resample_soxr' and 'playhrt' with their\n"
+"      --framed option follow changes of the format. Without this option\n"
+"      formats are removed from the stream.\n"
+"\n"
+"  --splice, -z\n"
+"      with --shared and stdout a pipe, the pages of the shared memory\n"
+"      are passed to the pipe by reference (vmsplice) instead of copying\n"
+"      the data. This is only done when the pipe is empty, otherwise the\n"
+"      segment is copied and given back to 'writeloop' at once, as\n"
+"      without this option. A spliced segment is given back when the\n"
+"      reader of the pipe has read past it or a pipe full of data was\n"
+"      written after it, so the reader must copy the data out of the pipe\n"
+"      (not splice them on). Only if the segment is needed again before\n"
+"      that, the program waits in short sleeps. The pipe is enlarged to\n"
+"      hold all but one segment if possible.\n"
+"\n"
+"  --ring, -r\n"
+"      read from a single ring buffer in shared memory written by\n"
+"      'writeloop --ring', give exactly one name. If the ring does not\n"
+"      exist yet, catloop waits for it.\n"
+"\n"
+"  --drop, -d\n"
+"      with --ring written by 'writeloop --readers=...', do not make the\n"
+"      writer wait for us: if catloop falls a whole ring behind, it\n"
+"      continues with the newest data (the dropped data are missing in\n"
+"      the output, the moment of the drop may contain garbage). Without\n"
+"      this option the writer waits for catloop.\n"
+"\n"
+"  --busy-poll=intval, -p intval\n"
+"      with --ring, poll the ring up to intval times before sleeping\n"
+"      when it is empty (default 0).\n"
+"\n"
 "  --verbose, -v\n"
-"    print some information during startup.\n"
+"    print some information during startup. When reading from files\n"
+"    print for each file how long catloop had to wait for it.\n"
 "\n"
 "  --version, -V\n"
 "      print information about the version of the program and abort.\n"
@@ -100,6 +158,27 @@ void usage( ) {
 }
 
 
+/* with --splice: gives back the segments whose pages have left the
+   pipe, because they were read or a pipe full of data (psz bytes) was
+   written after them; spliced counts all bytes put into the pipe,
+   segend[k] is this count at the end of segment k, or -1 if k is not
+   held; returns the number of unread bytes in the pipe */
+int releasesegs(sem_t **semsw, long long *segend, int n, long long spliced,
+                int psz)
+{
+    int unread, k;
+
+    if (ioctl(1, FIONREAD, &unread) < 0)
+        unread = psz;
+    for (k = 0; k < n; k++)
+        if (segend[k] >= 0 && (segend[k] <= spliced - unread ||
+                               spliced - segend[k] >= psz)) {
+            sem_post(semsw[k]);
+            segend[k] = -1;
+        }
+    return unread;
+}
+
 int main(int argc, char *argv[])
 {
     char **fname, *fnames[100], **tmpname, *tmpnames[100], **mem, *mems[100],
@@ -109,12 +188,32 @@ int main(int argc, char *argv[])
     int optc, infile, fd[100], i, blocksize, size, flen, sz, 
         ret, shared, c, verbose;
     struct stat sb;
-
+    struct shmring ring;
+    int usering, dosplice, nseg, k, policy, psz, unread;
+    long spin;
+    long long spliced, segend[100];
+    struct iovec iov;
+    struct dirwatch dw;
+    long long waited;
+    struct streamfmt *sfmt;
+    int framed, hdrlen;
+    char *hugedir;
+    int memflags;
+    struct rusage ru;
 
     /* read command line options */
     static struct option longoptions[] = {
         {"block-size", required_argument, 0,  'b' },
         {"shared", no_argument, 0, 's' },
+        {"splice", no_argument, 0, 'z' },
+        {"framed", no_argument, 0, 'M' },
+        {"ring", no_argument, 0, 'r' },
+        {"busy-poll", required_argument, 0, 'p' },
+        {"drop", no_argument, 0, 'd' },
+        {"hugetlbfs", required_argument, 0, 'J' },
+        {"huge-pages", no_argument, 0, 'Q' },
+        {"lock-memory", no_argument, 0, 'E' },
+        {"populate", no_argument, 0, 'y' },
         {"verbose", no_argument, 0, 'v' },
         {"version", no_argument, 0, 'V' },
         {"help", no_argument, 0, 'h' },
@@ -130,6 +229,13 @@ int main(int argc, char *argv[])
     shared = 0;
     verbose = 0;
     size = 0;
+    usering = 0;
+    policy = SHMRING_BLOCK;
+    dosplice = 0;
+    framed = 0;
+    hugedir = NULL;
+    memflags = 0;
+    spin = 0;
     while ((optc = getopt_long(argc, argv, "b:Vh",
             longoptions, &optind)) != -1) {
         switch (optc) {
@@ -139,6 +245,33 @@ int main(int argc, char *argv[])
         case 's':
           shared = 1;
           break;
+        case 'z':
+          dosplice = 1;
+          break;
+        case 'M':
+          framed = 1;
+          break;
+        case 'r':
+          usering = 1;
+          break;
+        case 'd':
+          policy = SHMRING_DROP;
+          break;
+        case 'p':
+          spin = atol(optarg);
+          break;
+        case 'J':
+          hugedir = optarg;
+          break;
+        case 'Q':
+          memflags |= SHMMEM_THP;
+          break;
+        case 'E':
+          memflags |= SHMMEM_LOCK;
+          break;
+        case 'y':
+          memflags |= SHMMEM_POPULATE;
+          break;
         case 'v':
           verbose = 1;
           break;
@@ -162,6 +295,48 @@ int main(int argc, char *argv[])
        fprintf(stderr, "catloop: Cannot allocate buffer.\n");
        exit(4);
     }
+    if (usering) {
+        if (argc-optind != 1) {
+            fprintf(stderr, "catloop: Specify one name with --ring.\n");
+            exit(3);
+        }
+        while (shmring_attach(&ring, argv[optind]) < 0) {
+            if (errno != ENOENT) {
+                fprintf(stderr, "catloop: Cannot open shared memory ring %s "
+                                "(%s).\n", argv[optind], strerror(errno));
+                exit(25);
+            }
+            usleep(50000);
+        }
+        if (shmring_join(&ring, policy) < 0) {
+            fprintf(stderr, "catloop: Too many readers of ring %s.\n",
+                            argv[optind]);
+            exit(26);
+        }
+        ring.spin = spin;
+        /* like with segments we wake up for a quarter of the ring */
+        ring.batch = ring.size/4;
+        if (verbose)
+            fprintf(stderr, "catloop: Reading from shared memory ring of "
+                            "%ld bytes.\n", (long)ring.size);
+        while ((flen = shmring_wait_fill(&ring, 1)) > 0) {
+            c = flen < blocksize ? flen : blocksize;
+            ret = write(1, shmring_rptr(&ring), c);
+            if (ret == -1) {
+                fprintf(stderr, "catloop: Write error: %s.\n", strerror(errno));
+                exit(31);
+            }
+            shmring_consume(&ring, ret);
+        }
+        if (verbose && ring.drops > 0)
+            fprintf(stderr, "catloop: Dropped %ld times.\n", ring.drops);
+        /* done, the last reader removes the ring */
+        if (shmring_leave(&ring))
+            shmring_unlink(argv[optind]);
+        exit(0);
+    }
+    if (shared)
+        shmmem_config(hugedir, memflags);
     for (i=optind; i < argc; i++) {
        if (i>100) {
           fprintf(stderr, "catloop: Too many filenames.\n");
@@ -185,7 +360,7 @@ int main(int argc, char *argv[])
                exit(21);
            }
            /* open shared memory */
-           if ((fd[i-optind] = shm_open(fnames[i-optind],
+           if ((fd[i-optind] = shmmem_open(fnames[i-optind],
                                O_RDONLY, S_IRUSR | S_IWUSR)) == -1){
                fprintf(stderr, "catloop: Cannot open shared memory %s.\n", fnames[i-optind]);
                exit(22);
@@ -198,8 +373,8 @@ int main(int argc, char *argv[])
                size = sb.st_size - sizeof(int);
            }
            /* map the memory */
-           mems[i-optind] = mmap(NULL, sizeof(int)+size,
-                           PROT_READ, MAP_SHARED, fd[i-optind], 0);
+           mems[i-optind] = shmmem_map(fd[i-optind], sizeof(int)+size,
+                                       PROT_READ);
            if (mems[i-optind] == MAP_FAILED) {
                fprintf(stderr, "catloop: Cannot map shared memory.");
                exit(24);
@@ -211,10 +386,29 @@ int main(int argc, char *argv[])
     if (shared) {
         if (verbose)
           fprintf(stderr, "catloop: Reading from shared memory.\n"); 
+        nseg = argc - optind;
+        if (dosplice && (fstat(1, &sb) == -1 || !S_ISFIFO(sb.st_mode))) {
+            dosplice = 0;
+            if (verbose)
+                fprintf(stderr, "catloop: Output is not a pipe, not using "
+                                "--splice.\n");
+        }
+        if (dosplice) {
+            /* room for all but one segment (plus partial pages) */
+            fcntl(1, F_SETPIPE_SZ, (nseg-1)*(size+2*getpagesize()));
+            psz = fcntl(1, F_GETPIPE_SZ);
+            if (verbose)
+                fprintf(stderr, "catloop: Splicing to pipe of %d bytes.\n",
+                                psz);
+            for (k = 0; k < nseg; k++)
+                segend[k] = -1;
+            spliced = 0;
+        }
         tmpname = tmpnames;
         mem = mems;
         sem = sems;
         semw = semsw;
+        getrusage(RUSAGE_SELF, &ru);
         while (1) {
            if (*fname == NULL) {
               fname = fnames;
@@ -223,6 +417,16 @@ int main(int argc, char *argv[])
               sem = sems;
               semw = semsw;
            }
+           /* with --splice the writer needs this segment back first; as
+              segments are only spliced into an empty pipe and copied
+              otherwise, this waits only if the segments after it were
+              short */
+           k = fname - fnames;
+           while (dosplice && segend[k] >= 0) {
+               releasesegs(semsw, segend, nseg, spliced, psz);
+               if (segend[k] >= 0)
+                   usleep(1000);
+           }
            /* get lock */
            sem_wait(*sem);
            /* find length of relevant memory chunk */
@@ -232,16 +436,63 @@ int main(int argc, char *argv[])
                fname = fnames;
                tmpname = tmpnames;
                while (*fname != NULL) {
-                   shm_unlink(*fname);
+                   shmmem_unlink(*fname);
                    sem_unlink(*fname);
                    sem_unlink(*tmpname);
                    fname++;
                    tmpname++;
                }
+               if (verbose)
+                   shmmem_faults("catloop", &ru);
                exit(0);
            }
-           /* write shared memory content to stdout */
            ptr = *mem + sizeof(int);
+           sfmt = NULL;
+           if (flen & STREAM_SEGFMT) {
+               /* a new format before the data */
+               sfmt = (struct streamfmt*)ptr;
+               ptr += sizeof(struct streamfmt);
+               flen &= ~STREAM_SEGFMT;
+               if (verbose)
+                   fprintf(stderr, "catloop: Format %u:%s:%u.\n",
+                           (unsigned)sfmt->rate,
+                           stream_fmtname(sfmt->format),
+                           (unsigned)sfmt->channels);
+           }
+           /* with --splice check if the pipe is empty before anything
+              of this segment goes in */
+           unread = 0;
+           if (dosplice)
+               unread = releasesegs(semsw, segend, nseg, spliced, psz);
+           hdrlen = 0;
+           if (framed && (hdrlen = stream_writehdr(1, sfmt, flen)) < 0) {
+               fprintf(stderr, "catloop: Write error: %s.\n", strerror(errno));
+               exit(31);
+           }
+           if (dosplice && unread == 0) {
+               /* pass the pages to the empty pipe, keep the segment */
+               iov.iov_base = ptr;
+               iov.iov_len = flen;
+               while (iov.iov_len > 0) {
+                   ret = vmsplice(1, &iov, 1, 0);
+                   if (ret == -1) {
+                      fprintf(stderr, "catloop: vmsplice error: %s.\n",
+                                      strerror(errno));
+                      exit(33);
+                   }
+                   iov.iov_base = (char*)iov.iov_base + ret;
+                   iov.iov_len -= ret;
+               }
+               spliced += hdrlen + flen;
+               segend[k] = spliced;
+               fname++;
+               tmpname++;
+               mem++;
+               sem++;
+               semw++;
+               continue;
+           }
+           /* write shared memory content to stdout */
            sz = 0;
            while (sz < flen) {
                if (flen - sz <= blocksize)
@@ -260,6 +511,8 @@ int main(int argc, char *argv[])
                ptr += c;
                sz += c;
            }
+           if (dosplice)
+               spliced += hdrlen + flen;
            /* mark as writable */
            sem_post(*semw);
            fname++;
@@ -271,11 +524,16 @@ int main(int argc, char *argv[])
     } else {
         if (verbose)
            fprintf(stderr, "catloop: Reading from files.\n"); 
+        /* wake up when writeloop renames a finished file */
+        if (dirwatch_init(&dw, fnames, IN_MOVED_TO, 500) < 0 && verbose)
+           fprintf(stderr, "catloop: Cannot use inotify, polling.\n");
         while (1) {
            if (*fname == NULL)
               fname = fnames;
-           while (access(*fname, R_OK) != 0)
-             usleep(500);
+           waited = dirwatch_wait(&dw, *fname, 1);
+           if (verbose)
+             fprintf(stderr, "catloop: Waited %lld usec for %s.\n",
+                             waited/1000, *fname);
            infile = open(*fname, O_RDONLY|O_NOATIME);
            if (!infile) {
               fprintf(stderr, "catloop: Cannot open for reading: %s.\n", *fname);
@@ -11,7 +11,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include "cprefresh.h"
+#include "shmload.h"
+#include "shmmem.h"
 
 /* help page */
 /* vim hint to remove resp. add quotes:
@@ -54,8 +57,37 @@ void usage( ) {
 "      If input is stdin then this  option must be given but may be\n"
 "      larger than the actual input.\n"
 "\n"
+"  --threads=intval, -t intval\n"
+"      use the fast path: the input is read directly into the shared\n"
+"      memory, without clearing it and without an intermediate buffer.\n"
+"      If the input is a file this many threads read separate parts of\n"
+"      it in parallel (with 'pread'), with stdin one thread is used.\n"
+"      The default is 0, which means the classic copy via a buffer.\n"
+"\n"
+"  --sendfile, -s\n"
+"      another fast path for input files: the kernel copies the file\n"
+"      into the shared memory (with 'sendfile') without mapping it\n"
+"      into this program.\n"
+"\n"
+"  --no-refresh, -R\n"
+"      with a fast path, do not refresh the memory after loading it\n"
+"      (which costs a second pass over the data).\n"
+"\n"
+"  --progress, -P\n"
+"      publish how much is loaded in a small companion shared memory\n"
+"      area <shmname>.LOAD, such that 'shmcat --stream' can start output\n"
+"      after the first block (of --buffer-size bytes) is loaded.\n"
+"\n"
+"  --huge-pages, -Q\n"
+"      ask for transparent huge pages for the shared memory (this needs\n"
+"      'advise' in /sys/kernel/mm/transparent_hugepage/shmem_enabled).\n"
+"\n"
+"  --populate, -y\n"
+"      allocate all pages of the shared memory at once when it is mapped.\n"
+"\n"
 "  --verbose, -v\n"
-"      print some information during startup and operation.\n"
+"      print some information during startup and operation, and the\n"
+"      load time and rate at the end.\n"
 "\n"
 "  --version, -V\n"
 "      print information about the version of the program and abort.\n"
@@ -71,6 +103,15 @@ void usage( ) {
 "  cptoshm --file=mymusic.flac --shmname=/play.flac\n"
 "\n"
 "  shmcat --shmname=/play.flac | ...\n"
+"\n"
+"  Load a large file quickly, with four threads reading in parallel.\n"
+"\n"
+"  cptoshm --threads=4 --verbose --file=mymusic.wav --shmname=/play.wav\n"
+"\n"
+"  Start playing while the file is still loaded.\n"
+"\n"
+"  cptoshm --progress --file=mymusic.flac --shmname=/play.flac &\n"
+"  shmcat --stream --shmname=/play.flac | ...\n"
 "\n"
   );
 }
@@ -78,9 +119,13 @@ void usage( ) {
 int main(int argc, char *argv[])
 {
     char *infile, *memname;
-    int ifd, fd, bufsize, optc, verbose;
+    int ifd, fd, bufsize, optc, verbose, nthreads, usesend, refresh, progress;
+    int memflags;
+    struct shmload_progress *prog;
     size_t length, done, rlen;
     struct stat sb;
+    struct timespec tstart, tend;
+    double sec;
     char *buf, *mem, *ptr;
 
     /* read command line options */
@@ -90,6 +135,12 @@ int main(int argc, char *argv[])
         {"buffer-size", required_argument, 0,  'b' },
         {"max-input", required_argument, 0, 'm' },
         {"overwrite", required_argument, 0, 'O' }, /* ignored */
+        {"threads", required_argument, 0, 't' },
+        {"sendfile", no_argument, 0, 's' },
+        {"no-refresh", no_argument, 0, 'R' },
+        {"progress", no_argument, 0, 'P' },
+        {"huge-pages", no_argument, 0, 'Q' },
+        {"populate", no_argument, 0, 'y' },
         {"verbose", no_argument, 0, 'v' },
         {"version", no_argument, 0, 'V' },
         {"help", no_argument, 0, 'h' },
@@ -107,7 +158,13 @@ int main(int argc, char *argv[])
     length = 0;
     verbose = 0;
     infile = NULL;
-    while ((optc = getopt_long(argc, argv, "i:o:b:m:O:vVh",
+    nthreads = 0;
+    usesend = 0;
+    refresh = 1;
+    progress = 0;
+    prog = NULL;
+    memflags = 0;
+    while ((optc = getopt_long(argc, argv, "i:o:b:m:O:t:sRPQyvVh",
             longoptions, &optind)) != -1) {
         switch (optc) {
         case 'i':
@@ -140,6 +197,28 @@ int main(int argc, char *argv[])
           break;
         case 'O':
           break;
+        case 't':
+          nthreads = atoi(optarg);
+          if (nthreads < 0 || nthreads > 64) {
+              fprintf(stderr, "cptoshm: Number of threads must be in 0..64.\n");
+              exit(10);
+          }
+          break;
+        case 's':
+          usesend = 1;
+          break;
+        case 'R':
+          refresh = 0;
+          break;
+        case 'P':
+          progress = 1;
+          break;
+        case 'Q':
+          memflags |= SHMMEM_THP;
+          break;
+        case 'y':
+          memflags |= SHMMEM_POPULATE;
+          break;
         case 'v':
           verbose = 1;
           break;
@@ -161,42 +240,80 @@ int main(int argc, char *argv[])
                 "cptoshm: input from %s, shared mem is %s, max length %ld\n",
                 infile, memname, (long)length);
     }
-    if (! (buf = malloc(bufsize)) ) {
-        fprintf(stderr, "cptoshm: Cannot allocate buffer of length %ld.\n",
-                        (long)bufsize);
-        exit(1);
+    shmmem_config(NULL, memflags);
+    if (usesend && ifd == 0) {
+        fprintf(stderr, "cptoshm: --sendfile needs an input file.\n");
+        exit(10);
+    }
+    /* readers check for the progress object before the length */
+    if (progress && (prog = shmload_progress(memname, 1, length)) == NULL) {
+        fprintf(stderr, "cptoshm: Cannot create progress object.\n");
+        exit(11);
     }
     if (ftruncate(fd, length) == -1) {
         fprintf(stderr, "cptoshm: Cannot truncate shared memory to %ld.", (long)length);
         exit(5);
     }
-    mem = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (mem == MAP_FAILED) {
-        fprintf(stderr, "cptoshm: Cannot map shared memory.\n");
-        exit(6);
-    }
-    /* clear memory */
-    if (verbose) {
-        fprintf(stderr, "cptoshm: clearing memory ... ");
-        fflush(stderr);
+    clock_gettime(CLOCK_MONOTONIC, &tstart);
+    if (usesend) {
+        done = shmload_send(ifd, fd, length, bufsize, prog);
+        if (refresh && done > 0) {
+            mem = shmmem_map(fd, done, PROT_READ | PROT_WRITE);
+            if (mem == MAP_FAILED) {
+                fprintf(stderr, "cptoshm: Cannot map shared memory.\n");
+                exit(6);
+            }
+            refreshmem(mem, done);
+        }
+    } else {
+        mem = shmmem_map(fd, length, PROT_READ | PROT_WRITE);
+        if (mem == MAP_FAILED) {
+            fprintf(stderr, "cptoshm: Cannot map shared memory.\n");
+            exit(6);
+        }
     }
-    memclean(mem, length);
-    if (verbose)
-        fprintf(stderr, "cptoshm: done\n");
-    /* copy data */
-    ptr = mem;
-    done = 0;
-    while (done < length) {
-        memclean(buf, bufsize);
-        rlen = read(ifd, buf, bufsize);
-        rlen = (done+rlen > length)? length-done:rlen;
-        if (rlen == 0) break;
-        memclean(ptr, rlen);
-        memcpy(ptr, buf, rlen);
-        refreshmem(ptr, rlen);
-        done += rlen;
-        ptr += rlen;
+    if (nthreads > 0 && ! usesend) {
+        done = shmload_read(ifd, ifd != 0, mem, length, nthreads, bufsize,
+                            refresh, prog);
+        if (done == (size_t)-1) {
+            fprintf(stderr, "cptoshm: Cannot start threads.\n");
+            exit(9);
+        }
+    } else if (! usesend) {
+        if (! (buf = malloc(bufsize)) ) {
+            fprintf(stderr, "cptoshm: Cannot allocate buffer of length %ld.\n",
+                            (long)bufsize);
+            exit(1);
+        }
+        /* clear memory (not when a reader may be waiting for the
+           first block) */
+        if (! prog) {
+            if (verbose) {
+                fprintf(stderr, "cptoshm: clearing memory ... ");
+                fflush(stderr);
+            }
+            memclean(mem, length);
+            if (verbose)
+                fprintf(stderr, "cptoshm: done\n");
+        }
+        /* copy data */
+        ptr = mem;
+        done = 0;
+        while (done < length) {
+            memclean(buf, bufsize);
+            rlen = read(ifd, buf, bufsize);
+            rlen = (done+rlen > length)? length-done:rlen;
+            if (rlen == 0) break;
+            memclean(ptr, rlen);
+            memcpy(ptr, buf, rlen);
+            refreshmem(ptr, rlen);
+            done += rlen;
+            ptr += rlen;
+            if (prog)
+                shmload_advance(prog, done);
+        }
     }
+    clock_gettime(CLOCK_MONOTONIC, &tend);
     if (done < length) {
       if (ftruncate(fd, done) == -1) {
           fprintf(stderr, "cptoshm: Cannot truncate shared memory to true length %ld.",
@@ -204,7 +321,12 @@ int main(int argc, char *argv[])
           exit(7);
       }
     }
-    if (verbose)
-        fprintf(stderr, "cptoshm: Copied %ld bytes.\n", (long)done);
+    if (prog)
+        shmload_complete(prog, done);
+    if (verbose) {
+        sec = (tend.tv_sec-tstart.tv_sec) + (tend.tv_nsec-tstart.tv_nsec)*1e-9;
+        fprintf(stderr, "cptoshm: Copied %ld bytes in %.3f sec (%.1f MB/sec).\n",
+                (long)done, sec, sec > 0.0 ? done/sec/1000000.0 : 0.0);
+    }
     exit(0);
 }
@@ -0,0 +1,82 @@
+/*
+dirwatch.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Waiting for files with inotify, see dirwatch.h.
+
+All watches are added at the start, so events which happen while we
+are not waiting are queued and the next wait returns immediately; after
+each wakeup the file is checked again.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "dirwatch.h"
+
+/* watches the directories of the NULL terminated list of names for the
+   events in mask, returns 0 on success, otherwise -1 and the following
+   waits will poll */
+int dirwatch_init(struct dirwatch *w, char **names, uint32_t mask,
+                  long pollusec)
+{
+    char *dir, *p;
+
+    w->pollusec = pollusec;
+    if ((w->fd = inotify_init1(IN_CLOEXEC)) < 0)
+        return -1;
+    for (; *names != NULL; names++) {
+        dir = strdup(*names);
+        if (dir == NULL)
+            break;
+        if ((p = strrchr(dir, '/')) == NULL)
+            strcpy(dir, ".");
+        else if (p == dir)
+            p[1] = '\0';
+        else
+            *p = '\0';
+        /* the same directory yields the same watch again */
+        if (inotify_add_watch(w->fd, dir, mask) < 0) {
+            free(dir);
+            break;
+        }
+        free(dir);
+    }
+    if (*names != NULL) {
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/* waits until file name exists (exists != 0) resp. does not exist,
+   returns the time waited in nanoseconds */
+long long dirwatch_wait(struct dirwatch *w, char *name, int exists)
+{
+    struct timespec t0, t1;
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while ((access(name, R_OK) == 0) != (exists != 0)) {
+        /* any event may be the one we wait for, they are just discarded */
+        if (w->fd < 0 || read(w->fd, buf, sizeof(buf)) <= 0)
+            usleep(w->pollusec);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec-t0.tv_sec)*1000000000LL + (t1.tv_nsec-t0.tv_nsec);
+}
+
+void dirwatch_close(struct dirwatch *w)
+{
+    if (w->fd >= 0)
+        close(w->fd);
+    w->fd = -1;
+}
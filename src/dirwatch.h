@@ -0,0 +1,26 @@
+/*
+dirwatch.h                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Waiting for files to appear or disappear (used by 'writeloop' and
+'catloop' when they hand over files). The directories of the files are
+watched with inotify, so a waiting process wakes up exactly when a file
+is renamed into or deleted from such a directory. If inotify is not
+available the existence of the file is polled.
+*/
+
+#include <stdint.h>
+#include <sys/inotify.h>
+
+struct dirwatch {
+    int fd;                 /* inotify descriptor, -1 when polling */
+    long pollusec;          /* nap between two polls */
+};
+
+int dirwatch_init(struct dirwatch *w, char **names, uint32_t mask,
+                  long pollusec);
+long long dirwatch_wait(struct dirwatch *w, char *name, int exists);
+void dirwatch_close(struct dirwatch *w);
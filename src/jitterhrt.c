@@ -0,0 +1,250 @@
+/*
+jitterhrt.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+*/
+
+#include "version.h"
+#include "net.h"
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+/* help page */
+void usage( ) {
+  fprintf(stderr,
+          "jitterhrt (version %s of frankl's stereo utilities)\nUSAGE:\n",
+          VERSION);
+  fprintf(stderr,
+"\n"
+"  jitterhrt [options]\n"
+"\n"
+"  This program receives data and records the arrival time of each\n"
+"  datagram or read, the data are discarded. At the end it prints the\n"
+"  received data rate, percentiles of the times between arrivals and of\n"
+"  the deviation of the arrivals from an even schedule (a line fitted\n"
+"  to the arrival times against the number of bytes received before).\n"
+"  It is meant for testing the timing of the output of 'bufhrt'.\n"
+"\n"
+"  OPTIONS\n"
+"\n"
+"  --udp-port=intval, -u intval\n"
+"      receive UDP datagrams on this port (see 'bufhrt --udp-host').\n"
+"      The arrival times are taken by the kernel.\n"
+"\n"
+"  --port=intval, -p intval\n"
+"      accept one TCP connection on this port.\n"
+"\n"
+"  --host=hname, -H hname\n"
+"      together with --port connect to this host instead of listening.\n"
+"\n"
+"  (without these options data are read from stdin)\n"
+"\n"
+"  --timeout=floatval, -t floatval\n"
+"      with UDP stop when no datagram arrived for this number of\n"
+"      seconds. Default is 2.\n"
+"\n"
+"  --max-arrivals=intval, -n intval\n"
+"      maximal number of arrivals to record. Default is 10000000.\n"
+"\n"
+"  --version, -V\n"
+"      print information about the version of the program and abort.\n"
+"\n"
+"  --help, -h\n"
+"      print this help page and abort.\n"
+"\n"
+"  EXAMPLE\n"
+"\n"
+"  jitterhrt --udp-port=5999 &\n"
+"  bufhrt --file=music.raw --bytes-per-second=1536000 \\\n"
+"         --udp-host=localhost --udp-port=5999\n"
+"\n"
+);
+}
+
+int cmpll(const void *a, const void *b)
+{
+    long long x = *(long long*)a, y = *(long long*)b;
+    return (x > y) - (x < y);
+}
+
+/* sorts v and prints some percentiles */
+void percentiles(char *name, long long *v, long n)
+{
+    qsort(v, n, sizeof(long long), cmpll);
+    printf("%-22s %10lld %10lld %10lld %10lld %10lld %10lld\n", name,
+           v[0], v[n/2], v[(long)(0.9*(n-1))], v[(long)(0.99*(n-1))],
+           v[(long)(0.999*(n-1))], v[n-1]);
+}
+
+int main(int argc, char *argv[])
+{
+    int fd, optc, udp, on = 1, rcvbuf;
+    long n, k, maxn;
+    ssize_t s;
+    long long *t, *b, *v, tot;
+    double timeout, st, sb, stb, sbb, slope, icept, dt;
+    char *host, *port, *udpport, buf[65536], cbuf[256];
+    struct timespec ts, *kts;
+    struct timeval tv;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cm;
+
+    static struct option longoptions[] = {
+        {"udp-port", required_argument, 0, 'u' },
+        {"port", required_argument, 0, 'p' },
+        {"host", required_argument, 0, 'H' },
+        {"timeout", required_argument, 0, 't' },
+        {"max-arrivals", required_argument, 0, 'n' },
+        {"version", no_argument, 0, 'V' },
+        {"help", no_argument, 0, 'h' },
+        {0,         0,                 0,  0 }
+    };
+
+    host = NULL;
+    port = NULL;
+    udpport = NULL;
+    timeout = 2.0;
+    maxn = 10000000;
+    while ((optc = getopt_long(argc, argv, "u:p:H:t:n:Vh",
+            longoptions, &optind)) != -1) {
+        switch (optc) {
+        case 'u':
+          udpport = optarg;
+          break;
+        case 'p':
+          port = optarg;
+          break;
+        case 'H':
+          host = optarg;
+          break;
+        case 't':
+          timeout = atof(optarg);
+          break;
+        case 'n':
+          maxn = atol(optarg);
+          break;
+        case 'V':
+          fprintf(stderr,
+                  "jitterhrt (version %s of frankl's stereo utilities)\n",
+                  VERSION);
+          exit(0);
+        default:
+          usage();
+          exit(1);
+        }
+    }
+    udp = 0;
+    if (udpport != NULL) {
+        udp = 1;
+        fd = fd_udp_bind(udpport);
+        /* enough room for bursts of datagrams */
+        rcvbuf = 4194304;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int));
+        /* arrival times from the kernel */
+        if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(int)) < 0) {
+            fprintf(stderr, "jitterhrt: Cannot enable time stamps.\n");
+            exit(2);
+        }
+    } else if (host != NULL && port != NULL) {
+        fd = fd_net(host, port);
+    } else if (port != NULL) {
+        k = fd_listen(port, NULL, 0);
+        if ((fd = accept(k, NULL, NULL)) < 0) {
+            fprintf(stderr, "jitterhrt: Cannot accept connection.\n");
+            exit(2);
+        }
+        close(k);
+    } else {
+        fd = 0;
+    }
+    t = (long long*)malloc(maxn * sizeof(long long));
+    b = (long long*)malloc(maxn * sizeof(long long));
+    v = (long long*)malloc(maxn * sizeof(long long));
+    if (!t || !b || !v) {
+        fprintf(stderr, "jitterhrt: Cannot allocate memory.\n");
+        exit(3);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    for (n = 0, tot = 0; n < maxn; n++) {
+        if (udp) {
+            msg.msg_control = cbuf;
+            msg.msg_controllen = sizeof(cbuf);
+            s = recvmsg(fd, &msg, 0);
+            if (s < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;   /* timeout */
+            clock_gettime(CLOCK_REALTIME, &ts);
+            for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+                if (cm->cmsg_level == SOL_SOCKET &&
+                    cm->cmsg_type == SCM_TIMESTAMPNS) {
+                    kts = (struct timespec*)CMSG_DATA(cm);
+                    ts = *kts;
+                }
+            if (n == 0) {
+                /* now we wait only for timeout seconds */
+                tv.tv_sec = (long)timeout;
+                tv.tv_usec = (long)(1000000*(timeout - tv.tv_sec));
+                setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            }
+        } else {
+            s = read(fd, buf, sizeof(buf));
+            clock_gettime(CLOCK_REALTIME, &ts);
+        }
+        if (s < 0) {
+            fprintf(stderr, "jitterhrt: Read error: %s.\n", strerror(errno));
+            exit(4);
+        }
+        if (s == 0)
+            break;
+        t[n] = ts.tv_sec*1000000000LL + ts.tv_nsec;
+        b[n] = tot;
+        tot += s;
+    }
+    if (n < 3) {
+        fprintf(stderr, "jitterhrt: Too few arrivals (%ld).\n", n);
+        exit(5);
+    }
+
+    /* least squares line of arrival time against bytes received before */
+    st = sb = stb = sbb = 0.0;
+    for (k = 0; k < n; k++) {
+        dt = t[k] - t[0];
+        st += dt;
+        sb += b[k];
+        stb += dt * b[k];
+        sbb += 1.0 * b[k] * b[k];
+    }
+    slope = (n*stb - st*sb)/(n*sbb - sb*sb);
+    icept = (st - slope*sb)/n;
+
+    dt = (t[n-1] - t[0])/1000000000.0;
+    printf("Arrivals: %ld, bytes: %lld in %.3f sec (%.1f bytes/sec).\n\n",
+           n, tot, dt, b[n-1]/dt);
+    printf("%-22s %10s %10s %10s %10s %10s %10s\n", "(nsec)", "min", "50%",
+           "90%", "99%", "99.9%", "max");
+    for (k = 1; k < n; k++)
+        v[k-1] = t[k] - t[k-1];
+    percentiles("time between arrivals", v, n-1);
+    for (k = 0; k < n; k++) {
+        dt = (t[k] - t[0]) - (icept + slope*b[k]);
+        v[k] = (long long)(dt < 0 ? -dt : dt);
+    }
+    percentiles("deviation (absolute)", v, n);
+    return 0;
+}
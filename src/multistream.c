@@ -0,0 +1,419 @@
+/*
+multistream.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Many independent bufhrt streams in one process, see multistream.h.
+
+Each timer thread sleeps until the start of the next non-empty slot of
+its wheel and then writes a chunk for each stream in this slot. The
+deadline of a stream is moved to its next loop and the stream is put
+into the corresponding slot. All streams of a wheel start at the same
+time, so streams with the same loop duration always share a wakeup.
+Deadlines are served at the start of their tick, that is at most one
+tick early; the deviations are collected per stream.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "net.h"
+#include "cprefresh.h"
+#include "ringbuf.h"
+#include "multistream.h"
+
+/* reads the configuration file, one stream per line with entries
+   key=value (see usage of 'bufhrt'), returns the number of streams */
+int ms_readconfig(char *path, struct mstream *streams)
+{
+    FILE *f;
+    char line[4096], *tok, *val;
+    int n, lnum;
+    struct mstream *s;
+
+    if ((f = fopen(path, "r")) == NULL) {
+        fprintf(stderr, "multistream: Cannot open configuration %s.\n", path);
+        exit(111);
+    }
+    for (n = 0, lnum = 1; fgets(line, 4096, f) != NULL; lnum++) {
+        if ((tok = strchr(line, '#')) != NULL)
+            *tok = '\0';
+        tok = strtok(line, " \t\r\n");
+        if (tok == NULL)
+            continue;
+        if (n == MS_MAXSTREAMS) {
+            fprintf(stderr, "multistream: At most %d streams.\n", MS_MAXSTREAMS);
+            exit(111);
+        }
+        s = streams + n;
+        memset(s, 0, sizeof(struct mstream));
+        s->loopspersec = 1000;
+        s->cpu = -1;
+        for (; tok != NULL; tok = strtok(NULL, " \t\r\n")) {
+            if ((val = strchr(tok, '=')) == NULL) {
+                fprintf(stderr, "multistream: Line %d: no value for %s.\n",
+                                lnum, tok);
+                exit(111);
+            }
+            *val++ = '\0';
+            if (strcmp(tok, "input") == 0)
+                s->input = strdup(val);
+            else if (strcmp(tok, "output") == 0)
+                s->output = strdup(val);
+            else if (strcmp(tok, "bytes-per-second") == 0)
+                s->outpersec = atol(val);
+            else if (strcmp(tok, "loops-per-second") == 0)
+                s->loopspersec = atol(val);
+            else if (strcmp(tok, "extra-bytes-per-second") == 0)
+                s->extrabps = atof(val);
+            else if (strcmp(tok, "buffer-size") == 0)
+                s->hlen = atol(val)/2;
+            else if (strcmp(tok, "cpu") == 0)
+                s->cpu = atoi(val);
+            else {
+                fprintf(stderr, "multistream: Line %d: unknown key %s.\n",
+                                lnum, tok);
+                exit(111);
+            }
+        }
+        if (s->input == NULL || s->output == NULL || s->outpersec <= 0 ||
+            s->loopspersec <= 0) {
+            fprintf(stderr, "multistream: Line %d: need input, output and "
+                            "bytes-per-second.\n", lnum);
+            exit(111);
+        }
+        n++;
+    }
+    fclose(f);
+    if (n == 0) {
+        fprintf(stderr, "multistream: No streams in %s.\n", path);
+        exit(111);
+    }
+    return n;
+}
+
+/* parses a list like "0,2-3", returns the number of CPUs */
+int ms_parsecpus(char *list, int *cpus)
+{
+    int n, a, b;
+    char *p, *q;
+
+    for (n = 0, p = list; *p; ) {
+        a = strtol(p, &q, 10);
+        b = a;
+        if (*q == '-')
+            b = strtol(q+1, &q, 10);
+        if (q == p || a < 0 || b < a || (*q != ',' && *q != '\0')) {
+            fprintf(stderr, "multistream: Invalid CPU list %s.\n", list);
+            exit(112);
+        }
+        for (; a <= b; a++) {
+            if (n == MS_MAXCPUS) {
+                fprintf(stderr, "multistream: At most %d CPUs.\n", MS_MAXCPUS);
+                exit(112);
+            }
+            cpus[n++] = a;
+        }
+        p = (*q == ',') ? q+1 : q;
+    }
+    return n;
+}
+
+/* "host:port" is a network connection, anything else a file name */
+static int ms_open(char *name, int output)
+{
+    char host[256], *c;
+    struct stat sb;
+    int fd;
+
+    c = strrchr(name, ':');
+    if (c != NULL && c - name < 256 && name[0] != '/' &&
+        (output || stat(name, &sb) != 0)) {
+        memcpy(host, name, c - name);
+        host[c - name] = '\0';
+        return fd_net(host, c+1);
+    }
+    if (output)
+        fd = open(name, O_WRONLY | O_CREAT, 00644);
+    else
+        fd = open(name, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "multistream: Cannot open %s.\n", name);
+        exit(113);
+    }
+    return fd;
+}
+
+/* opens input and output, sets the sizes and fills half of the buffer */
+static void ms_setup(struct mstream *s)
+{
+    long blen;
+    ssize_t r;
+
+    s->ifd = ms_open(s->input, 0);
+    s->ofd = ms_open(s->output, 1);
+    s->nsec = (long)(1000000000.0*s->outpersec/(s->outpersec+s->extrabps)
+                     /s->loopspersec);
+    s->olen = s->outpersec/s->loopspersec;
+    if (s->olen <= 0)
+        s->olen = 1;
+    s->ilen = (s->olen*s->loopspersec == s->outpersec) ? s->olen : s->olen+1;
+    s->looperr = (1.0*s->outpersec)/s->loopspersec - 1.0*s->olen;
+    blen = 2*s->hlen;
+    if (blen < 65536)
+        blen = 65536;
+    if (blen < 3*(s->ilen+s->olen))
+        blen = 3*(s->ilen+s->olen);
+    if (ringbuf_init(&s->rb, blen+s->ilen) < 0) {
+        fprintf(stderr, "multistream: Cannot allocate buffer for %s.\n",
+                        s->input);
+        exit(114);
+    }
+    s->hlen = blen/2;
+    s->moreinput = 1;
+    while (ringbuf_fill(&s->rb) < blen - s->ilen) {
+        memclean(ringbuf_wptr(&s->rb), s->ilen);
+        r = read(s->ifd, ringbuf_wptr(&s->rb), s->ilen);
+        if (r <= 0) {
+            s->moreinput = 0;
+            break;
+        }
+        s->icount += r;
+        ringbuf_produce(&s->rb, r);
+    }
+    /* from now on a stream must not block the other streams of its CPU */
+    fcntl(s->ifd, F_SETFL, fcntl(s->ifd, F_GETFL) | O_NONBLOCK);
+    fcntl(s->ofd, F_SETFL, fcntl(s->ofd, F_GETFL) | O_NONBLOCK);
+    s->wnext = ringbuf_fill(&s->rb) < s->olen ? ringbuf_fill(&s->rb) : s->olen;
+    s->off = s->looperr;
+    s->dmin = 1000000000;
+    s->dmax = -1000000000;
+    s->active = 1;
+}
+
+/* puts stream into the slot of its deadline, never into the current one */
+static void ms_insert(struct mswheel *w, struct mstream *s)
+{
+    long long d;
+    unsigned k;
+
+    d = (s->due - w->base) / w->tick;
+    if (d < 1)
+        d = 1;
+    s->rounds = (d - 1) / MS_WHEELSLOTS;
+    k = (w->cur + d) % MS_WHEELSLOTS;
+    s->next = w->slot[k];
+    w->slot[k] = s;
+}
+
+/* writes one chunk at the deadline and reads input if needed, returns 0
+   when the stream is finished (input at end and all written) */
+static int ms_serve(struct mstream *s, long long now)
+{
+    ssize_t r;
+    long d;
+
+    d = now - s->due;
+    if (d < s->dmin) s->dmin = d;
+    if (d > s->dmax) s->dmax = d;
+    s->dsum += d;
+    s->dsq += (double)d*d;
+    if (d > s->nsec/2)
+        s->late++;
+    s->loops++;
+    refreshmem(ringbuf_rptr(&s->rb), s->wnext);
+    r = write(s->ofd, ringbuf_rptr(&s->rb), s->wnext);
+    if (r < 0 && errno == EAGAIN)
+        r = 0;
+    if (r < 0) {
+        fprintf(stderr, "multistream: Write error on %s, stream closed.\n",
+                        s->output);
+        return 0;
+    }
+    s->ocount += r;
+    ringbuf_consume(&s->rb, r);
+    s->wnext = s->olen + s->wnext - r;
+    if (s->off >= 1.0) {
+        s->off -= 1.0;
+        s->wnext++;
+    }
+    s->off += s->looperr;
+    if (s->wnext >= 2*s->olen) {
+        s->underruns++;
+        s->wnext = 2*s->olen-1;
+    }
+    /* read if buffer not half filled */
+    while (s->moreinput && ringbuf_fill(&s->rb) < s->hlen) {
+        memclean(ringbuf_wptr(&s->rb), s->ilen);
+        r = read(s->ifd, ringbuf_wptr(&s->rb), s->ilen);
+        if (r < 0 && errno == EAGAIN)
+            break;
+        if (r <= 0) {
+            s->moreinput = 0;
+            break;
+        }
+        s->icount += r;
+        ringbuf_produce(&s->rb, r);
+    }
+    if (ringbuf_fill(&s->rb) <= s->wnext)
+        s->wnext = ringbuf_fill(&s->rb);
+    s->due += s->nsec;
+    /* an empty buffer after EAGAIN is an underrun, not the end */
+    return s->moreinput || s->wnext > 0;
+}
+
+/* the timer thread of one CPU */
+static void *ms_wheelthread(void *arg)
+{
+    struct mswheel *w = arg;
+    struct mstream *s, *list;
+    struct timespec ts;
+    long long now;
+    cpu_set_t cs;
+
+    if (w->cpu >= 0) {
+        CPU_ZERO(&cs);
+        CPU_SET(w->cpu, &cs);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs) != 0)
+            fprintf(stderr, "multistream: Cannot run on CPU %d.\n", w->cpu);
+    }
+    while (w->active > 0) {
+        /* sleep until the next slot with streams */
+        do {
+            w->cur = (w->cur + 1) % MS_WHEELSLOTS;
+            w->base += w->tick;
+        } while (w->slot[w->cur] == NULL);
+        ts.tv_sec = w->base / 1000000000;
+        ts.tv_nsec = w->base % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+               == EINTR) ;
+        w->wakeups++;
+        list = w->slot[w->cur];
+        w->slot[w->cur] = NULL;
+        while ((s = list) != NULL) {
+            list = s->next;
+            if (s->rounds > 0) {
+                s->rounds--;
+                s->next = w->slot[w->cur];
+                w->slot[w->cur] = s;
+                continue;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            now = ts.tv_sec*1000000000LL + ts.tv_nsec;
+            w->loops++;
+            if (ms_serve(s, now))
+                ms_insert(w, s);
+            else {
+                s->active = 0;
+                w->active--;
+                close(s->ofd);
+                close(s->ifd);
+            }
+        }
+    }
+    return NULL;
+}
+
+/* sets up all streams, distributes them on the CPUs and runs the timer
+   threads until all streams are finished */
+void ms_run(struct mstream *streams, int nstreams, int *cpus, int ncpus,
+            long tick, int verbose)
+{
+    struct mswheel *wheels;
+    struct mstream *s;
+    struct timespec ts;
+    long long start;
+    long loops, wakeups;
+    double var;
+    int i, k;
+
+    if (ncpus == 0) {
+        cpus[0] = -1;
+        ncpus = 1;
+    }
+    if ((wheels = calloc(ncpus, sizeof(struct mswheel))) == NULL) {
+        fprintf(stderr, "multistream: Cannot allocate timing wheels.\n");
+        exit(114);
+    }
+    /* a client which goes away only ends its own stream (write error
+       in ms_serve) instead of killing all streams */
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < nstreams; i++) {
+        s = streams + i;
+        s->id = i;
+        ms_setup(s);
+        if (s->nsec < 2*tick) {
+            fprintf(stderr, "multistream: Loops of %s are shorter than two "
+                            "ticks of %ld nsec.\n", s->input, tick);
+            exit(115);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    /* start a bit later, such that all threads are running */
+    start = ts.tv_sec*1000000000LL + ts.tv_nsec + 10000000;
+    for (k = 0; k < ncpus; k++) {
+        wheels[k].cpu = cpus[k];
+        wheels[k].tick = tick;
+        wheels[k].base = start;
+    }
+    /* streams with a CPU are put onto its wheel, the others round robin */
+    for (i = 0; i < nstreams; i++) {
+        s = streams + i;
+        for (k = 0; k < ncpus && cpus[k] != s->cpu; k++) ;
+        if (k == ncpus)
+            k = i % ncpus;
+        s->cpu = cpus[k];
+        s->due = start + s->nsec;
+        ms_insert(wheels + k, s);
+        wheels[k].active++;
+    }
+    for (k = 0; k < ncpus; k++) {
+        if (wheels[k].active == 0)
+            continue;
+        if (pthread_create(&wheels[k].thread, NULL, ms_wheelthread,
+                           wheels + k) != 0) {
+            fprintf(stderr, "multistream: Cannot create timer thread.\n");
+            exit(114);
+        }
+    }
+    for (k = 0; k < ncpus; k++)
+        if (wheels[k].active > 0)
+            pthread_join(wheels[k].thread, NULL);
+    if (!verbose)
+        return;
+    for (i = 0; i < nstreams; i++) {
+        s = streams + i;
+        if (s->loops == 0)
+            continue;
+        fprintf(stderr, "multistream: Stream %d (%s -> %s, CPU %d): loops %ld, "
+                        "bytes %lld in %lld out.\n", i, s->input, s->output,
+                        s->cpu, s->loops, s->icount, s->ocount);
+        var = s->dsq/s->loops - ((double)s->dsum/s->loops)*s->dsum/s->loops;
+        fprintf(stderr, "multistream:    deviation from deadlines min/avg/max/"
+                        "stddev %ld/%lld/%ld/%.0f nsec, late %ld, underruns %ld.\n",
+                        s->dmin, s->dsum/s->loops, s->dmax,
+                        var > 0.0 ? sqrt(var) : 0.0, s->late, s->underruns);
+    }
+    for (k = 0, loops = 0, wakeups = 0; k < ncpus; k++) {
+        loops += wheels[k].loops;
+        wakeups += wheels[k].wakeups;
+        fprintf(stderr, "multistream: CPU %d: loops %ld, wakeups %ld.\n",
+                        wheels[k].cpu, wheels[k].loops, wheels[k].wakeups);
+    }
+    fprintf(stderr, "multistream: Total loops %ld, wakeups %ld (%ld saved).\n",
+                    loops, wakeups, loops - wakeups);
+    free(wheels);
+}
@@ -0,0 +1,52 @@
+/*
+multistream.h                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Many independent bufhrt streams in one process (see --streams option of
+'bufhrt'). Each given CPU gets one timer thread which serves the
+deadlines of its streams from a timing wheel, so that deadlines falling
+into the same tick of the wheel need only one wakeup.
+Include pthread.h and ringbuf.h before this file.
+*/
+
+#define MS_MAXSTREAMS 64
+#define MS_MAXCPUS 64
+#define MS_WHEELSLOTS 256
+
+struct mstream {
+    /* from the configuration file */
+    char *input, *output;
+    long outpersec, loopspersec;
+    double extrabps;
+    int cpu;
+    /* set up by ms_run */
+    int id, ifd, ofd, moreinput, active;
+    struct ringbuf rb;
+    long ilen, olen, hlen, nsec, wnext;
+    double looperr, off;
+    long long due;            /* next deadline, nsec of CLOCK_MONOTONIC */
+    long rounds;              /* full turns of the wheel until due */
+    struct mstream *next;     /* in slot of the wheel */
+    /* statistics, deviation of write from deadline in nsec */
+    long loops, late, underruns, dmin, dmax;
+    long long icount, ocount, dsum;
+    double dsq;
+};
+
+struct mswheel {
+    int cpu, active;
+    long tick;
+    long long base;           /* time of slot 'cur' */
+    unsigned cur;
+    struct mstream *slot[MS_WHEELSLOTS];
+    long wakeups, loops;
+    pthread_t thread;
+};
+
+int ms_readconfig(char *path, struct mstream *streams);
+int ms_parsecpus(char *list, int *cpus);
+void ms_run(struct mstream *streams, int nstreams, int *cpus, int ncpus,
+            long tick, int verbose);
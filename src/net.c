@@ -8,16 +8,46 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
 #include <netdb.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
 
-/* returns file descriptor for network connection 
+/* fills addr for the UNIX domain socket with given path */
+static void unix_addr(struct sockaddr_un *addr, char *path) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "net: Socket path %s is too long.\n", path);
+        exit(103);
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+}
+
+/* returns file descriptor for connection to a UNIX domain socket */
+static int fd_unix(char *path) {
+    struct sockaddr_un addr;
+    int sfd;
+
+    unix_addr(&addr, path);
+    sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sfd == -1 ||
+        connect(sfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "net: Could not connect to %s.\n", path);
+        exit(102);
+    }
+    return sfd;
+}
+
+/* returns file descriptor for connection of given type to host/port
    (taken from man page of getaddrinfo)            */
-int fd_net(char *host, char *port) {
+static int fd_connect(char *host, char *port, int socktype) {
     struct addrinfo hints;
     struct addrinfo *result, *rp;
     int s, sfd;
@@ -25,7 +55,7 @@ int fd_net(char *host, char *port) {
     /* Obtain address(es) matching host/port */
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_UNSPEC;    /* Allow IPv4 or IPv6 */
-    hints.ai_socktype = SOCK_STREAM; 
+    hints.ai_socktype = socktype; 
     hints.ai_flags = 0;
     hints.ai_protocol = 0;          /* Any protocol */
 
@@ -58,3 +88,118 @@ int fd_net(char *host, char *port) {
     return sfd;
 }
 
+/* returns file descriptor for network connection 
+   if host starts with a slash it is the path of a UNIX domain
+   socket and port is ignored                      */
+int fd_net(char *host, char *port) {
+    if (host[0] == '/')
+        return fd_unix(host);
+    return fd_connect(host, port, SOCK_STREAM);
+}
+
+/* returns UDP socket connected to host/port, so that 'send' can be
+   used for the datagrams */
+int fd_udp(char *host, char *port) {
+    return fd_connect(host, port, SOCK_DGRAM);
+}
+
+/* returns UDP socket bound to the given port for IPv6 and IPv4 (or
+   IPv4 only if the system has no IPv6) */
+int fd_udp_bind(char *port) {
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in addr4;
+    int sfd, v6only = 0;
+
+    sfd = socket(AF_INET6, SOCK_DGRAM, 0);
+    if (sfd != -1) {
+        setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(int));
+        memset(&addr6, 0, sizeof(addr6));
+        addr6.sin6_family = AF_INET6;
+        addr6.sin6_addr = in6addr_any;
+        addr6.sin6_port = htons(atoi(port));
+        if (bind(sfd, (struct sockaddr*)&addr6, sizeof(addr6)) == -1) {
+            fprintf(stderr, "net: Cannot bind UDP socket.\n");
+            exit(11);
+        }
+    } else if (errno == EAFNOSUPPORT &&
+               (sfd = socket(AF_INET, SOCK_DGRAM, 0)) != -1) {
+        memset(&addr4, 0, sizeof(addr4));
+        addr4.sin_family = AF_INET;
+        addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr4.sin_port = htons(atoi(port));
+        if (bind(sfd, (struct sockaddr*)&addr4, sizeof(addr4)) == -1) {
+            fprintf(stderr, "net: Cannot bind UDP socket.\n");
+            exit(11);
+        }
+    }
+    if (sfd == -1) {
+        fprintf(stderr, "net: Cannot create UDP socket.\n");
+        exit(9);
+    }
+    return sfd;
+}
+
+/* returns a listening socket, on a UNIX domain socket if path is not 
+   NULL, otherwise on the given port for IPv6 and IPv4 (dual stack, or
+   IPv4 only if the system has no IPv6); if sndbuf is not 0 it is used
+   as send buffer size for accepted connections */
+int fd_listen(char *port, char *path, int sndbuf) {
+    struct sockaddr_un uaddr;
+    struct sockaddr_in6 addr6;
+    struct sockaddr_in addr4;
+    struct sockaddr *addr;
+    socklen_t addrlen;
+    struct stat sb;
+    int sfd, optval = 1, v6only = 0;
+
+    if (path != NULL) {
+        unix_addr(&uaddr, path);
+        /* remove a socket left over from a former call */
+        if (stat(path, &sb) == 0 && S_ISSOCK(sb.st_mode))
+            unlink(path);
+        sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        addr = (struct sockaddr*)&uaddr;
+        addrlen = sizeof(uaddr);
+    } else {
+        sfd = socket(AF_INET6, SOCK_STREAM, 0);
+        if (sfd != -1) {
+            /* accept IPv4 connections as well */
+            setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(int));
+            memset(&addr6, 0, sizeof(addr6));
+            addr6.sin6_family = AF_INET6;
+            addr6.sin6_addr = in6addr_any;
+            addr6.sin6_port = htons(atoi(port));
+            addr = (struct sockaddr*)&addr6;
+            addrlen = sizeof(addr6);
+        } else if (errno == EAFNOSUPPORT) {
+            sfd = socket(AF_INET, SOCK_STREAM, 0);
+            memset(&addr4, 0, sizeof(addr4));
+            addr4.sin_family = AF_INET;
+            addr4.sin_addr.s_addr = htonl(INADDR_ANY);
+            addr4.sin_port = htons(atoi(port));
+            addr = (struct sockaddr*)&addr4;
+            addrlen = sizeof(addr4);
+        }
+    }
+    if (sfd == -1) {
+        fprintf(stderr, "net: Cannot create listening socket.\n");
+        exit(9);
+    }
+    if (path == NULL &&
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int)) == -1) {
+        fprintf(stderr, "net: Cannot set REUSEADDR.\n");
+        exit(10);
+    }
+    if (sndbuf != 0 &&
+        setsockopt(sfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(int)) == -1) {
+        fprintf(stderr, "net: Cannot set outgoing network buffer to %d.\n",
+                sndbuf);
+        exit(30);
+    }
+    if (bind(sfd, addr, addrlen) == -1) {
+        fprintf(stderr, "net: Cannot bind listening socket.\n");
+        exit(11);
+    }
+    listen(sfd, 1);
+    return sfd;
+}
@@ -8,4 +8,7 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 
 
 int fd_net(char *host, char *port);
+int fd_listen(char *port, char *path, int sndbuf);
+int fd_udp(char *host, char *port);
+int fd_udp_bind(char *port);
 
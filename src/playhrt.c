@@ -17,8 +17,11 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <sys/resource.h>
 #include <alsa/asoundlib.h>
 #include "cprefresh.h"
+#include "ringbuf.h"
+#include "stream.h"
 
 /* help page */
 /* vim hint to remove resp. add quotes:
@@ -85,6 +88,11 @@ void usage( ) {
 "  --stdin, -S\n"
 "      read data from stdin (instead of --host and --port).\n"
 "\n"
+"  --socket-path=path, -u path\n"
+"      read data from a UNIX domain socket with this path (instead of\n"
+"      --host and --port), e.g., from 'bufhrt --socket-path=path' on\n"
+"      the same machine.\n"
+"\n"
 "  --device=alsaname, -d alsaname\n"
 "      the name of the sound device. A typical name is 'hw:0,0', maybe\n"
 "      use 'aplay -l' to find out the correct numbers. It is recommended\n"
@@ -105,6 +113,14 @@ void usage( ) {
 "      the number of channels in the (interleaved) audio stream. The \n"
 "      default is 2 (stereo).\n"
 "\n"
+"  --framed, -F\n"
+"      the input is a framed stream (see 'catloop --framed'). A format in\n"
+"      the stream overrides --sample-rate, --sample-format and\n"
+"      --number-channels. When the format changes, the data in the\n"
+"      buffer are played with the old format, then the sound device is\n"
+"      set up for the new format and playback continues, so a change of\n"
+"      the sample rate needs no restart. Not possible with --mmap.\n"
+"\n"
 "  --loops-per-second=intval, -n intval\n"
 "      the number of loops per second in which 'playhrt' reads some\n"
 "      data from the network into a buffer, sleeps until a precise\n"
@@ -268,6 +284,184 @@ void usage( ) {
 }
 
 
+/* the sound device format for a format of stream.h */
+snd_pcm_format_t alsaformat(int format)
+{
+    switch (format) {
+    case STREAM_S16_LE:
+        return SND_PCM_FORMAT_S16_LE;
+    case STREAM_S24_LE:
+        return SND_PCM_FORMAT_S24_LE;
+    case STREAM_S24_3LE:
+        return SND_PCM_FORMAT_S24_3LE;
+    case STREAM_S32_LE:
+        return SND_PCM_FORMAT_S32_LE;
+    case STREAM_FLOAT_LE:
+        return SND_PCM_FORMAT_FLOAT_LE;
+    case STREAM_FLOAT64_LE:
+        return SND_PCM_FORMAT_FLOAT64_LE;
+    }
+    return SND_PCM_FORMAT_UNKNOWN;
+}
+
+/* computes the nanoseconds per loop, the frames written per loop (olen
+   and the fractional part looperr) and the input chunk size ilen (at
+   least minilen) */
+void looptiming(int rate, int bytesperframe, long loopspersec,
+                double extrabps, long minilen, long *nsec, long *olen,
+                long *ilen, double *looperr, int verbose)
+{
+    double extraerr;
+
+    /* compute nanoseconds per loop (wrt local clock) */
+    extraerr = 1.0*bytesperframe*rate;
+    extraerr = extraerr/(extraerr+extrabps);
+    *nsec = (int) (1000000000*extraerr/loopspersec);
+    if (verbose) {
+        fprintf(stderr, "playhrt: Step size is %ld nsec.\n", *nsec);
+    }
+    /* olen in frames written per loop */
+    *olen = rate/loopspersec;
+    if (*olen <= 0)
+        *olen = 1;
+    *ilen = minilen;
+    if (*ilen < bytesperframe*(*olen)) {
+        if ((*olen)*loopspersec == rate)
+            *ilen = bytesperframe * (*olen);
+        else
+            *ilen = bytesperframe * (*olen+1);
+        if (verbose)
+            fprintf(stderr, "playhrt: Setting input chunk size to %ld bytes.\n", *ilen);
+    }
+    if ((*olen)*loopspersec == rate)
+        *looperr = 0.0;
+    else
+        *looperr = (1.0*rate)/loopspersec - 1.0*(*olen);
+}
+
+/* sets the hardware and software parameters of the sound device, 
+   hwbufsize is the wanted buffer size and is set to the one used */
+void setdevice(snd_pcm_t *pcm_handle, snd_pcm_access_t access,
+               snd_pcm_format_t format, int rate, int nrchannels,
+               snd_pcm_uframes_t periodsize, snd_pcm_uframes_t *hwbufsize,
+               int verbose)
+{
+    snd_pcm_hw_params_t *hwparams;
+    snd_pcm_sw_params_t *swparams;
+
+    snd_pcm_hw_params_malloc(&hwparams);
+    if (snd_pcm_hw_params_any(pcm_handle, hwparams) < 0) {
+        fprintf(stderr, "playhrt: Cannot configure this PCM device.\n");
+        exit(7);
+    }
+    if (snd_pcm_hw_params_set_access(pcm_handle, hwparams, access) < 0) {
+        fprintf(stderr, "playhrt: Error setting access.\n");
+        exit(8);
+    }
+    if (snd_pcm_hw_params_set_format(pcm_handle, hwparams, format) < 0) {
+        fprintf(stderr, "playhrt: Error setting format.\n");
+        exit(9);
+    }
+    if (snd_pcm_hw_params_set_rate(pcm_handle, hwparams, rate, 0) < 0) {
+        fprintf(stderr, "playhrt: Error setting rate.\n");
+        exit(10);
+    }
+    if (snd_pcm_hw_params_set_channels(pcm_handle, hwparams, nrchannels) < 0) {
+        fprintf(stderr, "playhrt: Error setting channels to %d.\n", nrchannels);
+        exit(11);
+    }
+    if (periodsize != 0) {
+      if (snd_pcm_hw_params_set_period_size(
+                                pcm_handle, hwparams, periodsize, 0) < 0) {
+          fprintf(stderr, "playhrt: Error setting period size to %ld.\n", periodsize);
+          exit(11);
+      }
+      if (verbose) {
+          fprintf(stderr, "playhrt: Setting period size explicitly to %ld frames.\n",
+                          periodsize);
+      }
+    }
+    if (verbose) {
+        snd_pcm_uframes_t min=1, max=100000000;
+        snd_pcm_hw_params_set_buffer_size_minmax(pcm_handle, hwparams,
+                                                                &min, &max);
+        fprintf(stderr,
+                "playhrt: Min and max buffer size of device %ld .. %ld - ", min, max);
+    }
+    if (snd_pcm_hw_params_set_buffer_size(pcm_handle, hwparams,
+                                                      *hwbufsize) < 0) {
+        fprintf(stderr, "\nplayhrt: Error setting buffersize to %ld.\n", *hwbufsize);
+        exit(12);
+    }
+    snd_pcm_hw_params_get_buffer_size(hwparams, hwbufsize);
+    if (verbose) {
+        fprintf(stderr, " using %ld.\n", *hwbufsize);
+    }
+    if (snd_pcm_hw_params(pcm_handle, hwparams) < 0) {
+        fprintf(stderr, "playhrt: Error setting HW params.\n");
+        exit(13);
+    }
+    snd_pcm_hw_params_free(hwparams);
+    if (snd_pcm_sw_params_malloc (&swparams) < 0) {
+        fprintf(stderr, "playhrt: Cannot allocate SW params.\n");
+        exit(14);
+    }
+    if (snd_pcm_sw_params_current(pcm_handle, swparams) < 0) {
+        fprintf(stderr, "playhrt: Cannot get current SW params.\n");
+        exit(15);
+    }
+    if (snd_pcm_sw_params_set_start_threshold(pcm_handle,
+                                          swparams, *hwbufsize/2) < 0) {
+        fprintf(stderr, "playhrt: Cannot set start threshold.\n");
+        exit(16);
+    }
+    if (snd_pcm_sw_params(pcm_handle, swparams) < 0) {
+        fprintf(stderr, "playhrt: Cannot apply SW params.\n");
+        exit(17);
+    }
+    snd_pcm_sw_params_free (swparams);
+}
+
+/* reads input, from a framed stream (if sin is not NULL) only data of
+   one format, then *newfmt tells if sin->fmt changed before the data */
+ssize_t readinput(int sfd, struct streamin *sin, void *buf, size_t len,
+                  int *newfmt)
+{
+    *newfmt = 0;
+    if (sin == NULL)
+        return read(sfd, buf, len);
+    return stream_readall(sin, buf, len, newfmt);
+}
+
+int fmtdiffers(struct streamfmt *f, snd_pcm_format_t format, int rate,
+               int nrchannels)
+{
+    return alsaformat(f->format) != format || (int)f->rate != rate ||
+           (int)f->channels != nrchannels;
+}
+
+/* takes the format of a framed stream, returns 1 if it differs from
+   the current one */
+int takeformat(struct streamfmt *f, snd_pcm_format_t *format, int *rate,
+               int *nrchannels, int *bytespersample)
+{
+    snd_pcm_format_t nformat;
+
+    nformat = alsaformat(f->format);
+    if (nformat == SND_PCM_FORMAT_UNKNOWN) {
+        fprintf(stderr, "playhrt: Sample format %s in stream not "
+                        "supported.\n", stream_fmtname(f->format));
+        exit(24);
+    }
+    if (! fmtdiffers(f, *format, *rate, *nrchannels))
+        return 0;
+    *format = nformat;
+    *rate = f->rate;
+    *nrchannels = f->channels;
+    *bytespersample = stream_bytespersample(f->format);
+    return 1;
+}
+
 int main(int argc, char *argv[])
 {
     int sfd, s, moreinput, err, verbose, nrchannels, startcount, sumavg,
@@ -275,15 +469,14 @@ int main(int argc, char *argv[])
     long blen, hlen, ilen, olen, extra, loopspersec, nrdelays, sleep,
          nsec, count, wnext, badloops, badreads, readmissing, avgav, checkav;
     long long icount, ocount, badframes;
-    void *buf, *iptr, *optr, *max;
+    void *iptr, *optr;
+    struct ringbuf rb;
     struct timespec mtime;
     struct timespec mtimecheck;
     double looperr, off, extraerr, extrabps, morebps;
     snd_pcm_t *pcm_handle;
-    snd_pcm_hw_params_t *hwparams;
-    snd_pcm_sw_params_t *swparams;
     snd_pcm_format_t format;
-    char *host, *port, *pcm_name;
+    char *host, *port, *sockpath, *pcm_name;
     int optc, nonblock, rate, bytespersample, bytesperframe;
     snd_pcm_uframes_t hwbufsize, periodsize, offset, frames;
     snd_pcm_access_t access;
@@ -291,12 +484,19 @@ int main(int argc, char *argv[])
     const snd_pcm_channel_area_t *areas;
     double checktime;
     long corr;
+    int framed, newfmt, pending;
+    long minilen;
+    long long fmtpos;
+    struct streamin sin, *sinp;
+    struct rusage ru0, ru;
 
     /* read command line options */
     static struct option longoptions[] = {
         {"host", required_argument, 0,  'r' },
         {"port", required_argument,       0,  'p' },
         {"stdin", no_argument,       0,  'S' },
+        {"framed", no_argument, 0, 'F' },
+        {"socket-path", required_argument, 0, 'u' },
         {"buffer-size", required_argument,       0,  'b' },
         {"input-size",  required_argument, 0, 'i'},
         {"loops-per-second", required_argument, 0,  'n' },
@@ -330,6 +530,7 @@ int main(int argc, char *argv[])
     /* defaults */
     host = NULL;
     port = NULL;
+    sockpath = NULL;
     blen = 65536;
     ilen = 0;
     loopspersec = 1000;
@@ -354,7 +555,8 @@ int main(int argc, char *argv[])
     stripped = 0;
     dobufstats = 1;
     countdelay = 1;
-    while ((optc = getopt_long(argc, argv, "r:p:Sb:D:i:n:s:f:k:Mc:P:d:e:m:K:o:NXO:vyjVh",
+    framed = 0;
+    while ((optc = getopt_long(argc, argv, "r:p:Su:b:D:i:n:s:f:k:Mc:P:d:e:m:K:o:NXO:vyjVh",
             longoptions, &optind)) != -1) {
         switch (optc) {
         case 'r':
@@ -366,6 +568,9 @@ int main(int argc, char *argv[])
         case 'S':
           sfd = 0;
           break;
+        case 'u':
+          sockpath = optarg;
+          break;
         case 'b':
           blen = atoi(optarg);
           break;
@@ -402,6 +607,9 @@ int main(int argc, char *argv[])
         case 'M':
           access = SND_PCM_ACCESS_MMAP_INTERLEAVED;
           break;
+        case 'F':
+          framed = 1;
+          break;
         case 'c':
           hwbufsize = atoi(optarg);
           break;
@@ -461,38 +669,22 @@ int main(int argc, char *argv[])
     }
     bytesperframe = bytespersample*nrchannels;
     /* check some arguments and set some parameters */
-    if ((host == NULL || port == NULL) && sfd < 0) {
-       fprintf(stderr, "playhrt: Must specify --host and --port or --stdin.\n");
+    if ((host == NULL || port == NULL) && sockpath == NULL && sfd < 0) {
+       fprintf(stderr, "playhrt: Must specify --host and --port, --socket-path or --stdin.\n");
        exit(3);
     }
-    /* compute nanoseconds per loop (wrt local clock) */
-    extraerr = 1.0*bytesperframe*rate;
-    extraerr = extraerr/(extraerr+extrabps);
-    nsec = (int) (1000000000*extraerr/loopspersec);
-    if (verbose) {
-        fprintf(stderr, "playhrt: Step size is %ld nsec.\n", nsec);
-    }
-    /* olen in frames written per loop */
-    olen = rate/loopspersec;
-    if (olen <= 0)
-        olen = 1;
-    if (ilen < bytesperframe*(olen)) {
-        if (olen*loopspersec == rate)
-            ilen = bytesperframe * olen;
-        else
-            ilen = bytesperframe * (olen+1);
-        if (verbose)
-            fprintf(stderr, "playhrt: Setting input chunk size to %ld bytes.\n", ilen);
+    if (framed && access == SND_PCM_ACCESS_MMAP_INTERLEAVED) {
+       fprintf(stderr, "playhrt: --framed is not possible with --mmap.\n");
+       exit(3);
     }
+    minilen = ilen;
+    looptiming(rate, bytesperframe, loopspersec, extrabps, minilen,
+               &nsec, &olen, &ilen, &looperr, verbose);
     /* need big enough input buffer */
     if (blen < 3*ilen) {
         blen = 3*ilen;
     }
     hlen = blen/2;
-    if (olen*loopspersec == rate)
-        looperr = 0.0;
-    else
-        looperr = (1.0*rate)/loopspersec - 1.0*olen;
     moreinput = 1;
     icount = 0;
     ocount = 0;
@@ -501,26 +693,24 @@ int main(int argc, char *argv[])
         hwbufsize = hwbufsize - (hwbufsize % olen);
     }
 
-    /* need blen plus some overlap for (circular) input buffer */
-    if (! (buf = malloc(blen+ilen+(olen+extra)*bytesperframe)) ) {
+    /* circular input buffer, mapped twice such that input and output
+       chunks are contiguous also at the wrap around */
+    if (ringbuf_init(&rb, blen+ilen) < 0) {
         fprintf(stderr, "playhrt: Cannot allocate buffer of length %ld.\n",
-                blen+ilen+(olen+extra)*bytesperframe);
+                blen+ilen);
         exit(2);
     }
     if (verbose) {
         fprintf(stderr, "playhrt: Input buffer size is %ld bytes.\n",
-                blen+ilen+(olen+extra)*bytesperframe);
+                (long)rb.size);
     }
-    /* we put some overlap before the reference pointer */
-    buf = buf + (olen+extra)*bytesperframe;
-    max = buf + blen;
-    /* the pointers for next input and next output */
-    iptr = buf;
-    optr = buf;
 
     /* setup network connection */
-    if (host != NULL && port != NULL) {
-        sfd = fd_net(host, port);
+    if (sockpath != NULL || (host != NULL && port != NULL)) {
+        if (sockpath != NULL)
+            sfd = fd_net(sockpath, NULL);
+        else
+            sfd = fd_net(host, port);
         if (innetbufsize != 0) {
             if (setsockopt(sfd, SOL_SOCKET, SO_RCVBUF, (void*)&innetbufsize, sizeof(int)) < 0) {
                 fprintf(stderr, "playhrt: Cannot set buffer size for network socket to %d.\n",
@@ -530,8 +720,31 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* a format at the start of a framed stream overrides the options */
+    sinp = NULL;
+    pending = 0;
+    fmtpos = 0;
+    if (framed) {
+        stream_initin(&sin, sfd);
+        sinp = &sin;
+        if (stream_read(&sin, NULL, 0) == STREAM_NEWFMT &&
+            takeformat(&sin.fmt, &format, &rate, &nrchannels,
+                       &bytespersample)) {
+            bytesperframe = bytespersample*nrchannels;
+            looptiming(rate, bytesperframe, loopspersec, extrabps, minilen,
+                       &nsec, &olen, &ilen, &looperr, verbose);
+            if (blen < 3*ilen) {
+                fprintf(stderr, "playhrt: Buffer too small for format of "
+                                "stream, use larger --buffer-size.\n");
+                exit(24);
+            }
+        }
+        if (verbose)
+            fprintf(stderr, "playhrt: Framed input, format %d:%s:%d.\n",
+                    rate, snd_pcm_format_name(format), nrchannels);
+    }
+
     /* setup sound device */
-    snd_pcm_hw_params_malloc(&hwparams);
     if (snd_pcm_open(&pcm_handle, pcm_name, SND_PCM_STREAM_PLAYBACK, 0) < 0) {
         fprintf(stderr, "playhrt: Error opening PCM device %s\n", pcm_name);
         exit(5);
@@ -544,76 +757,8 @@ int main(int argc, char *argv[])
             fprintf(stderr, "playhrt: Using card in non-block mode.\n");
         }
     }
-    if (snd_pcm_hw_params_any(pcm_handle, hwparams) < 0) {
-        fprintf(stderr, "playhrt: Cannot configure this PCM device.\n");
-        exit(7);
-    }
-    if (snd_pcm_hw_params_set_access(pcm_handle, hwparams, access) < 0) {
-        fprintf(stderr, "playhrt: Error setting access.\n");
-        exit(8);
-    }
-    if (snd_pcm_hw_params_set_format(pcm_handle, hwparams, format) < 0) {
-        fprintf(stderr, "playhrt: Error setting format.\n");
-        exit(9);
-    }
-    if (snd_pcm_hw_params_set_rate(pcm_handle, hwparams, rate, 0) < 0) {
-        fprintf(stderr, "playhrt: Error setting rate.\n");
-        exit(10);
-    }
-    if (snd_pcm_hw_params_set_channels(pcm_handle, hwparams, nrchannels) < 0) {
-        fprintf(stderr, "playhrt: Error setting channels to %d.\n", nrchannels);
-        exit(11);
-    }
-    if (periodsize != 0) {
-      if (snd_pcm_hw_params_set_period_size(
-                                pcm_handle, hwparams, periodsize, 0) < 0) {
-          fprintf(stderr, "playhrt: Error setting period size to %ld.\n", periodsize);
-          exit(11);
-      }
-      if (verbose) {
-          fprintf(stderr, "playhrt: Setting period size explicitly to %ld frames.\n",
-                          periodsize);
-      }
-    }
-    if (verbose) {
-        snd_pcm_uframes_t min=1, max=100000000;
-        snd_pcm_hw_params_set_buffer_size_minmax(pcm_handle, hwparams,
-                                                                &min, &max);
-        fprintf(stderr,
-                "playhrt: Min and max buffer size of device %ld .. %ld - ", min, max);
-    }
-    if (snd_pcm_hw_params_set_buffer_size(pcm_handle, hwparams,
-                                                      hwbufsize) < 0) {
-        fprintf(stderr, "\nplayhrt: Error setting buffersize to %ld.\n", hwbufsize);
-        exit(12);
-    }
-    snd_pcm_hw_params_get_buffer_size(hwparams, &hwbufsize);
-    if (verbose) {
-        fprintf(stderr, " using %ld.\n", hwbufsize);
-    }
-    if (snd_pcm_hw_params(pcm_handle, hwparams) < 0) {
-        fprintf(stderr, "playhrt: Error setting HW params.\n");
-        exit(13);
-    }
-    snd_pcm_hw_params_free(hwparams);
-    if (snd_pcm_sw_params_malloc (&swparams) < 0) {
-        fprintf(stderr, "playhrt: Cannot allocate SW params.\n");
-        exit(14);
-    }
-    if (snd_pcm_sw_params_current(pcm_handle, swparams) < 0) {
-        fprintf(stderr, "playhrt: Cannot get current SW params.\n");
-        exit(15);
-    }
-    if (snd_pcm_sw_params_set_start_threshold(pcm_handle,
-                                          swparams, hwbufsize/2) < 0) {
-        fprintf(stderr, "playhrt: Cannot set start threshold.\n");
-        exit(16);
-    }
-    if (snd_pcm_sw_params(pcm_handle, swparams) < 0) {
-        fprintf(stderr, "playhrt: Cannot apply SW params.\n");
-        exit(17);
-    }
-    snd_pcm_sw_params_free (swparams);
+    setdevice(pcm_handle, access, format, rate, nrchannels, periodsize,
+              &hwbufsize, verbose);
 
     /* main loop */
     badloops = 0;
@@ -631,24 +776,34 @@ int main(int argc, char *argv[])
 
     if (access == SND_PCM_ACCESS_RW_INTERLEAVED) {
       /* fill half buffer */
-      for (; iptr < buf + 2*hlen - ilen; ) {
+      while (ringbuf_fill(&rb) < blen - ilen) {
+          iptr = ringbuf_wptr(&rb);
           memclean(iptr, ilen);
-          s = read(sfd, iptr, ilen);
+          s = readinput(sfd, sinp, iptr, ilen, &newfmt);
           if (s < 0) {
               fprintf(stderr, "playhrt: Read error.\n");
               exit(18);
           }
+          if (newfmt && fmtdiffers(&sin.fmt, format, rate, nrchannels)) {
+              /* switch when the data so far are played */
+              pending = 1;
+              fmtpos = icount;
+          }
           icount += s;
-          if (s == 0) {
+          if (s == 0 && ! newfmt) {
               moreinput = 0;
               break;
           }
-          iptr += s;
+          ringbuf_produce(&rb, s);
+          if (pending)
+              break;
       }
-      if (iptr - optr < olen*bytesperframe)
-          wnext = (iptr-optr)/bytesperframe;
+      if (ringbuf_fill(&rb) < olen*bytesperframe)
+          wnext = ringbuf_fill(&rb)/bytesperframe;
       else
           wnext = olen;
+      if (pending && wnext*bytesperframe > fmtpos - ocount)
+          wnext = (fmtpos - ocount)/bytesperframe;
 
       if (clock_gettime(CLOCK_MONOTONIC, &mtime) < 0) {
           fprintf(stderr, "playhrt: Cannot get monotonic clock.\n");
@@ -657,6 +812,7 @@ int main(int argc, char *argv[])
       if (verbose)
          fprintf(stderr, "playhrt: Start time (%ld sec %ld nsec).\n",
                          mtime.tv_sec, mtime.tv_nsec);
+      getrusage(RUSAGE_SELF, &ru0);
       for (count=1, off=looperr; 1; count++, off+=looperr) {
           /* compute time for next wakeup */
           mtime.tv_nsec += nsec;
@@ -664,6 +820,7 @@ int main(int argc, char *argv[])
             mtime.tv_nsec -= 1000000000;
             mtime.tv_sec++;
           }
+          optr = ringbuf_rptr(&rb);
           refreshmem(optr, wnext*bytesperframe);
           refreshmem(optr, wnext*bytesperframe);
           clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &mtime, NULL);
@@ -699,7 +856,7 @@ int main(int argc, char *argv[])
               badframes += (wnext - s);
           }
           ocount += s*bytesperframe;
-          optr += s*bytesperframe;
+          ringbuf_consume(&rb, s*bytesperframe);
           wnext = olen + wnext - s;
           if (off >= 1.0) {
              off -= 1.0;
@@ -711,37 +868,87 @@ int main(int argc, char *argv[])
                         wnext - olen - extra, mtime.tv_sec, mtime.tv_nsec);
              wnext = olen+extra-1;
           }
-          s = (iptr >= optr ? iptr - optr : iptr+blen-optr);
+          s = ringbuf_fill(&rb);
           if (s <= wnext*bytesperframe) {
               wnext = s/bytesperframe;
           }
-          if (optr+wnext*bytesperframe >= max) {
-              optr -= blen;
+          /* with a new format pending only data of the old one */
+          if (pending && fmtpos - ocount < wnext*bytesperframe) {
+              wnext = (fmtpos - ocount)/bytesperframe;
           }
           /* read if buffer not half filled */
-          if (moreinput && (iptr > optr ? iptr-optr : iptr+blen-optr) < hlen) {
+          if (moreinput && ! pending && ringbuf_fill(&rb) < hlen) {
+              iptr = ringbuf_wptr(&rb);
               memclean(iptr, ilen);
-              s = read(sfd, iptr, ilen);
+              s = readinput(sfd, sinp, iptr, ilen, &newfmt);
               if (s < 0) {
                   fprintf(stderr, "playhrt: Read error.\n");
                   exit(20);
-              } else if (s < ilen) {
+              } else if (s < ilen && ! newfmt) {
                   badreads++;
                   readmissing += (ilen-s);
               }
-              icount += s;
-              iptr += s;
-              /* copy input to beginning if we reach end of buffer */
-              if (iptr >= max) {
-                  memcpy(buf-(olen+extra)*bytesperframe,
-                                           max-(olen+extra)*bytesperframe,
-                                           iptr-max+(olen+extra)*bytesperframe);
-                  iptr -= blen;
+              if (newfmt && fmtdiffers(&sin.fmt, format, rate, nrchannels)) {
+                  pending = 1;
+                  fmtpos = icount;
+                  if (wnext*bytesperframe > fmtpos - ocount)
+                      wnext = (fmtpos - ocount)/bytesperframe;
               }
-              if (s == 0) { /* input complete */
+              icount += s;
+              ringbuf_produce(&rb, s);
+              if (s == 0 && ! newfmt) { /* input complete */
                   moreinput = 0;
               }
           }
+          if (wnext == 0 && pending) {
+              /* old format played (an incomplete frame is skipped), now
+                 set up the sound device for the new one */
+              ringbuf_consume(&rb, fmtpos - ocount);
+              ocount = fmtpos;
+              snd_pcm_drain(pcm_handle);
+              takeformat(&sin.fmt, &format, &rate, &nrchannels,
+                         &bytespersample);
+              bytesperframe = bytespersample*nrchannels;
+              looptiming(rate, bytesperframe, loopspersec, extrabps, minilen,
+                         &nsec, &olen, &ilen, &looperr, verbose);
+              if (blen < 3*ilen) {
+                  fprintf(stderr, "playhrt: Buffer too small for new format, "
+                                  "use larger --buffer-size.\n");
+                  exit(24);
+              }
+              setdevice(pcm_handle, access, format, rate, nrchannels,
+                        periodsize, &hwbufsize, verbose);
+              if (verbose)
+                  fprintf(stderr, "playhrt: New format %d:%s:%d.\n", rate,
+                          snd_pcm_format_name(format), nrchannels);
+              pending = 0;
+              /* start again with a half filled buffer */
+              while (moreinput && ! pending && ringbuf_fill(&rb) < blen - ilen) {
+                  iptr = ringbuf_wptr(&rb);
+                  memclean(iptr, ilen);
+                  s = readinput(sfd, sinp, iptr, ilen, &newfmt);
+                  if (s < 0) {
+                      fprintf(stderr, "playhrt: Read error.\n");
+                      exit(20);
+                  }
+                  if (newfmt && fmtdiffers(&sin.fmt, format, rate, nrchannels)) {
+                      pending = 1;
+                      fmtpos = icount;
+                  }
+                  icount += s;
+                  if (s == 0 && ! newfmt)
+                      moreinput = 0;
+                  ringbuf_produce(&rb, s);
+              }
+              wnext = ringbuf_fill(&rb)/bytesperframe;
+              if (wnext > olen)
+                  wnext = olen;
+              if (pending && wnext*bytesperframe > fmtpos - ocount)
+                  wnext = (fmtpos - ocount)/bytesperframe;
+              off = 0.0;
+              clock_gettime(CLOCK_MONOTONIC, &mtime);
+              continue;
+          }
           if (wnext == 0)
               break;    /* done */
       }
@@ -846,6 +1053,7 @@ int main(int argc, char *argv[])
       if (verbose)
          fprintf(stderr, "playhrt: Start time (%ld sec %ld nsec).\n",
                          mtime.tv_sec, mtime.tv_nsec);
+      getrusage(RUSAGE_SELF, &ru0);
       sumavg= 0;
       checktime = 0;
       for (count=1, off=looperr; 1; count++, off+=looperr) {
@@ -968,6 +1176,9 @@ int main(int argc, char *argv[])
         fprintf(stderr, "playhrt: Loops: %ld (%ld delayed), total bytes: %lld in %lld out. \n"
                         "playhrt: Bad loops/frames written: %ld/%lld,  bad reads/bytes: %ld/%ld.\n",
                     count, nrdelays, icount, ocount, badloops, badframes, badreads, readmissing);
+        getrusage(RUSAGE_SELF, &ru);
+        fprintf(stderr, "playhrt: Page faults in loop: %ld minor, %ld major.\n",
+                        ru.ru_minflt - ru0.ru_minflt, ru.ru_majflt - ru0.ru_majflt);
     }
     return 0;
 }
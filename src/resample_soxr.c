@@ -23,6 +23,7 @@ Compile with
 #include <sndfile.h>
 #include <soxr.h>
 #include "cprefresh.h"
+#include "stream.h"
 
 /* help page */
 /* vim hint to remove resp. add quotes:
@@ -165,6 +166,14 @@ void usage( ) {
 "      file given in --param-file was changed). Default is 44100, for high \n"
 "      sample rates a larger value may be desirable.\n"
 "\n"
+"  --framed, -M\n"
+"      input (from stdin) and output are framed streams (see 'catloop\n"
+"      --framed'). A format in the input (must be FLOAT64_LE) overrides\n"
+"      --inrate and --channels; when it changes, the resampler is flushed\n"
+"      and set up again, so the input sample rate can change without\n"
+"      restarting the chain. The output format (--outrate, FLOAT64_LE) is\n"
+"      passed on in the output stream.\n"
+"\n"
 "  --help, -h\n"
 "      show this help.\n"
 "\n"
@@ -291,6 +300,12 @@ int main(int argc, char *argv[])
   int delay, ndelay, change;
   long fadinglength, fadecount=-1;
   char *pnam;
+  /* variables for framed input/output */
+  int framed, newfmt, reconf;
+  long held;
+  size_t nbytes, incap;
+  struct streamin sin;
+  struct streamfmt ofmt, lastofmt;
   for(i=0; i<1024; carry[i] = 0.0, i++);
 
   if (argc == 1) {
@@ -317,6 +332,7 @@ int main(int argc, char *argv[])
       {"until", required_argument, 0, 'u' },
       {"number-frames", required_argument, 0, 'n' },
       {"buffer-length", required_argument, 0, 'b' },
+      {"framed", no_argument, 0, 'M' },
       {"verbose", no_argument, 0, 'p' },
       {"version", no_argument, 0, 'V' },
       {"help", no_argument, 0, 'h' },
@@ -342,6 +358,7 @@ int main(int argc, char *argv[])
   fadinglength = 44100;
   pnam = NULL;
   verbose = 0;
+  framed = 0;
   while ((optc = getopt_long(argc, argv, 
           "i:o:P:B:e:r:v:d:a:F:l:c:f:m:s:u:n:b:pVh",
           longoptions, &optind)) != -1) {
@@ -412,6 +429,9 @@ int main(int argc, char *argv[])
         pnam = strdup(optarg);
         getraceparams(pnam, &vol, &delay, &att, 1);
         break;
+      case 'M':
+        framed = 1;
+        break;
       case 'p':
         verbose = 1;
         break;
@@ -500,7 +520,8 @@ int main(int argc, char *argv[])
   }
 
   /* allocate buffer */
-  inp = (double*) malloc(nch*blen*sizeof(double));
+  incap = nch*blen*sizeof(double);
+  inp = (double*) malloc(incap);
   OLEN = (long)(blen*(outrate/inrate+1.0));
   out = (double*) malloc(nch*OLEN*sizeof(double));
   /* create resampler for 64 bit floats and high quality */
@@ -531,6 +552,12 @@ int main(int argc, char *argv[])
     exit(1);
   }
      
+  if (framed)
+      stream_initin(&sin, 0);
+  held = -1;
+  reconf = 0;
+  memset(&lastofmt, 0, sizeof(struct streamfmt));
+
   /* we read from stdin or file/shared mem until eof and write to stdout */
   while (1) {
     mlen = blen;
@@ -541,19 +568,37 @@ int main(int argc, char *argv[])
             mlen = total - intotal;
     }
     /* read input block */
-    memclean((char*)inp, nch*sizeof(double)*mlen);
-    if (sndfile) 
-        mlen = sf_readf_double(sndfile, inp, mlen);
-    else
-        mlen = fread((void*)inp, nch*sizeof(double), mlen, stdin);
-    if (mlen == 0) { 
-      /* done */
-      free(inp);
-      inp = NULL;
+    if (held >= 0) {
+        /* data in the new format, read before the flush */
+        mlen = held/(nch*sizeof(double));
+        held = -1;
+    } else {
+        memclean((char*)inp, nch*sizeof(double)*mlen);
+        if (sndfile) 
+            mlen = sf_readf_double(sndfile, inp, mlen);
+        else if (framed) {
+            nbytes = stream_readall(&sin, (void*)inp, nch*sizeof(double)*mlen,
+                                    &newfmt);
+            if (newfmt && sin.fmt.format != STREAM_FLOAT64_LE) {
+                fprintf(stderr, "resample_soxr: Input format must be "
+                                "FLOAT64_LE, not %s.\n",
+                                stream_fmtname(sin.fmt.format));
+                exit(8);
+            }
+            if (newfmt && ((double)sin.fmt.rate != inrate ||
+                           sin.fmt.channels != nch)) {
+                /* first flush the resampler with the old format */
+                held = nbytes;
+                reconf = 1;
+                mlen = 0;
+            } else
+                mlen = nbytes/(nch*sizeof(double));
+        } else
+            mlen = fread((void*)inp, nch*sizeof(double), mlen, stdin);
     }
-    /* call resampler */
+    /* call resampler, without input it is flushed */
     refreshmem((char*)inp, nch*sizeof(double)*mlen);
-    error = soxr_process(soxr, inp, mlen, &indone,
+    error = soxr_process(soxr, mlen > 0 ? inp : NULL, mlen, &indone,
                                out, OLEN, &outdone);
     if (mlen > indone) {
       fprintf(stderr, "resample_soxr: only %ld/%ld processed.\n",(long)indone,(long)mlen);
@@ -601,8 +646,21 @@ int main(int argc, char *argv[])
  
     /* write output */
     refreshmem((char*)out, nch*sizeof(double)*outdone);
-    check = fwrite((void*)out, nch*sizeof(double), outdone, stdout);
-    fflush(stdout);
+    if (framed) {
+        /* the output format is announced before its first data */
+        stream_setfmt(&ofmt, (long)outrate, STREAM_FLOAT64_LE, nch);
+        check = 0;
+        if (outdone > 0 && memcmp(&ofmt, &lastofmt, sizeof(ofmt)) != 0) {
+            check = stream_writehdr(1, &ofmt, 0) < 0 ? -1 : 0;
+            lastofmt = ofmt;
+        }
+        if (check == 0 && outdone > 0)
+            check = stream_writeframe(1, out, nch*sizeof(double)*outdone);
+        check = (check == 0) ? outdone : 0;
+    } else {
+        check = fwrite((void*)out, nch*sizeof(double), outdone, stdout);
+        fflush(stdout);
+    }
     memclean((char*)out, nch*sizeof(double)*outdone);
     /* this should not happen, the whole block should be written */
     if (check < outdone) {
@@ -612,6 +670,36 @@ int main(int argc, char *argv[])
     }
     intotal += mlen;
     outtotal += outdone;
+    if (reconf) {
+        /* set up the resampler for the new format */
+        soxr_delete(soxr);
+        inrate = (double)sin.fmt.rate;
+        nch = sin.fmt.channels;
+        if (nch*blen*sizeof(double) > incap) {
+            incap = nch*blen*sizeof(double);
+            inp = (double*) realloc(inp, incap);
+        }
+        OLEN = (long)(blen*(outrate/inrate+1.0));
+        free(out);
+        out = (double*) malloc(nch*OLEN*sizeof(double));
+        if (inp == NULL || out == NULL) {
+            fprintf(stderr, "resample_soxr: Cannot allocate buffers.\n");
+            exit(8);
+        }
+        for(i=0; i<1024; carry[i] = 0.0, i++);
+        sanitizeraceparams(&delay, &att, nch);
+        soxr = soxr_create(inrate, outrate, nch, &error, 
+                           &io_spec, &q_spec, &runtime_spec);
+        if (error) {
+            fprintf(stderr, "resample_soxr: Cannot initialize resampler.\n");
+            exit(1);
+        }
+        if (verbose)
+            fprintf(stderr, "resample_soxr: New input format, rate %.3f, "
+                            "%ld channels.\n", inrate, nch);
+        reconf = 0;
+        continue;
+    }
     if (mlen == 0)
       break;
 
@@ -641,6 +729,7 @@ int main(int argc, char *argv[])
     }
   }
   soxr_delete(soxr);
+  free(inp);
   free(out);
   if (verbose) {
     fprintf(stderr, "resample_soxr: %ld input and %ld output samples\n", 
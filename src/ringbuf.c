@@ -0,0 +1,107 @@
+/*
+ringbuf.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+A ring buffer whose memory is mapped twice back to back. So, reading or
+writing up to 'size' bytes from any position is contiguous in memory and
+no data need to be copied at the wrap around.
+*/
+
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include "ringbuf.h"
+
+/* sets up a ring buffer of at least size bytes (rounded up to a multiple
+   of the page size), returns 0 on success and -1 (with errno set)
+   otherwise */
+int ringbuf_init(struct ringbuf *rb, size_t size)
+{
+    int fd, e;
+    long psz;
+    char *p;
+
+    psz = sysconf(_SC_PAGESIZE);
+    size = ((size + psz - 1) / psz) * psz;
+    if ((fd = memfd_create("ringbuf", MFD_CLOEXEC)) < 0)
+        return -1;
+    if (ftruncate(fd, size) < 0)
+        goto fail;
+    /* reserve address space for both mappings, then put the memory
+       file twice into it */
+    p = mmap(NULL, 2*size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        goto fail;
+    if (mmap(p, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             fd, 0) == MAP_FAILED ||
+        mmap(p + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             fd, 0) == MAP_FAILED) {
+        e = errno;
+        munmap(p, 2*size);
+        errno = e;
+        goto fail;
+    }
+    close(fd);
+    rb->buf = p;
+    rb->size = size;
+    rb->rpos = 0;
+    rb->wpos = 0;
+    rb->fill = 0;
+    return 0;
+fail:
+    e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+}
+
+void ringbuf_free(struct ringbuf *rb)
+{
+    munmap(rb->buf, 2*rb->size);
+    rb->buf = NULL;
+}
+
+/* start of the data not yet consumed, ringbuf_fill(rb) bytes are
+   contiguous from here */
+char *ringbuf_rptr(struct ringbuf *rb)
+{
+    return rb->buf + rb->rpos;
+}
+
+/* where new data go, ringbuf_space(rb) bytes are contiguous from here */
+char *ringbuf_wptr(struct ringbuf *rb)
+{
+    return rb->buf + rb->wpos;
+}
+
+size_t ringbuf_fill(struct ringbuf *rb)
+{
+    return rb->fill;
+}
+
+size_t ringbuf_space(struct ringbuf *rb)
+{
+    return rb->size - rb->fill;
+}
+
+/* n bytes were written at ringbuf_wptr(rb), n <= ringbuf_space(rb) */
+void ringbuf_produce(struct ringbuf *rb, size_t n)
+{
+    rb->wpos += n;
+    if (rb->wpos >= rb->size)
+        rb->wpos -= rb->size;
+    rb->fill += n;
+}
+
+/* n bytes were used from ringbuf_rptr(rb), n <= ringbuf_fill(rb) */
+void ringbuf_consume(struct ringbuf *rb, size_t n)
+{
+    rb->rpos += n;
+    if (rb->rpos >= rb->size)
+        rb->rpos -= rb->size;
+    rb->fill -= n;
+}
@@ -0,0 +1,30 @@
+/*
+ringbuf.h                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+A ring buffer whose memory is mapped twice back to back. So, reading or
+writing up to 'size' bytes from any position is contiguous in memory and
+no data need to be copied at the wrap around.
+*/
+
+#include <stddef.h>
+
+struct ringbuf {
+    char *buf;      /* start of first mapping, second at buf+size */
+    size_t size;    /* multiple of the page size */
+    size_t rpos;    /* offset of next byte to read */
+    size_t wpos;    /* offset of next byte to write */
+    size_t fill;    /* number of bytes between rpos and wpos */
+};
+
+int ringbuf_init(struct ringbuf *rb, size_t size);
+void ringbuf_free(struct ringbuf *rb);
+char *ringbuf_rptr(struct ringbuf *rb);
+char *ringbuf_wptr(struct ringbuf *rb);
+size_t ringbuf_fill(struct ringbuf *rb);
+size_t ringbuf_space(struct ringbuf *rb);
+void ringbuf_produce(struct ringbuf *rb, size_t n);
+void ringbuf_consume(struct ringbuf *rb, size_t n);
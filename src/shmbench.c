@@ -0,0 +1,405 @@
+/*
+shmbench.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+*/
+
+#define _GNU_SOURCE
+#include "version.h"
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <semaphore.h>
+#include "shmring.h"
+
+/* help page */
+void usage( ) {
+  fprintf(stderr,
+          "shmbench (version %s of frankl's stereo utilities)\nUSAGE:\n",
+          VERSION);
+  fprintf(stderr,
+"\n"
+"  shmbench [options]\n"
+"\n"
+"  This program compares the two ways of passing data between processes\n"
+"  through shared memory: the chain of segments with two semaphores each\n"
+"  (as in 'writeloop --shared' and 'catloop --shared') and the ring\n"
+"  buffer (as with their --ring option).\n"
+"\n"
+"  For the throughput a writer process passes data in blocks to a reader\n"
+"  process which copies them to a private buffer (the reader of the ring\n"
+"  wakes up when a segment size is available). For the latency the\n"
+"  writer sends small messages with a time stamp, with a pause between\n"
+"  them such that the reader is waiting; the reader takes the time\n"
+"  after receiving a message. Percentiles of the latency are printed in\n"
+"  nsec.\n"
+"\n"
+"  OPTIONS\n"
+"\n"
+"  --bytes=intval, -n intval\n"
+"      number of bytes for the throughput test, default is 1000000000.\n"
+"\n"
+"  --block-size=intval, -b intval\n"
+"      size of the blocks written and read, default is 4096.\n"
+"\n"
+"  --file-size=intval, -f intval\n"
+"      size of each of the segments, the ring has the size of all\n"
+"      segments together; default is 64000.\n"
+"\n"
+"  --segments=intval, -s intval\n"
+"      number of segments, default is 3.\n"
+"\n"
+"  --messages=intval, -m intval\n"
+"      number of messages for the latency test, default is 10000.\n"
+"\n"
+"  --pause=intval, -p intval\n"
+"      pause between messages in usec, default is 200.\n"
+"\n"
+"  --busy-poll=intval, -P intval\n"
+"      the ring is polled up to intval times before sleeping, default 0.\n"
+"\n"
+"  --version, -V\n"
+"      print information about the version of the program and abort.\n"
+"\n"
+"  --help, -h\n"
+"      print this help page and abort.\n"
+"\n"
+"  EXAMPLE\n"
+"\n"
+"  shmbench --block-size=1024 --file-size=16000 --busy-poll=1000\n"
+"\n"
+);
+}
+
+#define MAXSEG 100
+
+/* the segment chain as created by 'writeloop --shared' */
+struct chain {
+    int n, size;
+    char *mems[MAXSEG], names[MAXSEG][32], tmpnames[MAXSEG][32];
+    sem_t *sems[MAXSEG], *semsw[MAXSEG];
+};
+
+void chain_create(struct chain *ch, int n, int size)
+{
+    int i, fd;
+
+    ch->n = n;
+    ch->size = size;
+    for (i = 0; i < n; i++) {
+        sprintf(ch->names[i], "/shmbench%d", i);
+        sprintf(ch->tmpnames[i], "/shmbench%d.TMP", i);
+        sem_unlink(ch->names[i]);
+        sem_unlink(ch->tmpnames[i]);
+        ch->sems[i] = sem_open(ch->names[i], O_CREAT, 0666, 0);
+        ch->semsw[i] = sem_open(ch->tmpnames[i], O_CREAT, 0666, 1);
+        fd = shm_open(ch->names[i], O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+        if (ch->sems[i] == SEM_FAILED || ch->semsw[i] == SEM_FAILED ||
+            fd < 0 || ftruncate(fd, sizeof(int)+size) < 0) {
+            fprintf(stderr, "shmbench: Cannot create segment %s.\n",
+                            ch->names[i]);
+            exit(2);
+        }
+        ch->mems[i] = mmap(NULL, sizeof(int)+size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+        close(fd);
+        if (ch->mems[i] == MAP_FAILED) {
+            fprintf(stderr, "shmbench: Cannot map segment %s.\n", ch->names[i]);
+            exit(2);
+        }
+    }
+}
+
+void chain_remove(struct chain *ch)
+{
+    int i;
+
+    for (i = 0; i < ch->n; i++) {
+        munmap(ch->mems[i], sizeof(int)+ch->size);
+        shm_unlink(ch->names[i]);
+        sem_unlink(ch->names[i]);
+        sem_unlink(ch->tmpnames[i]);
+    }
+}
+
+long long now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+int cmpll(const void *a, const void *b)
+{
+    long long x = *(long long*)a, y = *(long long*)b;
+    return (x > y) - (x < y);
+}
+
+/* sorts v and prints some percentiles */
+void percentiles(char *name, long long *v, long n)
+{
+    qsort(v, n, sizeof(long long), cmpll);
+    printf("%-22s %10lld %10lld %10lld %10lld %10lld\n", name,
+           v[0], v[n/2], v[(long)(0.9*(n-1))], v[(long)(0.99*(n-1))], v[n-1]);
+}
+
+/* writer side of the chain: fills segments with blocks, if stamp is set
+   each block is one message with a time stamp */
+void chain_write(struct chain *ch, long long bytes, int bsize, int stamp,
+                 int pause)
+{
+    long long done;
+    int k, fill;
+    char *blk;
+
+    blk = malloc(bsize);
+    memset(blk, 1, bsize);
+    for (k = 0, done = 0; done < bytes; k = (k+1) % ch->n) {
+        sem_wait(ch->semsw[k]);
+        for (fill = 0; fill + bsize <= ch->size && done < bytes; ) {
+            if (stamp)
+                *((long long*)blk) = now();
+            memcpy(ch->mems[k] + sizeof(int) + fill, blk, bsize);
+            fill += bsize;
+            done += bsize;
+            if (stamp)
+                break;
+        }
+        *((int*)(ch->mems[k])) = fill;
+        sem_post(ch->sems[k]);
+        if (pause)
+            usleep(pause);
+    }
+    /* empty segment at the end */
+    sem_wait(ch->semsw[k]);
+    *((int*)(ch->mems[k])) = 0;
+    sem_post(ch->sems[k]);
+    free(blk);
+}
+
+/* reader side of the chain, with lat the latencies of messages */
+void chain_read(struct chain *ch, int bsize, long long *lat)
+{
+    int k, len, off;
+    long n;
+    char *blk;
+
+    blk = malloc(bsize);
+    for (k = 0, n = 0; ; k = (k+1) % ch->n) {
+        sem_wait(ch->sems[k]);
+        len = *((int*)(ch->mems[k]));
+        if (len == 0)
+            break;
+        if (lat)
+            lat[n++] = now() - *((long long*)(ch->mems[k] + sizeof(int)));
+        for (off = 0; off < len; off += bsize)
+            memcpy(blk, ch->mems[k] + sizeof(int) + off, bsize);
+        sem_post(ch->semsw[k]);
+    }
+    free(blk);
+}
+
+void ring_write(struct shmring *r, long long bytes, int bsize, int stamp,
+                int pause)
+{
+    long long done;
+    char *blk;
+
+    blk = malloc(bsize);
+    memset(blk, 1, bsize);
+    for (done = 0; done < bytes; done += bsize) {
+        shmring_wait_space(r, bsize);
+        if (stamp)
+            *((long long*)blk) = now();
+        memcpy(shmring_wptr(r), blk, bsize);
+        shmring_produce(r, bsize);
+        if (pause)
+            usleep(pause);
+    }
+    shmring_close_write(r);
+    free(blk);
+}
+
+void ring_read(struct shmring *r, int bsize, long long *lat)
+{
+    long n;
+    char *blk;
+
+    blk = malloc(bsize);
+    for (n = 0; shmring_wait_fill(r, bsize) >= bsize; ) {
+        if (lat)
+            lat[n++] = now() - *((long long*)shmring_rptr(r));
+        memcpy(blk, shmring_rptr(r), bsize);
+        shmring_consume(r, bsize);
+    }
+    free(blk);
+}
+
+/* number of context switches of this process and the finished children */
+long switches()
+{
+    struct rusage ru, rc;
+
+    getrusage(RUSAGE_SELF, &ru);
+    getrusage(RUSAGE_CHILDREN, &rc);
+    return ru.ru_nvcsw + ru.ru_nivcsw + rc.ru_nvcsw + rc.ru_nivcsw;
+}
+
+/* runs writer in this process and reader in a child, returns nsec; the
+   child prints latency percentiles if nmsg > 0 */
+long long run(int ring, struct chain *ch, struct shmring *r, long long bytes,
+              int bsize, long nmsg, int pause, char *name)
+{
+    pid_t pid;
+    long long t0, *lat;
+
+    fflush(stdout);
+    t0 = now();
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "shmbench: Cannot fork.\n");
+        exit(3);
+    }
+    if (pid == 0) {
+        lat = NULL;
+        if (nmsg > 0 && (lat = malloc(nmsg * sizeof(long long))) == NULL)
+            exit(4);
+        /* for throughput wake up for a segment size as with semaphores */
+        if (nmsg == 0)
+            r->batch = ch->size;
+        if (ring)
+            ring_read(r, bsize, lat);
+        else
+            chain_read(ch, bsize, lat);
+        if (lat)
+            percentiles(name, lat, nmsg);
+        exit(0);
+    }
+    if (ring)
+        ring_write(r, bytes, bsize, nmsg > 0, pause);
+    else
+        chain_write(ch, bytes, bsize, nmsg > 0, pause);
+    waitpid(pid, NULL, 0);
+    return now() - t0;
+}
+
+int main(int argc, char *argv[])
+{
+    int optc, bsize, fsize, nseg, pause;
+    long nmsg, spin, sw;
+    long long bytes, t;
+    struct chain ch;
+    struct shmring r;
+
+    static struct option longoptions[] = {
+        {"bytes", required_argument, 0, 'n' },
+        {"block-size", required_argument, 0, 'b' },
+        {"file-size", required_argument, 0, 'f' },
+        {"segments", required_argument, 0, 's' },
+        {"messages", required_argument, 0, 'm' },
+        {"pause", required_argument, 0, 'p' },
+        {"busy-poll", required_argument, 0, 'P' },
+        {"version", no_argument, 0, 'V' },
+        {"help", no_argument, 0, 'h' },
+        {0,         0,                 0,  0 }
+    };
+
+    bytes = 1000000000;
+    bsize = 4096;
+    fsize = 64000;
+    nseg = 3;
+    nmsg = 10000;
+    pause = 200;
+    spin = 0;
+    while ((optc = getopt_long(argc, argv, "n:b:f:s:m:p:P:Vh",
+            longoptions, &optind)) != -1) {
+        switch (optc) {
+        case 'n':
+          bytes = atoll(optarg);
+          break;
+        case 'b':
+          bsize = atoi(optarg);
+          break;
+        case 'f':
+          fsize = atoi(optarg);
+          break;
+        case 's':
+          nseg = atoi(optarg);
+          break;
+        case 'm':
+          nmsg = atol(optarg);
+          break;
+        case 'p':
+          pause = atoi(optarg);
+          break;
+        case 'P':
+          spin = atol(optarg);
+          break;
+        case 'V':
+          fprintf(stderr,
+                  "shmbench (version %s of frankl's stereo utilities)\n",
+                  VERSION);
+          exit(0);
+        default:
+          usage();
+          exit(1);
+        }
+    }
+    if (bsize < (int)sizeof(long long) || bsize > fsize || nseg < 2 ||
+        nseg > MAXSEG) {
+        fprintf(stderr, "shmbench: Need 8 <= block size <= file size and "
+                        "2 to %d segments.\n", MAXSEG);
+        exit(1);
+    }
+    bytes -= bytes % bsize;
+
+    chain_create(&ch, nseg, fsize);
+    shmring_unlink("/shmbenchring");
+    if (shmring_create(&r, "/shmbenchring", (size_t)nseg*fsize, 0, 1) < 0) {
+        fprintf(stderr, "shmbench: Cannot create ring (%s).\n", strerror(errno));
+        exit(2);
+    }
+    r.spin = spin;
+
+    printf("Throughput, %lld bytes in blocks of %d:\n", bytes, bsize);
+    sw = switches();
+    t = run(0, &ch, &r, bytes, bsize, 0, 0, NULL);
+    printf("  semaphores  %10.1f MB/sec, %ld context switches\n",
+           1000.0*bytes/t, switches() - sw);
+    sw = switches();
+    t = run(1, &ch, &r, bytes, bsize, 0, 0, NULL);
+    printf("  ring        %10.1f MB/sec, %ld context switches\n",
+           1000.0*bytes/t, switches() - sw);
+
+    /* fresh objects for the latency test */
+    chain_remove(&ch);
+    shmring_free(&r);
+    chain_create(&ch, nseg, fsize);
+    if (shmring_create(&r, "/shmbenchring", (size_t)nseg*fsize, 0, 1) < 0) {
+        fprintf(stderr, "shmbench: Cannot create ring (%s).\n", strerror(errno));
+        exit(2);
+    }
+    r.spin = spin;
+    printf("\nLatency (nsec), %ld messages, pause %d usec:\n", nmsg, pause);
+    printf("%-22s %10s %10s %10s %10s %10s\n", "", "min", "median", "90%",
+           "99%", "max");
+    run(0, &ch, &r, nmsg*8, 8, nmsg, pause, "  semaphores");
+    run(1, &ch, &r, nmsg*8, 8, nmsg, pause, "  ring");
+
+    chain_remove(&ch);
+    shmring_free(&r);
+    shmring_unlink("/shmbenchring");
+    return 0;
+}
@@ -0,0 +1,486 @@
+/*
+shmcache.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+*/
+
+#define _GNU_SOURCE
+#include "version.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "shmload.h"
+
+/* where the shared memory objects appear in the file system */
+#define SHMDIR "/dev/shm"
+#define CACHEPREFIX "hrtcache."
+
+/* help page */
+/* vim hint to remove resp. add quotes:
+      s/^"\(.*\)\\n"$/\1/
+      s/.*$/"\0\\n"/
+*/
+void usage( ) {
+  fprintf(stderr,
+          "shmcache (version %s of frankl's stereo utilities)\nUSAGE:\n",
+          VERSION);
+  fprintf(stderr,
+"\n"
+"  shmcache --get=<file> [options]\n"
+"  shmcache --daemon --control=<fifo> [options]\n"
+"\n"
+"  This program keeps music files in shared memory, such that playing\n"
+"  them does not wait for the disk, and files which are played again\n"
+"  are not loaded again.\n"
+"\n"
+"  With --get the file is loaded into shared memory (if it is not\n"
+"  already there) and the name of the shared memory area is written to\n"
+"  stdout; it can be used with the --shmname options of 'shmcat'\n"
+"  (together with --keep), 'cat64' and 'resample_soxr'. The name is\n"
+"  derived from the device, inode, size and modification time of the\n"
+"  file, so a file which is changed gets a new name.\n"
+"\n"
+"  The cached files use at most --budget bytes of memory; before a new\n"
+"  file is loaded the least recently used files are removed.\n"
+"\n"
+"  With --daemon the program keeps running (it does not detach itself,\n"
+"  start it with '&') and reads file names from a named pipe (created\n"
+"  if it does not exist). Each name is the file which is played now: it\n"
+"  is loaded if necessary, then the next files in the --playlist are\n"
+"  loaded in advance. A 'shmcache --get' with the same --control option\n"
+"  tells the daemon the file it has asked for.\n"
+"\n"
+"  OPTIONS\n"
+"\n"
+"  --get=name, -g name\n"
+"      make the file available in shared memory and print the name of\n"
+"      the shared memory area.\n"
+"\n"
+"  --name=name, -n name\n"
+"      only print the name of the shared memory area for the file.\n"
+"\n"
+"  --daemon, -d\n"
+"      keep running and serve the --control pipe, see above.\n"
+"\n"
+"  --control=name, -c name\n"
+"      the named pipe on which the daemon listens.\n"
+"\n"
+"  --playlist=name, -p name\n"
+"      a file with one file name per line (lines starting with '#' are\n"
+"      ignored), it is read again for each file played.\n"
+"\n"
+"  --prefetch=intval, -f intval\n"
+"      the number of files after the one played which are loaded in\n"
+"      advance. The default is 2.\n"
+"\n"
+"  --budget=intval, -b intval\n"
+"      the maximal memory for cached files in bytes. The default is\n"
+"      1 GB. A single file larger than this is still loaded.\n"
+"\n"
+"  --threads=intval, -t intval\n"
+"      the number of threads reading a file in parallel, see 'cptoshm'.\n"
+"      The default is 4.\n"
+"\n"
+"  --verbose, -v\n"
+"      print some information during operation.\n"
+"\n"
+"  --version, -V\n"
+"      print information about the version of the program and abort.\n"
+"\n"
+"  --help, -h\n"
+"      print this help page and abort.\n"
+"\n"
+"  EXAMPLES\n"
+"\n"
+"  Start the daemon for a playlist:\n"
+"\n"
+"  shmcache --daemon --control=/tmp/shmcache.ctl \\\n"
+"           --playlist=/tmp/playlist --budget=2000000000 &\n"
+"\n"
+"  and use in a play script instead of 'cptoshm':\n"
+"\n"
+"  NAME=`shmcache --get=\"$1\" --control=/tmp/shmcache.ctl`\n"
+"  shmcat --keep --shmname=$NAME | ...\n"
+"\n"
+);
+}
+
+struct cacheentry {
+    char name[64];
+    off_t size;
+    struct timespec mtime;
+};
+
+static int verbose;
+
+/* name of the shared memory area for a file, the size of the file is
+   stored in *size, returns -1 if the file cannot be read; the name is
+   derived from the metadata, not from part of the content: two files
+   of equal size with equal start and end would get the same name and
+   the wrong data would be played, hashing the whole file on each
+   --get would read it from disk, which the cache should avoid */
+int cachename(char *path, char *name, size_t *size)
+{
+    uint64_t h, key[5];
+    unsigned char *p;
+    struct stat sb;
+    size_t k;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    *size = sb.st_size;
+    /* FNV-1a over device, inode, size and modification time */
+    key[0] = sb.st_dev;
+    key[1] = sb.st_ino;
+    key[2] = sb.st_size;
+    key[3] = sb.st_mtim.tv_sec;
+    key[4] = sb.st_mtim.tv_nsec;
+    h = 14695981039346656037ULL;
+    for (p = (unsigned char*)key, k = 0; k < sizeof(key); k++) {
+        h ^= p[k];
+        h *= 1099511628211ULL;
+    }
+    sprintf(name, "/%s%016llx", CACHEPREFIX, (unsigned long long)h);
+    return 0;
+}
+
+static int cmpentry(const void *a, const void *b)
+{
+    struct timespec *ta = &((struct cacheentry*)a)->mtime;
+    struct timespec *tb = &((struct cacheentry*)b)->mtime;
+    if (ta->tv_sec != tb->tv_sec)
+        return (ta->tv_sec > tb->tv_sec) - (ta->tv_sec < tb->tv_sec);
+    return (ta->tv_nsec > tb->tv_nsec) - (ta->tv_nsec < tb->tv_nsec);
+}
+
+/* removes least recently used files until need more bytes fit into
+   the budget, the file keep is never removed */
+void evict(size_t budget, size_t need, char *keep)
+{
+    DIR *dir;
+    struct dirent *de;
+    struct stat sb;
+    struct cacheentry *ents, *tmp;
+    int n, max, k;
+    size_t total;
+    char path[1024];
+
+    if ((dir = opendir(SHMDIR)) == NULL)
+        return;
+    n = 0;
+    max = 64;
+    ents = malloc(max*sizeof(struct cacheentry));
+    total = 0;
+    while (ents && (de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, CACHEPREFIX, strlen(CACHEPREFIX)) != 0 ||
+            strlen(de->d_name) >= 63 || strstr(de->d_name, ".part") != NULL)
+            continue;
+        snprintf(path, 1024, "%s/%s", SHMDIR, de->d_name);
+        if (stat(path, &sb) == -1)
+            continue;
+        if (n == max) {
+            max *= 2;
+            if ((tmp = realloc(ents, max*sizeof(struct cacheentry))) == NULL)
+                break;
+            ents = tmp;
+        }
+        sprintf(ents[n].name, "/%s", de->d_name);
+        ents[n].size = sb.st_size;
+        ents[n].mtime = sb.st_mtim;
+        total += sb.st_size;
+        n++;
+    }
+    closedir(dir);
+    if (ents == NULL)
+        return;
+    qsort(ents, n, sizeof(struct cacheentry), cmpentry);
+    for (k = 0; k < n && total + need > budget; k++) {
+        if (keep && strcmp(ents[k].name, keep) == 0)
+            continue;
+        if (shm_unlink(ents[k].name) == 0) {
+            total -= ents[k].size;
+            if (verbose)
+                fprintf(stderr, "shmcache: Removed %s (%ld bytes).\n",
+                        ents[k].name, (long)ents[k].size);
+        }
+    }
+    free(ents);
+}
+
+/* loads the file into the shared memory area name; it is first loaded
+   under name.part, locked, and renamed when complete, so that several
+   processes can ask for the same file */
+int loadfile(char *path, char *name, size_t size, int nthreads)
+{
+    char part[80], ppath[1024], fpath[1024];
+    struct stat sa, sb;
+    int fd, ifd;
+    size_t done;
+    char *mem;
+
+    snprintf(part, 80, "%s.part", name);
+    snprintf(ppath, 1024, "%s%s", SHMDIR, part);
+    snprintf(fpath, 1024, "%s%s", SHMDIR, name);
+    while (1) {
+        if (stat(fpath, &sb) == 0)
+            return 0;
+        if ((fd = shm_open(part, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) == -1)
+            return -1;
+        if (flock(fd, LOCK_EX) == -1) {
+            close(fd);
+            return -1;
+        }
+        /* has another process finished it while we waited? */
+        if (fstat(fd, &sa) == -1 || stat(ppath, &sb) == -1 ||
+            sa.st_ino != sb.st_ino) {
+            close(fd);
+            continue;
+        }
+        if ((ifd = open(path, O_RDONLY)) == -1) {
+            shm_unlink(part);
+            close(fd);
+            return -1;
+        }
+        if (size > 0) {
+            if (ftruncate(fd, size) == -1) {
+                shm_unlink(part);
+                close(fd);
+                close(ifd);
+                return -1;
+            }
+            mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mem == MAP_FAILED) {
+                shm_unlink(part);
+                close(fd);
+                close(ifd);
+                return -1;
+            }
+            done = shmload_read(ifd, 1, mem, size, nthreads, 4194304, 1,
+                                NULL);
+            munmap(mem, size);
+            if (done == (size_t)-1 || (done < size && ftruncate(fd, done) == -1)) {
+                shm_unlink(part);
+                close(fd);
+                close(ifd);
+                return -1;
+            }
+        }
+        close(ifd);
+        if (rename(ppath, fpath) == -1) {
+            shm_unlink(part);
+            close(fd);
+            return -1;
+        }
+        close(fd);
+        return 0;
+    }
+}
+
+/* makes the file available in the cache, its shared memory name is
+   stored in name */
+int getfile(char *path, char *name, size_t budget, int nthreads, char *keep)
+{
+    char fpath[1024];
+    size_t size;
+
+    if (cachename(path, name, &size) == -1)
+        return -1;
+    snprintf(fpath, 1024, "%s%s", SHMDIR, name);
+    /* mark as recently used */
+    if (utimensat(AT_FDCWD, fpath, NULL, 0) == 0)
+        return 0;
+    evict(budget, size, keep);
+    if (verbose)
+        fprintf(stderr, "shmcache: Loading %s into %s.\n", path, name);
+    return loadfile(path, name, size, nthreads);
+}
+
+/* loads the next files after path in the playlist */
+void prefetch(char *playlist, char *path, int num, size_t budget,
+              int nthreads, char *keep)
+{
+    FILE *pl;
+    char line[4096], name[80];
+    int found, len;
+
+    if (playlist == NULL || num <= 0 || (pl = fopen(playlist, "r")) == NULL)
+        return;
+    found = 0;
+    while (num > 0 && fgets(line, 4096, pl) != NULL) {
+        len = strlen(line);
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+        if (! found) {
+            found = (strcmp(line, path) == 0);
+            continue;
+        }
+        if (getfile(line, name, budget, nthreads, keep) == -1) {
+            if (verbose)
+                fprintf(stderr, "shmcache: Cannot load %s.\n", line);
+        }
+        num--;
+    }
+    fclose(pl);
+}
+
+int main(int argc, char *argv[])
+{
+    char *get, *only, *control, *playlist, line[4096], name[80];
+    int optc, daemon, num, nthreads, cfd, len;
+    size_t budget, size;
+    FILE *ctl;
+
+    /* read command line options */
+    static struct option longoptions[] = {
+        {"get", required_argument, 0, 'g' },
+        {"name", required_argument, 0, 'n' },
+        {"daemon", no_argument, 0, 'd' },
+        {"control", required_argument, 0, 'c' },
+        {"playlist", required_argument, 0, 'p' },
+        {"prefetch", required_argument, 0, 'f' },
+        {"budget", required_argument, 0, 'b' },
+        {"threads", required_argument, 0, 't' },
+        {"verbose", no_argument, 0, 'v' },
+        {"version", no_argument, 0, 'V' },
+        {"help", no_argument, 0, 'h' },
+        {0,         0,                 0,  0 }
+    };
+
+    if (argc == 1) {
+       usage();
+       exit(0);
+    }
+    /* defaults */
+    get = NULL;
+    only = NULL;
+    daemon = 0;
+    control = NULL;
+    playlist = NULL;
+    num = 2;
+    budget = 1073741824;
+    nthreads = 4;
+    verbose = 0;
+    while ((optc = getopt_long(argc, argv, "g:n:dc:p:f:b:t:vVh",
+            longoptions, &optind)) != -1) {
+        switch (optc) {
+        case 'g':
+          get = optarg;
+          break;
+        case 'n':
+          only = optarg;
+          break;
+        case 'd':
+          daemon = 1;
+          break;
+        case 'c':
+          control = optarg;
+          break;
+        case 'p':
+          playlist = optarg;
+          break;
+        case 'f':
+          num = atoi(optarg);
+          break;
+        case 'b':
+          budget = atoll(optarg);
+          break;
+        case 't':
+          nthreads = atoi(optarg);
+          if (nthreads < 1 || nthreads > 64) {
+              fprintf(stderr, "shmcache: Number of threads must be in 1..64.\n");
+              exit(2);
+          }
+          break;
+        case 'v':
+          verbose = 1;
+          break;
+        case 'V':
+          fprintf(stderr,
+                  "shmcache (version %s of frankl's stereo utilities)\n",
+                  VERSION);
+          exit(0);
+        default:
+          usage();
+          exit(0);
+        }
+    }
+    if (only) {
+        if (cachename(only, name, &size) == -1) {
+            fprintf(stderr, "shmcache: Cannot read %s.\n", only);
+            exit(3);
+        }
+        printf("%s\n", name);
+        exit(0);
+    }
+    if (get) {
+        if (getfile(get, name, budget, nthreads, NULL) == -1) {
+            fprintf(stderr, "shmcache: Cannot load %s.\n", get);
+            exit(4);
+        }
+        printf("%s\n", name);
+        fflush(stdout);
+        /* tell a running daemon, if there is none we don't wait */
+        if (control &&
+            (cfd = open(control, O_WRONLY | O_NONBLOCK)) != -1) {
+            snprintf(line, 4096, "%s\n", get);
+            if (write(cfd, line, strlen(line)) == -1 && verbose)
+                fprintf(stderr, "shmcache: Cannot notify daemon.\n");
+            close(cfd);
+        }
+        exit(0);
+    }
+    if (! daemon || ! control) {
+        fprintf(stderr, "shmcache: Need --get, --name or --daemon with "
+                        "--control.\n");
+        exit(5);
+    }
+    if (mkfifo(control, S_IRUSR | S_IWUSR) == -1 && errno != EEXIST) {
+        fprintf(stderr, "shmcache: Cannot create named pipe %s.\n", control);
+        exit(6);
+    }
+    /* opened for writing as well, so we never see end of file */
+    if ((cfd = open(control, O_RDWR)) == -1 ||
+        (ctl = fdopen(cfd, "r")) == NULL) {
+        fprintf(stderr, "shmcache: Cannot open named pipe %s.\n", control);
+        exit(6);
+    }
+    if (verbose)
+        fprintf(stderr, "shmcache: Listening on %s.\n", control);
+    while (fgets(line, 4096, ctl) != NULL) {
+        len = strlen(line);
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (getfile(line, name, budget, nthreads, NULL) == -1) {
+            if (verbose)
+                fprintf(stderr, "shmcache: Cannot load %s.\n", line);
+            continue;
+        }
+        if (verbose)
+            fprintf(stderr, "shmcache: Playing %s from %s.\n", line, name);
+        prefetch(playlist, line, num, budget, nthreads, name);
+    }
+    exit(0);
+}
@@ -4,6 +4,7 @@
 */
 
 #include "version.h"
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <getopt.h>
@@ -13,7 +14,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
 #include "cprefresh.h"
+#include "shmload.h"
+#include "shmmem.h"
 
 void usage( ) {
   fprintf(stderr,
@@ -32,6 +37,24 @@ void usage( ) {
 "\n"
 "  You may create the shared memory file with 'cptoshm'.\n"
 "\n"
+"  With the '--splice' option and stdout a pipe the pages of the shared\n"
+"  memory are passed to the pipe by reference (vmsplice) instead of being\n"
+"  copied. If blksize is a multiple of the page size the pages are given\n"
+"  to the kernel (they are not used afterwards anyway, unless --keep is\n"
+"  given) and the pipe is resized to hold a whole number of blocks.\n"
+"\n"
+"  With '--stream' the output starts while 'cptoshm --progress' is still\n"
+"  loading the shared memory file (the program waits for it to appear);\n"
+"  it writes what is loaded and waits when it has caught up.\n"
+"\n"
+"  With '--lock-memory' the shared memory is locked in memory while it is\n"
+"  written, with '--populate' all its pages are mapped at the start, so\n"
+"  that no page faults happen during output (with '--verbose' the page\n"
+"  faults during output are shown at the end).\n"
+"\n"
+"  With '--keep' the shared memory file is not deleted, e.g. for files\n"
+"  cached by 'shmcache'.\n"
+"\n"
 "  The program also support the '--version' option to display its version\n"
 "  and the '--verbose' option to display when it is starting.\n"
 "\n"
@@ -41,15 +64,25 @@ void usage( ) {
 int main(int argc, char *argv[])
 {
   char *memname;
-  int fd, optc, verbose;
-  size_t length, blen, done, wlen;
+  int fd, optc, verbose, dosplice, gift, psz, keep, stream, complete;
+  size_t length, blen, done, wlen, avail;
+  struct shmload_progress *prog;
+  struct rusage ru;
+  int memflags;
   struct stat sb;
   char *mem, *ptr;
+  struct iovec iov;
+  ssize_t ret;
 
   /* read command line options */
   static struct option longoptions[] = {
       {"shmname", required_argument, 0, 'i' },
       {"block-size", required_argument, 0,  'b' },
+      {"splice", no_argument, 0, 'z' },
+      {"keep", no_argument, 0, 'k' },
+      {"stream", no_argument, 0, 'S' },
+      {"lock-memory", no_argument, 0, 'E' },
+      {"populate", no_argument, 0, 'y' },
       {"verbose", no_argument, 0, 'v' },
       {"version", no_argument, 0, 'V' },
       {"help", no_argument, 0, 'h' },
@@ -63,6 +96,10 @@ int main(int argc, char *argv[])
   blen = 8192;
   memname = NULL;
   verbose = 0;
+  dosplice = 0;
+  keep = 0;
+  stream = 0;
+  memflags = 0;
   while ((optc = getopt_long(argc, argv, "i:b:Vh",
           longoptions, &optind)) != -1) {
       switch (optc) {
@@ -72,6 +109,21 @@ int main(int argc, char *argv[])
       case 'b':
         blen = atoi(optarg);
         break;
+      case 'z':
+        dosplice = 1;
+        break;
+      case 'k':
+        keep = 1;
+        break;
+      case 'S':
+        stream = 1;
+        break;
+      case 'E':
+        memflags |= SHMMEM_LOCK;
+        break;
+      case 'y':
+        memflags |= SHMMEM_POPULATE;
+        break;
       case 'v':
         verbose = 1;
         break;
@@ -90,6 +142,19 @@ int main(int argc, char *argv[])
       fprintf(stderr, "shmcat: Need --shmname argument . . . bye.\n");
       exit(7);
   }
+  prog = NULL;
+  if (stream) {
+      /* wait until the loader has started, or the file is complete */
+      while ((prog = shmload_progress(memname, 0, 0)) == NULL) {
+          if ((fd = shm_open(memname, O_RDWR, 0)) != -1) {
+              psz = (fstat(fd, &sb) == 0 && sb.st_size > 0);
+              close(fd);
+              if (psz)
+                  break;
+          }
+          usleep(10000);
+      }
+  }
   if ((fd = shm_open(memname, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) == -1){
       fprintf(stderr, "shmcat: Cannot open memory %s.\n", memname);
       exit(3);
@@ -99,31 +164,95 @@ int main(int argc, char *argv[])
       exit(4);
   }
   length = sb.st_size;
-  mem = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (prog) {
+      /* the loader truncates the area to its length after publishing
+         the progress object; --lock-memory and --populate need the
+         pages to exist, so wait until they do */
+      length = atomic_load(&prog->length);
+      while (sb.st_size < (off_t)length && !atomic_load(&prog->complete)) {
+          usleep(1000);
+          if (fstat(fd, &sb) == -1) {
+              fprintf(stderr, "shmcat: Cannot stat shared memory %s.\n",
+                      memname);
+              exit(4);
+          }
+      }
+      if (sb.st_size < (off_t)length)
+          length = sb.st_size;
+  }
+  shmmem_config(NULL, memflags);
+  mem = shmmem_map(fd, length, PROT_READ | PROT_WRITE);
   if (mem == MAP_FAILED) {
       fprintf(stderr, "shmcat: Cannot map shared memory.\n");
       exit(6);
   }
   ptr = mem;
   done = 0;
+  if (dosplice && (fstat(1, &sb) == -1 || !S_ISFIFO(sb.st_mode))) {
+      dosplice = 0;
+      if (verbose)
+          fprintf(stderr, "shmcat: Output is not a pipe, not using "
+                          "--splice.\n");
+  }
+  gift = 0;
+  if (dosplice && ! keep && blen % getpagesize() == 0) {
+      /* the mapping is page aligned, so are all blocks */
+      gift = SPLICE_F_GIFT;
+      psz = fcntl(1, F_GETPIPE_SZ);
+      if (psz > 0 && psz % blen != 0)
+          fcntl(1, F_SETPIPE_SZ, (psz/blen + 1)*blen);
+  }
   if (verbose)
       fprintf(stderr, "shmcat: Starting.\n");
-  while (done < length-blen) {
-      refreshmem(ptr, blen);
-      refreshmem(ptr, blen);
-      wlen = write(1, ptr, blen);
-      done += wlen;
-      ptr += wlen;
+  getrusage(RUSAGE_SELF, &ru);
+  avail = length;
+  complete = 1;
+  if (prog)
+      avail = shmload_wait(prog, 0, &complete);
+  while (1) {
+      if (dosplice) {
+          /* the pipe keeps references to the pages, so they stay valid
+             after unlinking until they are read */
+          while (done < avail) {
+              iov.iov_base = ptr;
+              iov.iov_len = (avail-done < blen) ? avail-done : blen;
+              refreshmem(ptr, iov.iov_len);
+              refreshmem(ptr, iov.iov_len);
+              ret = vmsplice(1, &iov, 1, gift);
+              if (ret == -1) {
+                  fprintf(stderr, "shmcat: vmsplice error: %s.\n",
+                                  strerror(errno));
+                  exit(8);
+              }
+              done += ret;
+              ptr += ret;
+          }
+      }
+      while (done + blen < avail) {
+          refreshmem(ptr, blen);
+          refreshmem(ptr, blen);
+          wlen = write(1, ptr, blen);
+          done += wlen;
+          ptr += wlen;
+      }
+      if (complete)
+          break;
+      /* wait for the loader */
+      avail = shmload_wait(prog, avail, &complete);
   }
-  while (done < length) {
-      wlen = write(1, ptr, length-done);
+  while (done < avail) {
+      wlen = write(1, ptr, avail-done);
       done += wlen;
       ptr += wlen;
   }
-  if (shm_unlink(memname) == -1) {
+  if (verbose)
+      shmmem_faults("shmcat", &ru);
+  if (! keep && shm_unlink(memname) == -1) {
       fprintf(stderr, "shmcat: Cannot unlink shared memory.\n");
       exit(7);
   }
+  if (! keep)
+      shmload_unlinkprogress(memname);
   exit(0);
 }
 
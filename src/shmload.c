@@ -0,0 +1,263 @@
+/*
+shmload.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Loading files into shared memory, see shmload.h.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "cprefresh.h"
+#include "shmload.h"
+
+/* part of the input file read by one thread */
+struct loadpart {
+    int ifd, refresh, nparts;
+    char *mem;
+    size_t off, len, bufsize;
+    _Atomic size_t done;
+    struct loadpart *all;
+    struct shmload_progress *prog;
+};
+
+/* name of the companion object */
+static void progname(char *name, char *pname)
+{
+    snprintf(pname, 1024, "%s.LOAD", name);
+}
+
+/* opens (or creates, with the given length of the shared memory area)
+   the progress object of name, returns NULL if it does not exist */
+struct shmload_progress *shmload_progress(char *name, int create,
+                                          size_t length)
+{
+    struct shmload_progress *p;
+    char pname[1024];
+    struct stat sb;
+    int fd;
+
+    progname(name, pname);
+    if (create)
+        fd = shm_open(pname, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+    else
+        fd = shm_open(pname, O_RDWR, 0);
+    if (fd == -1)
+        return NULL;
+    if (create && ftruncate(fd, sizeof(struct shmload_progress)) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if (fstat(fd, &sb) == -1 || sb.st_size < sizeof(struct shmload_progress)) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, sizeof(struct shmload_progress), PROT_READ | PROT_WRITE,
+             MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return NULL;
+    if (create) {
+        atomic_store(&p->length, length);
+        atomic_store(&p->done, 0);
+        atomic_store(&p->complete, 0);
+        memcpy(p->magic, SHMLOAD_MAGIC, 8);
+    } else if (memcmp(p->magic, SHMLOAD_MAGIC, 8) != 0) {
+        munmap(p, sizeof(struct shmload_progress));
+        return NULL;
+    }
+    return p;
+}
+
+void shmload_unlinkprogress(char *name)
+{
+    char pname[1024];
+
+    progname(name, pname);
+    shm_unlink(pname);
+}
+
+static void wakereaders(struct shmload_progress *p)
+{
+    atomic_fetch_add(&p->seq, 1);
+    if (atomic_load(&p->waiters))
+        syscall(SYS_futex, &p->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* publishes that the first done bytes are loaded */
+void shmload_advance(struct shmload_progress *p, size_t done)
+{
+    uint64_t old = atomic_load(&p->done);
+
+    /* several threads may advance, done only grows */
+    while (old < done &&
+           ! atomic_compare_exchange_weak(&p->done, &old, done))
+        ;
+    wakereaders(p);
+}
+
+/* loading finished with done bytes */
+void shmload_complete(struct shmload_progress *p, size_t done)
+{
+    atomic_store(&p->done, done);
+    atomic_store(&p->complete, 1);
+    wakereaders(p);
+}
+
+/* waits until more than have bytes are available or the loading is
+   complete, returns the number of available bytes */
+size_t shmload_wait(struct shmload_progress *p, size_t have, int *complete)
+{
+    uint64_t done;
+    uint32_t seq;
+
+    while (1) {
+        seq = atomic_load(&p->seq);
+        done = atomic_load(&p->done);
+        *complete = atomic_load(&p->complete);
+        if (done > have || *complete)
+            return done;
+        atomic_fetch_add(&p->waiters, 1);
+        /* the loader changes seq after done, so we cannot miss it */
+        syscall(SYS_futex, &p->seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+        atomic_fetch_sub(&p->waiters, 1);
+    }
+}
+
+/* bytes loaded from the start by all threads */
+static size_t contiguous(struct loadpart *parts, int nparts)
+{
+    size_t done, d;
+    int k;
+
+    done = 0;
+    for (k = 0; k < nparts; k++) {
+        d = atomic_load(&parts[k].done);
+        done += d;
+        if (d < parts[k].len)
+            break;
+    }
+    return done;
+}
+
+static void *loadthread(void *arg)
+{
+    struct loadpart *p = (struct loadpart*)arg;
+    size_t n;
+    ssize_t r;
+
+    p->done = 0;
+    while (p->done < p->len) {
+        n = p->len - p->done;
+        if (n > p->bufsize)
+            n = p->bufsize;
+        r = pread(p->ifd, p->mem + p->off + p->done, n, p->off + p->done);
+        if (r <= 0)
+            break;   /* file shorter than expected or error */
+        if (p->refresh)
+            refreshmem(p->mem + p->off + p->done, r);
+        p->done += r;
+        if (p->prog)
+            shmload_advance(p->prog, contiguous(p->all, p->nparts));
+    }
+    return NULL;
+}
+
+/* reads up to length bytes directly into the mapped memory mem, returns
+   the number of bytes loaded from the start of the input (-1 if the
+   threads cannot be started); progress is published in prog if not NULL */
+size_t shmload_read(int ifd, int isfile, char *mem, size_t length,
+                    int nthreads, size_t bufsize, int refresh,
+                    struct shmload_progress *prog)
+{
+    struct loadpart *parts;
+    pthread_t *threads;
+    size_t chunk, done;
+    ssize_t r;
+    int k;
+
+    if (! isfile || nthreads <= 1 || length < 2*bufsize) {
+        /* read sequentially, without staging buffer */
+        done = 0;
+        while (done < length) {
+            r = read(ifd, mem+done, length-done > bufsize ? bufsize :
+                                                            length-done);
+            if (r <= 0)
+                break;
+            if (refresh)
+                refreshmem(mem+done, r);
+            done += r;
+            if (prog)
+                shmload_advance(prog, done);
+        }
+        return done;
+    }
+    parts = (struct loadpart*)calloc(nthreads, sizeof(struct loadpart));
+    threads = (pthread_t*)calloc(nthreads, sizeof(pthread_t));
+    if (! parts || ! threads)
+        return (size_t)-1;
+    /* parts of whole pages */
+    chunk = (length/nthreads + 4095) & ~((size_t)4095);
+    for (k = 0; k < nthreads; k++) {
+        parts[k].ifd = ifd;
+        parts[k].refresh = refresh;
+        parts[k].mem = mem;
+        parts[k].bufsize = bufsize;
+        parts[k].all = parts;
+        parts[k].nparts = nthreads;
+        parts[k].prog = prog;
+        parts[k].off = k*chunk < length ? k*chunk : length;
+        parts[k].len = parts[k].off+chunk < length ? chunk :
+                                                     length-parts[k].off;
+        if (pthread_create(&threads[k], NULL, loadthread, &parts[k]) != 0) {
+            for (k--; k >= 0; k--)
+                pthread_join(threads[k], NULL);
+            free(parts);
+            free(threads);
+            return (size_t)-1;
+        }
+    }
+    for (k = 0; k < nthreads; k++)
+        pthread_join(threads[k], NULL);
+    /* loaded up to the first incomplete part */
+    done = contiguous(parts, nthreads);
+    free(parts);
+    free(threads);
+    return done;
+}
+
+/* the kernel copies up to length bytes from ifd into the shared memory
+   object fd (from its current offset) in steps of bufsize, returns the
+   number of bytes; progress is published in prog if not NULL */
+size_t shmload_send(int ifd, int fd, size_t length, size_t bufsize,
+                    struct shmload_progress *prog)
+{
+    size_t done;
+    ssize_t r;
+
+    done = 0;
+    while (done < length) {
+        r = sendfile(fd, ifd, NULL, length-done > bufsize ? bufsize :
+                                                            length-done);
+        if (r <= 0)
+            break;
+        done += r;
+        if (prog)
+            shmload_advance(prog, done);
+    }
+    return done;
+}
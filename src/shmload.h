@@ -0,0 +1,45 @@
+/*
+shmload.h                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Loading a file into a shared memory area (used by 'cptoshm' and
+'shmcache'). The data are read directly into the mapped memory, a
+regular file optionally by several threads at separate offsets, or
+copied by the kernel with sendfile.
+
+While loading, the number of bytes available from the start can be
+published in a small companion object '<name>.LOAD' (see --progress of
+'cptoshm' and --stream of 'shmcat'), so that a reader can start before
+the whole file is loaded. A reader sleeps in a futex only when it has
+caught up with the loader.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SHMLOAD_MAGIC "HRTLOAD1"
+
+struct shmload_progress {
+    char magic[8];
+    _Atomic uint64_t length;    /* size of the shared memory area */
+    _Atomic uint64_t done;      /* bytes available from the start */
+    _Atomic uint32_t complete;  /* set when done is final */
+    _Atomic uint32_t seq;       /* futex word, changed with done */
+    _Atomic uint32_t waiters;   /* readers sleeping on seq */
+};
+
+struct shmload_progress *shmload_progress(char *name, int create,
+                                          size_t length);
+void shmload_unlinkprogress(char *name);
+void shmload_advance(struct shmload_progress *p, size_t done);
+void shmload_complete(struct shmload_progress *p, size_t done);
+size_t shmload_wait(struct shmload_progress *p, size_t have, int *complete);
+size_t shmload_read(int ifd, int isfile, char *mem, size_t length,
+                    int nthreads, size_t bufsize, int refresh,
+                    struct shmload_progress *prog);
+size_t shmload_send(int ifd, int fd, size_t length, size_t bufsize,
+                    struct shmload_progress *prog);
@@ -0,0 +1,111 @@
+/*
+shmmem.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Shared memory segments on hugetlbfs, with huge pages, locked and
+prefaulted, see shmmem.h.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include "shmmem.h"
+
+static char *hdir = NULL;
+static size_t hpsz = 0;
+static int mflags = 0;
+
+/* hugedir (or NULL for /dev/shm) and SHMMEM_* flags for all following
+   segments */
+void shmmem_config(char *hugedir, int flags)
+{
+    struct statfs fs;
+
+    hdir = hugedir;
+    mflags = flags;
+    hpsz = 0;
+    if (hdir && statfs(hdir, &fs) == 0)
+        hpsz = fs.f_bsize;
+}
+
+static void hugepath(char *name, char *path)
+{
+    snprintf(path, 1024, "%s/%s", hdir, name[0] == '/' ? name+1 : name);
+}
+
+/* like shm_open */
+int shmmem_open(char *name, int oflag, mode_t mode)
+{
+    char path[1024];
+
+    if (hdir == NULL)
+        return shm_open(name, oflag, mode);
+    hugepath(name, path);
+    return open(path, oflag, mode);
+}
+
+/* like shm_unlink */
+int shmmem_unlink(char *name)
+{
+    char path[1024];
+
+    if (hdir == NULL)
+        return shm_unlink(name);
+    hugepath(name, path);
+    return unlink(path);
+}
+
+/* size of a segment holding len bytes, on hugetlbfs a multiple of the
+   huge page size */
+size_t shmmem_size(size_t len)
+{
+    if (hdir == NULL || hpsz == 0)
+        return len;
+    return (len + hpsz - 1) / hpsz * hpsz;
+}
+
+/* maps len bytes (rounded by shmmem_size) of fd with protection prot,
+   returns MAP_FAILED if mapping or locking fails */
+void *shmmem_map(int fd, size_t len, int prot)
+{
+    void *p;
+
+    len = shmmem_size(len);
+    p = mmap(NULL, len, prot,
+             MAP_SHARED | (mflags & SHMMEM_POPULATE ? MAP_POPULATE : 0), fd, 0);
+    if (p == MAP_FAILED)
+        return p;
+#ifdef MADV_HUGEPAGE
+    /* only a hint, tmpfs needs shmem_enabled=advise in
+       /sys/kernel/mm/transparent_hugepage */
+    if (mflags & SHMMEM_THP)
+        madvise(p, len, MADV_HUGEPAGE);
+#endif
+    if ((mflags & SHMMEM_LOCK) && mlock(p, len) == -1) {
+        munmap(p, len);
+        return MAP_FAILED;
+    }
+    return p;
+}
+
+/* reports the page faults since start (from getrusage) */
+void shmmem_faults(char *prog, struct rusage *start)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) == -1)
+        return;
+    fprintf(stderr, "%s: Page faults in loop: %ld minor, %ld major.\n",
+            prog, ru.ru_minflt - start->ru_minflt,
+            ru.ru_majflt - start->ru_majflt);
+}
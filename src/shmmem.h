@@ -0,0 +1,29 @@
+/*
+shmmem.h                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Opening and mapping the shared memory segments of 'writeloop',
+'catloop', 'bufhrt', 'cptoshm' and 'shmcat', optionally such that no
+page fault happens when they are used in a timed loop: the segments can
+be placed on a hugetlbfs mount instead of /dev/shm (all programs using
+them need the same --hugetlbfs option), or transparent huge pages can
+be requested; the mappings can be locked in memory and prefaulted.
+*/
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#define SHMMEM_THP 1            /* madvise(MADV_HUGEPAGE) */
+#define SHMMEM_LOCK 2           /* mlock */
+#define SHMMEM_POPULATE 4       /* MAP_POPULATE */
+
+void shmmem_config(char *hugedir, int flags);
+int shmmem_open(char *name, int oflag, mode_t mode);
+int shmmem_unlink(char *name);
+size_t shmmem_size(size_t len);
+void *shmmem_map(int fd, size_t len, int prot);
+void shmmem_faults(char *prog, struct rusage *start);
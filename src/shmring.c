@@ -0,0 +1,460 @@
+/*
+shmring.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+A ring buffer in shared memory for one writer and one reader, see
+shmring.h.
+
+The writer moves 'head', the reader 'tail'. Before sleeping, a process
+announces this in a flag and checks the ring again; the other side
+checks the flag after moving its counter (all sequentially consistent),
+so a wakeup cannot get lost. The futex words are sequence numbers which
+change with each wakeup.
+
+In broadcast mode each reader has its own 'tail', 'rwait' and 'rneed' in
+a slot, all readers sleep on 'wseq'. The writer may only overwrite what
+all registered readers have read, but it never waits for a
+SHMRING_DROP reader: such a reader is marked as SHMRING_DROPPED when it
+is in the way and registers again at the current 'head' when it notices
+this.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include "shmring.h"
+
+static void futex_wait(_Atomic uint32_t *addr, uint32_t val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void futex_wake(_Atomic uint32_t *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static inline void relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/* the fields of this reader */
+static inline _Atomic uint64_t *tailp(struct shmring *r)
+{
+    return r->slot < 0 ? &r->h->tail : &r->h->slot[r->slot].tail;
+}
+
+static inline _Atomic uint32_t *rwaitp(struct shmring *r)
+{
+    return r->slot < 0 ? &r->h->rwait : &r->h->slot[r->slot].rwait;
+}
+
+static inline _Atomic uint64_t *rneedp(struct shmring *r)
+{
+    return r->slot < 0 ? &r->h->rneed : &r->h->slot[r->slot].rneed;
+}
+
+/* free space for the writer, in broadcast mode behind the slowest
+   registered reader, with all == 0 only the SHMRING_BLOCK readers count;
+   there is no space until all slots were taken once (so all readers get
+   the data from the beginning) and when no reader is registered */
+static size_t freespace(struct shmring *r, int all)
+{
+    uint64_t head, t, lag;
+    uint32_t st;
+    int k, present;
+
+    head = atomic_load_explicit(&r->h->head, memory_order_relaxed);
+    if (r->h->nslots == 0)
+        return r->size - (head -
+               atomic_load_explicit(&r->h->tail, memory_order_acquire));
+    for (lag = 0, present = 0, k = 0; k < r->h->nslots; k++) {
+        st = atomic_load(&r->h->slot[k].state);
+        if (st == SHMRING_FREE)
+            continue;
+        present++;
+        if (st == SHMRING_BLOCK || (all && st == SHMRING_DROP)) {
+            t = atomic_load(&r->h->slot[k].tail);
+            if (head - t > lag)
+                lag = head - t;
+        }
+    }
+    if (present == r->h->nslots)
+        atomic_store(&r->h->started, 1);
+    if (present == 0 || ! atomic_load(&r->h->started))
+        return 0;
+    return r->size - lag;
+}
+
+/* marks the SHMRING_DROP readers which are in the way of n more bytes
+   as dropped */
+static void dropreaders(struct shmring *r, size_t n)
+{
+    uint64_t head;
+    uint32_t st;
+    int k;
+
+    head = atomic_load_explicit(&r->h->head, memory_order_relaxed);
+    for (k = 0; k < r->h->nslots; k++) {
+        st = SHMRING_DROP;
+        if (atomic_load(&r->h->slot[k].state) == SHMRING_DROP &&
+            head + n - atomic_load(&r->h->slot[k].tail) > r->size &&
+            atomic_compare_exchange_strong(&r->h->slot[k].state, &st,
+                                           SHMRING_DROPPED))
+            atomic_fetch_add(&r->h->slot[k].drops, 1);
+    }
+}
+
+/* wakes the reader(s) if sleeping, with force also if they wait for more;
+   the flag is cleared here, so further calls need no system call */
+static void wakereader(struct shmring *r, int force)
+{
+    struct shmring_slot *sl;
+    uint64_t head;
+    int k, woke;
+
+    if (r->h->nslots == 0) {
+        woke = atomic_load(&r->h->rwait) &&
+               (force || shmring_fill(r) >= atomic_load(&r->h->rneed)) &&
+               atomic_exchange(&r->h->rwait, 0);
+    } else {
+        head = atomic_load(&r->h->head);
+        for (woke = 0, k = 0; k < r->h->nslots; k++) {
+            sl = &r->h->slot[k];
+            if (atomic_load(&sl->rwait) &&
+                (force || head - atomic_load(&sl->tail) >=
+                          atomic_load(&sl->rneed)) &&
+                atomic_exchange(&sl->rwait, 0))
+                woke = 1;
+        }
+    }
+    if (woke) {
+        atomic_fetch_add(&r->h->wseq, 1);
+        futex_wake(&r->h->wseq);
+    }
+}
+
+/* wakes the writer if it sleeps and there is enough space now */
+static void wakewriter(struct shmring *r)
+{
+    if (atomic_load(&r->h->wwait) &&
+        freespace(r, 0) >= atomic_load(&r->h->wneed) &&
+        atomic_exchange(&r->h->wwait, 0)) {
+        atomic_fetch_add(&r->h->rseq, 1);
+        futex_wake(&r->h->rseq);
+    }
+}
+
+/* registers this reader in slot k at the current position of the writer */
+static void takeslot(struct shmring *r, int k)
+{
+    struct shmring_slot *sl = &r->h->slot[k];
+
+    atomic_store(&sl->tail, atomic_load(&r->h->head));
+    atomic_store(&sl->rwait, 0);
+    atomic_store(&sl->state, r->policy);
+    /* the writer may have moved on before it could see us */
+    atomic_store(&sl->tail, atomic_load(&r->h->head));
+    r->slot = k;
+}
+
+/* maps header page and data, the data a second time behind the first
+   mapping */
+static int ringmap(struct shmring *r, int fd, size_t size)
+{
+    long psz;
+    char *p;
+
+    psz = sysconf(_SC_PAGESIZE);
+    r->maplen = psz + 2*size;
+    p = mmap(NULL, r->maplen, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return -1;
+    if (mmap(p, psz + size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             fd, 0) == MAP_FAILED ||
+        mmap(p + psz + size, size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, fd, psz) == MAP_FAILED) {
+        munmap(p, r->maplen);
+        return -1;
+    }
+    r->h = (struct shmring_head*)p;
+    r->data = p + psz;
+    r->size = size;
+    r->spin = 0;
+    r->batch = 0;
+    r->slot = -1;
+    r->policy = SHMRING_BLOCK;
+    r->drops = 0;
+    return 0;
+}
+
+/* creates the shared memory object 'name' with a ring of at least size
+   bytes (rounded up to a multiple of the page size), for broadcast to up
+   to 'readers' readers (0 for a single reader), with force an existing
+   object is reused; returns 0 on success and -1 (with errno set)
+   otherwise */
+int shmring_create(struct shmring *r, char *name, size_t size, int readers,
+                   int force)
+{
+    int fd, e;
+    long psz;
+
+    if (readers < 0 || readers > SHMRING_MAXREADERS) {
+        errno = EINVAL;
+        return -1;
+    }
+    psz = sysconf(_SC_PAGESIZE);
+    size = ((size + psz - 1) / psz) * psz;
+    fd = shm_open(name, O_CREAT | O_RDWR | (force ? 0 : O_EXCL),
+                  S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return -1;
+    if ((force && ftruncate(fd, 0) < 0) || ftruncate(fd, psz + size) < 0 ||
+        ringmap(r, fd, size) < 0) {
+        e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    close(fd);
+    memset(r->h, 0, sizeof(struct shmring_head));
+    r->h->size = size;
+    r->h->nslots = readers;
+    memcpy(r->h->magic, SHMRING_MAGIC, 8);
+    return 0;
+}
+
+/* maps an existing ring, returns 0 on success and -1 (with errno set)
+   otherwise */
+int shmring_attach(struct shmring *r, char *name)
+{
+    int fd, e;
+    long psz;
+    struct stat sb;
+    struct shmring_head *h;
+    size_t size;
+
+    psz = sysconf(_SC_PAGESIZE);
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0)
+        return -1;
+    if (fstat(fd, &sb) < 0)
+        sb.st_size = 0;
+    if (sb.st_size < psz) {
+        e = EINVAL;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    h = mmap(NULL, psz, PROT_READ, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+        e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    size = h->size;
+    e = memcmp(h->magic, SHMRING_MAGIC, 8) != 0 ||
+        size == 0 || psz + size != (size_t)sb.st_size;
+    munmap(h, psz);
+    if (e) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    if (ringmap(r, fd, size) < 0) {
+        e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* a reader registers with policy SHMRING_BLOCK or SHMRING_DROP, this is
+   only needed in broadcast mode, where the reader starts with the next
+   data written; returns 0 on success and -1 if all slots are taken */
+int shmring_join(struct shmring *r, int policy)
+{
+    uint32_t st;
+    int k;
+
+    r->policy = policy;
+    r->drops = 0;
+    for (k = 0; k < r->h->nslots; k++) {
+        st = SHMRING_FREE;
+        if (atomic_compare_exchange_strong(&r->h->slot[k].state, &st,
+                                           SHMRING_JOINING)) {
+            atomic_store(&r->h->slot[k].drops, 0);
+            takeslot(r, k);
+            /* the writer may wait for its first reader */
+            wakewriter(r);
+            return 0;
+        }
+    }
+    if (r->h->nslots > 0) {
+        errno = EBUSY;
+        return -1;
+    }
+    return 0;
+}
+
+/* the reader is done, returns 1 if the ring can be removed: the writer
+   is done and no other reader is registered */
+int shmring_leave(struct shmring *r)
+{
+    int k;
+
+    if (r->slot < 0)
+        return 1;
+    atomic_store(&r->h->slot[r->slot].state, SHMRING_FREE);
+    r->slot = -1;
+    wakewriter(r);
+    for (k = 0; k < r->h->nslots; k++)
+        if (atomic_load(&r->h->slot[k].state) != SHMRING_FREE)
+            return 0;
+    return atomic_load(&r->h->eof);
+}
+
+void shmring_free(struct shmring *r)
+{
+    munmap(r->h, r->maplen);
+    r->h = NULL;
+}
+
+int shmring_unlink(char *name)
+{
+    return shm_unlink(name);
+}
+
+/* where the writer puts new data, shmring_space(r) bytes are contiguous */
+char *shmring_wptr(struct shmring *r)
+{
+    return r->data + atomic_load_explicit(&r->h->head, memory_order_relaxed)
+                     % r->size;
+}
+
+/* the next data for the reader, shmring_fill(r) bytes are contiguous */
+char *shmring_rptr(struct shmring *r)
+{
+    return r->data + atomic_load_explicit(tailp(r), memory_order_relaxed)
+                     % r->size;
+}
+
+size_t shmring_fill(struct shmring *r)
+{
+    return atomic_load_explicit(&r->h->head, memory_order_acquire) -
+           atomic_load_explicit(tailp(r), memory_order_relaxed);
+}
+
+size_t shmring_space(struct shmring *r)
+{
+    return freespace(r, 1);
+}
+
+int shmring_eof(struct shmring *r)
+{
+    return atomic_load(&r->h->eof);
+}
+
+/* waits until at least n bytes (at most the ring size) can be read or
+   the writer is done, returns shmring_fill(r) */
+size_t shmring_wait_fill(struct shmring *r, size_t n)
+{
+    long i;
+    uint32_t seq;
+
+    if (n > r->size)
+        n = r->size;
+    for (i = 0; ; i++) {
+        if (r->slot >= 0 && atomic_load(&r->h->slot[r->slot].state) ==
+                            SHMRING_DROPPED) {
+            /* we were too slow, continue with the newest data */
+            r->drops++;
+            atomic_store(&r->h->slot[r->slot].state, SHMRING_JOINING);
+            takeslot(r, r->slot);
+        }
+        if (shmring_fill(r) >= n || atomic_load(&r->h->eof))
+            return shmring_fill(r);
+        if (i < r->spin) {
+            relax();
+            continue;
+        }
+        seq = atomic_load(&r->h->wseq);
+        atomic_store(rneedp(r), n > r->batch ? n : r->batch);
+        atomic_store(rwaitp(r), 1);
+        if (shmring_fill(r) < n && ! atomic_load(&r->h->eof))
+            futex_wait(&r->h->wseq, seq);
+        atomic_store(rwaitp(r), 0);
+    }
+}
+
+/* waits until at least n bytes (at most the ring size) can be written,
+   returns shmring_space(r); in broadcast mode this only waits for
+   SHMRING_BLOCK readers, SHMRING_DROP readers in the way are dropped */
+size_t shmring_wait_space(struct shmring *r, size_t n)
+{
+    long i;
+    uint32_t seq;
+
+    if (n > r->size)
+        n = r->size;
+    for (i = 0; ; i++) {
+        if (freespace(r, 0) >= n) {
+            if (r->h->nslots > 0)
+                dropreaders(r, n);
+            return shmring_space(r);
+        }
+        if (i < r->spin) {
+            relax();
+            continue;
+        }
+        seq = atomic_load(&r->h->rseq);
+        atomic_store(&r->h->wneed, n > r->size/4 ? n : r->size/4);
+        atomic_store(&r->h->wwait, 1);
+        if (freespace(r, 0) < n) {
+            /* the reader must not wait for more than we can give */
+            wakereader(r, 1);
+            futex_wait(&r->h->rseq, seq);
+        }
+        atomic_store(&r->h->wwait, 0);
+    }
+}
+
+/* n bytes were written at shmring_wptr(r), wakes a sleeping reader */
+void shmring_produce(struct shmring *r, size_t n)
+{
+    atomic_fetch_add(&r->h->head, n);
+    wakereader(r, 0);
+}
+
+/* n bytes were used from shmring_rptr(r), wakes a sleeping writer if
+   there is enough space now */
+void shmring_consume(struct shmring *r, size_t n)
+{
+    atomic_fetch_add(tailp(r), n);
+    wakewriter(r);
+}
+
+/* the writer is done, the reader gets the remaining data and then
+   shmring_wait_fill returns 0 */
+void shmring_close_write(struct shmring *r)
+{
+    atomic_store(&r->h->eof, 1);
+    atomic_fetch_add(&r->h->wseq, 1);
+    futex_wake(&r->h->wseq);
+}
@@ -0,0 +1,99 @@
+/*
+shmring.h                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+A ring buffer in one named shared memory object for one writer and one
+reader process (see --ring options of 'writeloop', 'catloop' and
+'bufhrt'). The positions are atomic counters, a process only sleeps
+(in a futex) when the ring is empty resp. full, optionally after some
+busy polling. A writer waiting for space is only woken when a quarter
+of the ring is free, and a reader waiting for data when 'batch' bytes
+are available (or the writer has to wait itself), so that the
+processes do not take turns block by block. As in ringbuf.h the data
+are mapped twice back to back, so any chunk of up to the ring size is
+contiguous in memory.
+
+In broadcast mode (created with readers > 0) the same data go to several
+readers. Each reader registers in a slot with its own position 'tail'
+and a policy: the writer waits for a SHMRING_BLOCK reader, while a
+SHMRING_DROP reader which falls a whole ring behind is dropped by the
+writer and continues with the newest data.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SHMRING_MAGIC "HRTRING1"
+#define SHMRING_MAXREADERS 16
+
+/* state of a reader slot */
+#define SHMRING_FREE 0
+#define SHMRING_BLOCK 1
+#define SHMRING_DROP 2
+#define SHMRING_JOINING 3
+#define SHMRING_DROPPED 4
+
+/* a reader in broadcast mode, one cache line */
+struct shmring_slot {
+    _Atomic uint32_t state;
+    _Atomic uint32_t rwait;     /* reader sleeps on wseq */
+    _Atomic uint64_t tail;      /* total number of bytes read */
+    _Atomic uint64_t rneed;     /* data the sleeping reader waits for */
+    _Atomic uint64_t drops;     /* times the writer dropped this reader */
+    char pad[32];
+};
+
+/* first page of the shared memory object, the data follow on the next
+   page; writer and reader fields are on separate cache lines */
+struct shmring_head {
+    char magic[8];
+    uint64_t size;              /* of data, a multiple of the page size */
+    _Atomic uint32_t eof;       /* set by the writer when done */
+    uint32_t nslots;            /* broadcast: reader slots, else 0 */
+    _Atomic uint32_t started;   /* broadcast: all slots were taken once */
+    char pad0[36];
+    _Atomic uint64_t head;      /* total number of bytes written */
+    _Atomic uint32_t wseq;      /* futex word, changed when head moved */
+    _Atomic uint32_t rwait;     /* reader sleeps on wseq */
+    _Atomic uint64_t wneed;     /* space the sleeping writer waits for */
+    char pad1[40];
+    _Atomic uint64_t tail;      /* total number of bytes read */
+    _Atomic uint32_t rseq;      /* futex word, changed when tail moved */
+    _Atomic uint32_t wwait;     /* writer sleeps on rseq */
+    _Atomic uint64_t rneed;     /* data the sleeping reader waits for */
+    char pad2[40];
+    struct shmring_slot slot[SHMRING_MAXREADERS];
+};
+
+struct shmring {
+    struct shmring_head *h;
+    char *data;
+    size_t size, maplen;
+    long spin;                  /* number of polls before sleeping */
+    size_t batch;               /* reader: wake up for this much data */
+    int slot;                   /* reader: slot in broadcast mode or -1 */
+    int policy;                 /* reader: SHMRING_BLOCK or SHMRING_DROP */
+    long drops;                 /* reader: times it was dropped */
+};
+
+int shmring_create(struct shmring *r, char *name, size_t size, int readers,
+                   int force);
+int shmring_attach(struct shmring *r, char *name);
+int shmring_join(struct shmring *r, int policy);
+int shmring_leave(struct shmring *r);
+void shmring_free(struct shmring *r);
+int shmring_unlink(char *name);
+char *shmring_wptr(struct shmring *r);
+char *shmring_rptr(struct shmring *r);
+size_t shmring_fill(struct shmring *r);
+size_t shmring_space(struct shmring *r);
+int shmring_eof(struct shmring *r);
+size_t shmring_wait_fill(struct shmring *r, size_t n);
+size_t shmring_wait_space(struct shmring *r, size_t n);
+void shmring_produce(struct shmring *r, size_t n);
+void shmring_consume(struct shmring *r, size_t n);
+void shmring_close_write(struct shmring *r);
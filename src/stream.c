@@ -0,0 +1,239 @@
+/*
+stream.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+In-band stream format and framed pipes, see stream.h.
+*/
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "stream.h"
+
+static struct {
+    char *name;
+    int code, bytes;
+} fmtnames[] = {
+    {"S16_LE", STREAM_S16_LE, 2},
+    {"S24_LE", STREAM_S24_LE, 4},
+    {"S24_3LE", STREAM_S24_3LE, 3},
+    {"S32_LE", STREAM_S32_LE, 4},
+    {"FLOAT_LE", STREAM_FLOAT_LE, 4},
+    {"FLOAT64_LE", STREAM_FLOAT64_LE, 8},
+    {NULL, 0, 0}
+};
+
+void stream_setfmt(struct streamfmt *f, long rate, int format, int channels)
+{
+    memset(f, 0, sizeof(struct streamfmt));
+    f->magic = STREAM_MAGIC;
+    f->version = STREAM_VERSION;
+    f->rate = rate;
+    f->format = format;
+    f->channels = channels;
+}
+
+/* returns the code of a sample format name like 'S16_LE' or 0 */
+int stream_fmtcode(char *name)
+{
+    int i;
+
+    for (i = 0; fmtnames[i].name != NULL; i++)
+        if (strcmp(name, fmtnames[i].name) == 0)
+            return fmtnames[i].code;
+    return 0;
+}
+
+char *stream_fmtname(int format)
+{
+    int i;
+
+    for (i = 0; fmtnames[i].name != NULL; i++)
+        if (format == fmtnames[i].code)
+            return fmtnames[i].name;
+    return "unknown";
+}
+
+int stream_bytespersample(int format)
+{
+    int i;
+
+    for (i = 0; fmtnames[i].name != NULL; i++)
+        if (format == fmtnames[i].code)
+            return fmtnames[i].bytes;
+    return 0;
+}
+
+int stream_fmtvalid(struct streamfmt *f)
+{
+    return f->magic == STREAM_MAGIC && f->version == STREAM_VERSION &&
+           f->rate > 0 && f->channels > 0 &&
+           stream_bytespersample(f->format) > 0;
+}
+
+/* parses 'rate:format:channels' like '44100:S16_LE:2', returns 0 on
+   success and -1 otherwise */
+int stream_parsefmt(char *s, struct streamfmt *f)
+{
+    char name[32];
+    long rate;
+    int channels;
+
+    if (sscanf(s, "%ld:%31[^:]:%d", &rate, name, &channels) != 3)
+        return -1;
+    stream_setfmt(f, rate, stream_fmtcode(name), channels);
+    return stream_fmtvalid(f) ? 0 : -1;
+}
+
+void stream_initin(struct streamin *s, int fd)
+{
+    memset(s, 0, sizeof(struct streamin));
+    s->fd = fd;
+}
+
+/* reads exactly len bytes, returns 0 on success, 1 at end of input
+   before the first byte and -1 otherwise */
+static int readfull(int fd, void *buf, size_t len)
+{
+    size_t done;
+    ssize_t n;
+
+    for (done = 0; done < len; done += n) {
+        n = read(fd, (char*)buf + done, len - done);
+        if (n < 0 && errno == EINTR)
+            n = 0;
+        else if (n == 0)
+            return done == 0 ? 1 : -1;
+        else if (n < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* like read(2) for the data in a framed pipe: returns the number of
+   bytes read (never across a frame boundary), 0 at the end, -1 on error
+   and STREAM_NEWFMT when a new format was read into s->fmt */
+ssize_t stream_read(struct streamin *s, void *buf, size_t len)
+{
+    uint32_t hdr;
+    ssize_t n;
+    int r;
+
+    while (s->left == 0) {
+        if (s->eof)
+            return 0;
+        r = readfull(s->fd, &hdr, sizeof(uint32_t));
+        if (r == 1) {
+            s->eof = 1;
+            return 0;
+        }
+        if (r < 0)
+            return -1;
+        s->left = hdr & ~STREAM_FRAMEFMT;
+        if (hdr & STREAM_FRAMEFMT) {
+            if (readfull(s->fd, &s->fmt, sizeof(struct streamfmt)) != 0 ||
+                ! stream_fmtvalid(&s->fmt)) {
+                errno = EINVAL;
+                return -1;
+            }
+            return STREAM_NEWFMT;
+        }
+    }
+    /* len == 0 only reads a pending header */
+    if (len == 0)
+        return 0;
+    if (len > s->left)
+        len = s->left;
+    n = read(s->fd, buf, len);
+    if (n > 0)
+        s->left -= n;
+    else if (n == 0)
+        s->eof = 1;
+    return n;
+}
+
+/* reads up to len bytes, less only at the end of input, on error or
+   before a change of the format. *newfmt is set if s->fmt changed before
+   the returned data, so a return value of 0 without *newfmt means the
+   end of input. */
+size_t stream_readall(struct streamin *s, void *buf, size_t len, int *newfmt)
+{
+    struct streamfmt old;
+    size_t done;
+    ssize_t n;
+
+    *newfmt = 0;
+    if (s->pending) {
+        s->fmt = s->next;
+        s->pending = 0;
+        *newfmt = 1;
+    }
+    for (done = 0; done < len; done += n) {
+        old = s->fmt;
+        n = stream_read(s, (char*)buf + done, len - done);
+        if (n == STREAM_NEWFMT) {
+            if (done == 0) {
+                *newfmt = 1;
+                n = 0;
+                continue;
+            }
+            /* the data read so far have the old format */
+            s->next = s->fmt;
+            s->fmt = old;
+            s->pending = 1;
+            break;
+        }
+        if (n <= 0)
+            break;
+    }
+    return done;
+}
+
+/* writes a frame header for the following len data bytes, with a new
+   format f if not NULL; returns the number of bytes written or -1 */
+int stream_writehdr(int fd, struct streamfmt *f, uint32_t len)
+{
+    uint32_t hdr;
+    struct iovec iov[2];
+    int n;
+
+    hdr = len | (f != NULL ? STREAM_FRAMEFMT : 0);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(uint32_t);
+    iov[1].iov_base = f;
+    iov[1].iov_len = sizeof(struct streamfmt);
+    n = sizeof(uint32_t) + (f != NULL ? sizeof(struct streamfmt) : 0);
+    return writev(fd, iov, f != NULL ? 2 : 1) == n ? n : -1;
+}
+
+/* writes a frame with len bytes of data, returns 0 on success and -1
+   otherwise */
+int stream_writeframe(int fd, void *buf, uint32_t len)
+{
+    uint32_t hdr;
+    struct iovec iov[2];
+    ssize_t n, m;
+
+    hdr = len;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(uint32_t);
+    iov[1].iov_base = buf;
+    iov[1].iov_len = len;
+    n = writev(fd, iov, 2);
+    if (n < 0 || n < (ssize_t)sizeof(uint32_t))
+        return -1;
+    /* finish a partial write of the data */
+    for (n -= sizeof(uint32_t); n < (ssize_t)len; n += m) {
+        m = write(fd, (char*)buf + n, len - n);
+        if (m <= 0)
+            return -1;
+    }
+    return 0;
+}
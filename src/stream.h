@@ -0,0 +1,71 @@
+/*
+stream.h                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+In-band description of the audio format (see --format and --framed
+options of 'writeloop', 'catloop', 'volrace', 'resample_soxr' and
+'playhrt'), so that the programs of a chain can follow a change of the
+sample rate or format without restart.
+
+In shared memory segments of 'writeloop --shared' the flag STREAM_SEGFMT
+in the length int at the start of a segment says that a struct
+streamfmt follows this int, the data follow after it.
+
+A framed pipe is a sequence of frames, each frame starts with a uint32
+(host byte order) with the number of data bytes in the frame. With the
+flag STREAM_FRAMEFMT a struct streamfmt follows this header; the new
+format holds for the data of this and all following frames.
+*/
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STREAM_MAGIC 0x31544d46    /* "FMT1" */
+#define STREAM_VERSION 1
+
+#define STREAM_SEGFMT 0x40000000
+#define STREAM_FRAMEFMT 0x80000000u
+
+/* sample formats */
+#define STREAM_S16_LE 1
+#define STREAM_S24_LE 2
+#define STREAM_S24_3LE 3
+#define STREAM_S32_LE 4
+#define STREAM_FLOAT_LE 5
+#define STREAM_FLOAT64_LE 6
+
+/* returned by stream_read after a new format */
+#define STREAM_NEWFMT -2
+
+struct streamfmt {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t channels;
+    uint32_t rate;
+    uint32_t format;
+};
+
+/* reading side of a framed pipe */
+struct streamin {
+    int fd;
+    uint32_t left;          /* data bytes left in current frame */
+    int eof;
+    struct streamfmt fmt;   /* the current format, magic 0 if unknown */
+    struct streamfmt next;  /* stream_readall: format after the data */
+    int pending;
+};
+
+void stream_setfmt(struct streamfmt *f, long rate, int format, int channels);
+int stream_parsefmt(char *s, struct streamfmt *f);
+int stream_fmtcode(char *name);
+char *stream_fmtname(int format);
+int stream_bytespersample(int format);
+int stream_fmtvalid(struct streamfmt *f);
+void stream_initin(struct streamin *s, int fd);
+ssize_t stream_read(struct streamin *s, void *buf, size_t len);
+size_t stream_readall(struct streamin *s, void *buf, size_t len, int *newfmt);
+int stream_writehdr(int fd, struct streamfmt *f, uint32_t len);
+int stream_writeframe(int fd, void *buf, uint32_t len);
@@ -0,0 +1,67 @@
+/*
+trace.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Writing of per loop trace files, see trace.h. The file is created with
+its full size and mapped, so recording needs no system calls.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include "trace.h"
+
+/* creates trace file for nrec records and maps it, returns NULL (with
+   errno set) on failure */
+struct tracehead *trace_open(char *path, uint32_t nrec, long nsec, long olen)
+{
+    int fd;
+    size_t len;
+    struct tracehead *th;
+
+    len = sizeof(struct tracehead) + (size_t)nrec * sizeof(struct tracerec);
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 00644)) < 0)
+        return NULL;
+    if (ftruncate(fd, len) < 0) {
+        close(fd);
+        return NULL;
+    }
+    th = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, 0);
+    close(fd);
+    if (th == MAP_FAILED)
+        return NULL;
+    memcpy(th->magic, TRACE_MAGIC, 8);
+    th->recsize = sizeof(struct tracerec);
+    th->nrec = nrec;
+    th->count = 0;
+    th->nsec = nsec;
+    th->olen = olen;
+    return th;
+}
+
+/* slot for the next record, the oldest one is overwritten if the file
+   is full */
+struct tracerec *trace_next(struct tracehead *th)
+{
+    struct tracerec *r;
+
+    r = (struct tracerec*)(th + 1) + th->count % th->nrec;
+    th->count++;
+    return r;
+}
+
+void trace_close(struct tracehead *th)
+{
+    size_t len;
+
+    len = sizeof(struct tracehead) + (size_t)th->nrec * sizeof(struct tracerec);
+    msync(th, len, MS_SYNC);
+    munmap(th, len);
+}
@@ -0,0 +1,43 @@
+/*
+trace.h                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+Format of the per loop trace files written by 'bufhrt --trace=...' and
+read by 'tracehrt'. The file is a header followed by a fixed number of
+records which are used as a ring, so the last 'nrec' loops are kept.
+*/
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "HRTTRACE"
+
+/* flags of a record */
+#define TRACE_UNDERRUN   1
+#define TRACE_SHORTWRITE 2
+#define TRACE_SHORTREAD  4
+
+struct tracehead {
+    char magic[8];
+    uint32_t recsize;   /* sizeof(struct tracerec) */
+    uint32_t nrec;      /* number of records in file */
+    uint64_t count;     /* number of records written */
+    int64_t nsec;       /* nominal duration of a loop */
+    int64_t olen;       /* nominal bytes per loop */
+};
+
+struct tracerec {
+    uint64_t loop;      /* loop index */
+    int64_t target;     /* wakeup time in nsec of CLOCK_MONOTONIC */
+    int64_t wakeup;     /* actual time after sleep */
+    int32_t wdur;       /* duration of write in nsec */
+    int32_t bytes;      /* bytes written */
+    int32_t fill;       /* bytes left in buffer after write */
+    int32_t flags;
+};
+
+struct tracehead *trace_open(char *path, uint32_t nrec, long nsec, long olen);
+struct tracerec *trace_next(struct tracehead *th);
+void trace_close(struct tracehead *th);
@@ -0,0 +1,246 @@
+/*
+tracehrt.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+*/
+
+#include "version.h"
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+/* help page */
+void usage( ) {
+  fprintf(stderr,
+          "tracehrt (version %s of frankl's stereo utilities)\nUSAGE:\n",
+          VERSION);
+  fprintf(stderr,
+"\n"
+"  tracehrt [options] tracefile\n"
+"\n"
+"  This program analyses a trace file written by 'bufhrt --trace=...'.\n"
+"  It prints percentiles of the delay of the wakeups after the wanted\n"
+"  wakeup time, of the time between wakeups and of the duration of the\n"
+"  writes. Then it lists the windows of consecutive loops with the\n"
+"  largest wakeup delays.\n"
+"\n"
+"  OPTIONS\n"
+"\n"
+"  --window=intval, -w intval\n"
+"      number of loops per window, default is 1000.\n"
+"\n"
+"  --worst=intval, -n intval\n"
+"      number of worst windows to list, default is 5.\n"
+"\n"
+"  --csv, -c\n"
+"      instead of the analysis write all records as comma separated\n"
+"      values to stdout (times in nsec, relative to the first record).\n"
+"\n"
+"  --version, -V\n"
+"      print information about the version of the program and abort.\n"
+"\n"
+"  --help, -h\n"
+"      print this help page and abort.\n"
+"\n"
+"  EXAMPLE\n"
+"\n"
+"  bufhrt --trace=/tmp/bt --port-to-write=5888 ...\n"
+"  tracehrt /tmp/bt\n"
+"  tracehrt --csv /tmp/bt > bt.csv\n"
+"\n"
+);
+}
+
+int cmpll(const void *a, const void *b)
+{
+    long long x = *(long long*)a, y = *(long long*)b;
+    return (x > y) - (x < y);
+}
+
+/* sorts v and prints some percentiles */
+void percentiles(char *name, long long *v, long n)
+{
+    qsort(v, n, sizeof(long long), cmpll);
+    printf("%-22s %10lld %10lld %10lld %10lld %10lld %10lld\n", name,
+           v[0], v[n/2], v[(long)(0.9*(n-1))], v[(long)(0.99*(n-1))],
+           v[(long)(0.999*(n-1))], v[n-1]);
+}
+
+int main(int argc, char *argv[])
+{
+    int fd, optc, csv, nworst, i, j;
+    long n, k, win, nwin, *worst, underruns, shortwrites, shortreads;
+    long long *lat, *dist, *wdur, minfill, maxfill, sumfill, sumbytes, t0;
+    double *score;
+    struct stat sb;
+    struct tracehead *th;
+    struct tracerec *rec, **r;
+
+    static struct option longoptions[] = {
+        {"window", required_argument, 0, 'w' },
+        {"worst", required_argument, 0, 'n' },
+        {"csv", no_argument, 0, 'c' },
+        {"version", no_argument, 0, 'V' },
+        {"help", no_argument, 0, 'h' },
+        {0,         0,                 0,  0 }
+    };
+
+    if (argc == 1) {
+       usage();
+       exit(0);
+    }
+    win = 1000;
+    nworst = 5;
+    csv = 0;
+    while ((optc = getopt_long(argc, argv, "w:n:cVh",
+            longoptions, &optind)) != -1) {
+        switch (optc) {
+        case 'w':
+          win = atol(optarg);
+          if (win < 1) {
+              fprintf(stderr, "tracehrt: --window must be at least 1.\n");
+              exit(1);
+          }
+          break;
+        case 'n':
+          nworst = atoi(optarg);
+          break;
+        case 'c':
+          csv = 1;
+          break;
+        case 'V':
+          fprintf(stderr,
+                  "tracehrt (version %s of frankl's stereo utilities)\n",
+                  VERSION);
+          exit(0);
+        default:
+          usage();
+          exit(1);
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "tracehrt: Need name of trace file.\n");
+        exit(1);
+    }
+    if ((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+        fprintf(stderr, "tracehrt: Cannot open %s.\n", argv[optind]);
+        exit(2);
+    }
+    th = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (th == MAP_FAILED || sb.st_size < sizeof(struct tracehead) ||
+        memcmp(th->magic, TRACE_MAGIC, 8) != 0 ||
+        th->recsize != sizeof(struct tracerec) ||
+        sb.st_size < sizeof(struct tracehead) +
+                     (long long)th->nrec * sizeof(struct tracerec)) {
+        fprintf(stderr, "tracehrt: %s is not a trace file.\n", argv[optind]);
+        exit(3);
+    }
+    rec = (struct tracerec*)(th + 1);
+
+    /* records in order, the file is used as a ring */
+    n = (th->count < th->nrec) ? th->count : th->nrec;
+    if (n < 2) {
+        fprintf(stderr, "tracehrt: Too few records in %s.\n", argv[optind]);
+        exit(4);
+    }
+    r = (struct tracerec**)malloc(n * sizeof(struct tracerec*));
+    lat = (long long*)malloc(n * sizeof(long long));
+    dist = (long long*)malloc(n * sizeof(long long));
+    wdur = (long long*)malloc(n * sizeof(long long));
+    if (!r || !lat || !dist || !wdur) {
+        fprintf(stderr, "tracehrt: Cannot allocate memory.\n");
+        exit(5);
+    }
+    for (k = 0; k < n; k++)
+        r[k] = rec + (th->count - n + k) % th->nrec;
+    t0 = r[0]->target;
+
+    if (csv) {
+        printf("loop,target,wakeup,delay,write,bytes,fill,flags\n");
+        for (k = 0; k < n; k++)
+            printf("%llu,%lld,%lld,%lld,%d,%d,%d,%d\n",
+                   (unsigned long long)r[k]->loop,
+                   (long long)(r[k]->target - t0), (long long)(r[k]->wakeup - t0),
+                   (long long)(r[k]->wakeup - r[k]->target), r[k]->wdur,
+                   r[k]->bytes, r[k]->fill, r[k]->flags);
+        return 0;
+    }
+
+    underruns = shortwrites = shortreads = 0;
+    minfill = maxfill = r[0]->fill;
+    sumfill = sumbytes = 0;
+    for (k = 0; k < n; k++) {
+        lat[k] = r[k]->wakeup - r[k]->target;
+        wdur[k] = r[k]->wdur;
+        dist[k] = (k > 0) ? r[k]->wakeup - r[k-1]->wakeup : th->nsec;
+        if (r[k]->flags & TRACE_UNDERRUN) underruns++;
+        if (r[k]->flags & TRACE_SHORTWRITE) shortwrites++;
+        if (r[k]->flags & TRACE_SHORTREAD) shortreads++;
+        if (r[k]->fill < minfill) minfill = r[k]->fill;
+        if (r[k]->fill > maxfill) maxfill = r[k]->fill;
+        sumfill += r[k]->fill;
+        sumbytes += r[k]->bytes;
+    }
+
+    /* windows with largest maximal wakeup delay (before sorting lat) */
+    nwin = n / win;
+    if (nwin > 0) {
+        score = (double*)malloc(nwin * sizeof(double));
+        worst = (long*)malloc(nwin * sizeof(long));
+        for (j = 0; j < nwin; j++) {
+            score[j] = lat[j*win];
+            for (k = j*win; k < (j+1)*win; k++)
+                if (lat[k] > score[j])
+                    score[j] = lat[k];
+            worst[j] = j;
+        }
+        /* partial selection sort for the worst ones */
+        if (nworst > nwin)
+            nworst = nwin;
+        for (i = 0; i < nworst; i++)
+            for (j = i+1; j < nwin; j++)
+                if (score[worst[j]] > score[worst[i]]) {
+                    k = worst[i];
+                    worst[i] = worst[j];
+                    worst[j] = k;
+                }
+    } else {
+        nworst = 0;
+        worst = NULL;
+        score = NULL;
+    }
+
+    printf("Trace of %ld loops (of %llu), nominal %lld nsec and %lld bytes "
+           "per loop.\n", n, (unsigned long long)th->count,
+           (long long)th->nsec, (long long)th->olen);
+    printf("Underruns: %ld, short writes: %ld, short reads: %ld.\n",
+           underruns, shortwrites, shortreads);
+    printf("Bytes per loop: avg %.2f; buffer fill: min %lld avg %lld max %lld.\n\n",
+           1.0*sumbytes/n, minfill, sumfill/n, maxfill);
+    printf("%-22s %10s %10s %10s %10s %10s %10s\n", "(nsec)", "min", "50%",
+           "90%", "99%", "99.9%", "max");
+    percentiles("wakeup delay", lat, n);
+    percentiles("time between wakeups", dist, n);
+    percentiles("write duration", wdur, n);
+
+    if (nworst > 0) {
+        printf("\nWorst windows of %ld loops (by maximal wakeup delay):\n", win);
+        for (i = 0; i < nworst; i++) {
+            k = worst[i]*win;
+            printf("  loops %llu..%llu at %.3f sec: max delay %.0f nsec\n",
+                   (unsigned long long)r[k]->loop,
+                   (unsigned long long)r[k+win-1]->loop,
+                   (r[k]->target - t0)/1000000000.0, score[worst[i]]);
+        }
+    }
+    return 0;
+}
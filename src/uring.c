@@ -0,0 +1,131 @@
+/*
+uring.c                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+A minimal interface to the io_uring system calls (without liburing).
+*/
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include "uring.h"
+
+/* sets up a ring with given number of entries, returns 0 on success
+   and -1 (with errno set) otherwise */
+int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+    size_t sqlen, cqlen;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+    /* we need one mapping for both rings (kernel 5.4 and later) */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (cqlen > sqlen)
+        sqlen = cqlen;
+    sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    cq = sq;
+    r->ring = sq;
+    r->ringlen = sqlen;
+    r->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqeslen,
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(sq, sqlen);
+        close(r->fd);
+        return -1;
+    }
+    r->sqhead = (unsigned*)(sq + p.sq_off.head);
+    r->sqtail = (unsigned*)(sq + p.sq_off.tail);
+    r->sqmask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sqarray = (unsigned*)(sq + p.sq_off.array);
+    r->cqhead = (unsigned*)(cq + p.cq_off.head);
+    r->cqtail = (unsigned*)(cq + p.cq_off.tail);
+    r->cqmask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    r->pending = 0;
+    return 0;
+}
+
+/* queues a request, the returned entry can be adjusted before calling
+   uring_submit (e.g., flags, offset) */
+struct io_uring_sqe *uring_prep(struct uring *r, int op, int fd, void *addr,
+                                unsigned len, unsigned long long data)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail, idx;
+
+    tail = *r->sqtail + r->pending;
+    idx = tail & *r->sqmask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    /* for files use (and advance) the current position */
+    sqe->off = (unsigned long long)-1;
+    sqe->user_data = data;
+    r->sqarray[idx] = idx;
+    r->pending++;
+    return sqe;
+}
+
+/* submits the queued requests and waits for 'wait' completions
+   (may return earlier, e.g., on a signal), returns the number of
+   submitted requests or -1 */
+int uring_submit(struct uring *r, unsigned wait)
+{
+    unsigned n;
+
+    n = r->pending;
+    if (n > 0)
+        __atomic_store_n(r->sqtail, *r->sqtail + n, __ATOMIC_RELEASE);
+    r->pending = 0;
+    return syscall(__NR_io_uring_enter, r->fd, n, wait,
+                   wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* gets the next completion, returns 0 if there is none */
+int uring_reap(struct uring *r, unsigned long long *data, int *res)
+{
+    unsigned head;
+    struct io_uring_cqe *cqe;
+
+    head = *r->cqhead;
+    if (head == __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE))
+        return 0;
+    cqe = &r->cqes[head & *r->cqmask];
+    *data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cqhead, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void uring_exit(struct uring *r)
+{
+    munmap(r->sqes, r->sqeslen);
+    munmap(r->ring, r->ringlen);
+    close(r->fd);
+}
@@ -0,0 +1,29 @@
+/*
+uring.h                Copyright frankl 2013-2015
+
+This file is part of frankl's stereo utilities.
+See the file License.txt of the distribution and
+http://www.gnu.org/licenses/gpl.txt for license details.
+
+A minimal interface to the io_uring system calls (without liburing).
+*/
+
+#include <linux/io_uring.h>
+
+struct uring {
+    int fd;
+    unsigned pending;
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring;
+    size_t ringlen, sqeslen;
+};
+
+int uring_init(struct uring *r, unsigned entries);
+struct io_uring_sqe *uring_prep(struct uring *r, int op, int fd, void *addr,
+                                unsigned len, unsigned long long data);
+int uring_submit(struct uring *r, unsigned wait);
+int uring_reap(struct uring *r, unsigned long long *data, int *res);
+void uring_exit(struct uring *r);
@@ -17,6 +17,7 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 #include <sys/stat.h>
 #include <time.h>
 #include "cprefresh.h"
+#include "stream.h"
 
 #define LEN 100000
 #define MAXDELAY 500
@@ -126,6 +127,13 @@ void usage( ) {
 "      by default the output of the program consists of 64-bit floating \n"
 "      point samples. Use this switch if you want 32-bit floating point \n"
 "      samples in the output.\n"
+"\n"
+"  --framed, -M\n"
+"      input and output are framed streams (see 'catloop --framed').\n"
+"      A format in the input (FLOAT64_LE or FLOAT_LE with 2 channels)\n"
+"      overrides --float-input, the RACE delay line is reset and the\n"
+"      format of the output (with the same sample rate) is passed on.\n"
+"      So the chain need not be restarted when the sample rate changes.\n"
 "      \n"
 "   --help, -h\n"
 "      show this help.\n"
@@ -228,6 +236,10 @@ int main(int argc, char *argv[])
   int optc, optind, blen, delay, ndelay, i, check, mlen, change, count,
       fadinglength, verbose;
   char *fnam, floatin, floatout;
+  int framed, newfmt;
+  size_t nbytes;
+  struct streamin sin;
+  struct streamfmt ofmt;
 
   if (argc == 1) {
       usage();
@@ -245,6 +257,7 @@ int main(int argc, char *argv[])
       {"fading-length", required_argument, 0,  'l' },
       {"float-input", no_argument, 0, 'I' },
       {"float-output", no_argument, 0, 'O' },
+      {"framed", no_argument, 0, 'M' },
       {"verbose", no_argument, 0, 'p' },
       {"version", no_argument, 0, 'V' },
       {"help", no_argument, 0, 'h' },
@@ -262,6 +275,7 @@ int main(int argc, char *argv[])
   verbose = 0;
   floatin = FALSE;
   floatout = FALSE;
+  framed = FALSE;
   while ((optc = getopt_long(argc, argv, "v:r:d:a:b:f:m:l:IOVh",
           longoptions, &optind)) != -1) {
       switch (optc) {
@@ -311,6 +325,9 @@ int main(int argc, char *argv[])
       case 'O':
         floatout = TRUE;
         break;
+      case 'M':
+        framed = TRUE;
+        break;
       case 'V':
         fprintf(stderr, "volrace (version %s of frankl's stereo utilities)\n",
                 VERSION);
@@ -345,9 +362,45 @@ int main(int argc, char *argv[])
   /* prepend delay zero samples */
   for (i=0; i<2*delay; i++) buf[i] = 0.0;
 
+  if (framed)
+    stream_initin(&sin, 0);
+
   /* we read from stdin until eof and write to stdout */
   while (TRUE) {
-    if (floatin) {
+    if (framed) {
+      /* we do not know the format before reading, so read floats
+         into inp and convert in place (backwards) if needed */
+      nbytes = stream_readall(&sin, (void*)inp, 2*sizeof(float)*blen, &newfmt);
+      if (newfmt) {
+        if ((sin.fmt.format != STREAM_FLOAT_LE &&
+             sin.fmt.format != STREAM_FLOAT64_LE) || sin.fmt.channels != 2) {
+          fprintf(stderr, "volrace: Cannot handle format %s with %d "
+                          "channels.\n", stream_fmtname(sin.fmt.format),
+                          (int)sin.fmt.channels);
+          exit(5);
+        }
+        floatin = (sin.fmt.format == STREAM_FLOAT_LE);
+        /* reset RACE delay line */
+        for (i=0; i<2*delay; i++) buf[i] = 0.0;
+        stream_setfmt(&ofmt, sin.fmt.rate,
+                      floatout ? STREAM_FLOAT_LE : STREAM_FLOAT64_LE, 2);
+        if (stream_writehdr(1, &ofmt, 0) < 0) {
+          fprintf(stderr, "volrace: Error in write.\n");
+          exit(4);
+        }
+        if (verbose)
+          fprintf(stderr, "volrace: New format, rate %ld, %s input.\n",
+                  (long)sin.fmt.rate, floatin ? "float" : "double");
+      }
+      if (floatin) {
+        mlen = nbytes/(2*sizeof(float));
+        for (i=2*mlen-1; i>=0; i--)
+          inp[i] = (double)(((float*)inp)[i]);
+      } else
+        mlen = nbytes/(2*sizeof(double));
+      if (mlen == 0 && newfmt)
+        continue;
+    } else if (floatin) {
       mlen = fread((void*)inpfloat, 2*sizeof(float), blen, stdin);
       for (i=0; i<2*mlen; i++)
         inp[i] = (double)(inpfloat[i]);
@@ -381,7 +434,16 @@ int main(int argc, char *argv[])
         count--;
       }
     }
-    if (floatout) {
+    if (framed) {
+      if (floatout) {
+        refreshmem((char*)outfloat, 2*sizeof(float)*mlen);
+        check = stream_writeframe(1, outfloat, 2*sizeof(float)*mlen);
+      } else {
+        refreshmem((char*)out, 2*sizeof(double)*mlen);
+        check = stream_writeframe(1, out, 2*sizeof(double)*mlen);
+      }
+      check = (check == 0) ? mlen : 0;
+    } else if (floatout) {
       refreshmem((char*)outfloat, 2*sizeof(float)*mlen);
       check = fwrite((void*)outfloat, 2*sizeof(float), mlen, stdout);
     }
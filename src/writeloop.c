@@ -21,6 +21,10 @@ http://www.gnu.org/licenses/gpl.txt for license details.
 #include <string.h>
 #include <semaphore.h>
 #include "cprefresh.h"
+#include "shmring.h"
+#include "dirwatch.h"
+#include "stream.h"
+#include "shmmem.h"
 
 /* help page */
 /* vim hint to remove resp. add quotes:
@@ -37,7 +41,8 @@ void usage( ) {
 "  This program 'writeloop' reads data from stdin or a file and writes them \n"
 "  cyclically into the files whose names <file1>, ..., are given on the \n"
 "  command line. (If the next file to be written exists then the program \n"
-"  will wait until it is deleted.)\n"
+"  will wait until it is deleted, the directories of the files are watched\n"
+"  with inotify for this.)\n"
 "\n"
 "  Some overhead can be saved by using shared memory files instead of files\n"
 "  in a file system. See the --shared option below.\n"
@@ -68,6 +73,61 @@ void usage( ) {
 "      For large amounts of shared memory you may need to enlarge\n"
 "      '/proc/sys/kernel/shmmax' directly or via sysctl.\n"
 "\n"
+"  --ring, -r\n"
+"      instead of several shared memory segments use a single ring\n"
+"      buffer in shared memory, give exactly one name (starting with a\n"
+"      slash). Its size is the --file-size (rounded up to a multiple of\n"
+"      the page size). Writer and reader only synchronize when the ring\n"
+"      is full or empty, this is much cheaper than the semaphores of\n"
+"      --shared. Use 'catloop --ring' or 'bufhrt --ring' as reader.\n"
+"\n"
+"  --readers=intval, -R intval\n"
+"      with --ring, broadcast the data to up to intval readers (at most\n"
+"      16), each of them gets all data written after it has started.\n"
+"      writeloop waits until intval readers are there and then\n"
+"      overwrites data only when all readers have read them, except\n"
+"      for readers with the --drop option (see 'catloop'): these are\n"
+"      never waited for but continue with the newest data when they fall\n"
+"      a whole ring behind. Readers may leave and new ones join (they get\n"
+"      the data written after joining). The default is a single reader.\n"
+"\n"
+"  --busy-poll=intval, -p intval\n"
+"      with --ring, poll the ring up to intval times before sleeping\n"
+"      when it is full (default 0).\n"
+"\n"
+"  --format=rate:format:channels, -T rate:format:channels\n"
+"      with --shared, put this format (like '44100:S16_LE:2', formats as in\n"
+"      'playhrt') into the first segment. 'catloop --framed' passes it on\n"
+"      in the stream, so that later programs in the chain need not be\n"
+"      told about the format on the command line.\n"
+"\n"
+"  --framed, -M\n"
+"      with --shared, the input is a framed stream (as written by\n"
+"      'catloop --framed', 'volrace --framed' or 'resample_soxr\n"
+"      --framed'). When it contains a new format, the current segment\n"
+"      is finished and the format is put into the next segment, so a\n"
+"      change of the sample rate needs no restart of the chain. (With\n"
+"      files or --ring the data are passed on unchanged, so a framed\n"
+"      stream stays framed.)\n"
+"\n"
+"  --hugetlbfs=dir, -J dir\n"
+"      (with --shared) the segments are files in this directory on a\n"
+"      hugetlbfs mount (e.g., /dev/hugepages) instead of /dev/shm, so they\n"
+"      use huge pages. The other side needs the same option.\n"
+"\n"
+"  --huge-pages, -Q\n"
+"      (with --shared) ask for transparent huge pages for the segments\n"
+"      (for /dev/shm this needs 'advise' in\n"
+"      /sys/kernel/mm/transparent_hugepage/shmem_enabled).\n"
+"\n"
+"  --lock-memory, -E\n"
+"      (with --shared) lock the segments in memory, so that they are never\n"
+"      swapped out or migrated (see 'ulimit -l').\n"
+"\n"
+"  --populate, -y\n"
+"      (with --shared) prefault the segments when they are mapped, so that\n"
+"      the first access of a page causes no page fault.\n"
+"\n"
 "  --force-shm, -x\n"
 "      if --shared is used writeloop may fail to start if 'semaphores' are\n"
 "      left over from former calls or other programs. With this option these\n"
@@ -78,7 +138,8 @@ void usage( ) {
 "      argument is rounded down to a multiple of 8.\n"
 "\n"
 "  --verbose, -v\n"
-"      print some information during startup.\n"
+"      print some information during startup. When writing to files\n"
+"      print for each file how long writeloop had to wait for it.\n"
 "\n"
 "  --version, -V\n"
 "      print information about the version of the program and abort.\n"
@@ -128,6 +189,16 @@ int main(int argc, char *argv[])
     int outfile, fd[100], inp, i, shared, verbose, force, blocksize,
         semflag, size, ret, sz, c, optc;
     off_t skip, checkskip;
+    struct shmring ring;
+    int usering, readers;
+    long spin;
+    struct dirwatch dw;
+    long long waited;
+    struct streamin sin;
+    struct streamfmt fmt;
+    int framed, fmtnext, hdrflag, cap;
+    char *hugedir;
+    int memflags;
 
     /* read command line options */
     static struct option longoptions[] = {
@@ -137,6 +208,15 @@ int main(int argc, char *argv[])
         {"skip", required_argument,       0,  'S' },
         {"shared", no_argument, 0, 's' },
         {"force-shm", no_argument, 0, 'x' },
+        {"ring", no_argument, 0, 'r' },
+        {"busy-poll", required_argument, 0, 'p' },
+        {"readers", required_argument, 0, 'R' },
+        {"format", required_argument, 0, 'T' },
+        {"framed", no_argument, 0, 'M' },
+        {"hugetlbfs", required_argument, 0, 'J' },
+        {"huge-pages", no_argument, 0, 'Q' },
+        {"lock-memory", no_argument, 0, 'E' },
+        {"populate", no_argument, 0, 'y' },
         {"verbose", no_argument, 0, 'v' },
         {"version", no_argument, 0, 'V' },
         {"help", no_argument, 0, 'h' },
@@ -154,8 +234,15 @@ int main(int argc, char *argv[])
     verbose = 0;
     semflag = O_CREAT | O_EXCL;
     force = 0;
+    hugedir = NULL;
+    memflags = 0;
     inp = 0;  /* stdin */
     skip = 0;
+    usering = 0;
+    readers = 0;
+    framed = 0;
+    fmtnext = 0;
+    spin = 0;
     while ((optc = getopt_long(argc, argv, "b:f:F:sVh",
             longoptions, &optind)) != -1) {
         switch (optc) {
@@ -184,6 +271,37 @@ int main(int argc, char *argv[])
         case 'x':
           force = 1;
           break;
+        case 'r':
+          usering = 1;
+          break;
+        case 'p':
+          spin = atol(optarg);
+          break;
+        case 'R':
+          readers = atoi(optarg);
+          break;
+        case 'T':
+          if (stream_parsefmt(optarg, &fmt) < 0) {
+            fprintf(stderr, "writeloop: Invalid format %s.\n", optarg);
+            exit(26);
+          }
+          fmtnext = 1;
+          break;
+        case 'M':
+          framed = 1;
+          break;
+        case 'J':
+          hugedir = optarg;
+          break;
+        case 'Q':
+          memflags |= SHMMEM_THP;
+          break;
+        case 'E':
+          memflags |= SHMMEM_LOCK;
+          break;
+        case 'y':
+          memflags |= SHMMEM_POPULATE;
+          break;
         case 'v':
           verbose = 1;
           break;
@@ -217,7 +335,36 @@ int main(int argc, char *argv[])
        fprintf(stderr, "writeloop: Specify at least two filenames.\n");
        exit(5);
     }
+    if (usering) {
+        /* single ring buffer in shared memory, we read directly into it */
+        if (argc-optind != 1) {
+            fprintf(stderr, "writeloop: Specify one name with --ring.\n");
+            exit(5);
+        }
+        if (shmring_create(&ring, argv[optind], size, readers, force) < 0) {
+            fprintf(stderr, "writeloop: Cannot create shared memory ring %s "
+                            "(%s).\n", argv[optind], strerror(errno));
+            exit(25);
+        }
+        ring.spin = spin;
+        if (verbose)
+            fprintf(stderr, "writeloop: Writing to shared memory ring of "
+                            "%ld bytes (%d readers).\n", (long)ring.size,
+                            readers > 0 ? readers : 1);
+        while (1) {
+            shmring_wait_space(&ring, blocksize);
+            ptr = shmring_wptr(&ring);
+            memclean(ptr, blocksize);
+            c = read(inp, ptr, blocksize);
+            if (c <= 0)
+                break;
+            shmring_produce(&ring, c);
+        }
+        shmring_close_write(&ring);
+        exit(0);
+    }
     if (shared) {
+       shmmem_config(hugedir, memflags);
        if (force) 
           semflag = O_CREAT;
        else
@@ -238,7 +385,7 @@ int main(int argc, char *argv[])
                exit(20);
            }
            /* open shared memory */
-           if ((fd[i-optind] = shm_open(fnames[i-optind],
+           if ((fd[i-optind] = shmmem_open(fnames[i-optind],
                                O_CREAT | O_RDWR, S_IRUSR | S_IWUSR)) == -1){
                fprintf(stderr, "writeloop: Cannot open shared memory %s.\n", fnames[i-optind]);
                exit(22);
@@ -248,13 +395,13 @@ int main(int argc, char *argv[])
                fprintf(stderr, "writeloop: Cannot truncate to 0.");
                exit(23);
            }
-           if (ftruncate(fd[i-optind], sizeof(int)+size) == -1) {
+           if (ftruncate(fd[i-optind], shmmem_size(sizeof(int)+size)) == -1) {
                fprintf(stderr, "writeloop: Cannot truncate to %d.", size);
                exit(23);
            }
            /* map the memory */
-           mems[i-optind] = mmap(NULL, sizeof(int)+size,
-                           PROT_READ | PROT_WRITE, MAP_SHARED, fd[i-optind], 0);
+           mems[i-optind] = shmmem_map(fd[i-optind], sizeof(int)+size,
+                                       PROT_READ | PROT_WRITE);
            if (mems[i-optind] == MAP_FAILED) {
                fprintf(stderr, "writeloop: Cannot map shared memory.");
                exit(24);
@@ -288,12 +435,16 @@ int main(int argc, char *argv[])
     if (shared) {
         if (verbose)
           fprintf(stderr, "writing to shared memory.\n");
+        if (framed)
+          stream_initin(&sin, inp);
+        if (size <= (int)sizeof(struct streamfmt) && (framed || fmtnext)) {
+          fprintf(stderr, "writeloop: File size too small for format.\n");
+          exit(26);
+        }
         mem = mems;
         sem = sems;
         semw = semsw;
-        memclean(buf, blocksize);
-        c = read(inp, buf, blocksize);
-        sz = c;
+        c = 1;
         while (1) {
            if (*fname == NULL) {
               fname = fnames;
@@ -304,24 +455,54 @@ int main(int argc, char *argv[])
            }
            /* get write lock */
            sem_wait(*semw);
-           if (c == 0) {
-              /* done, indicate by empty memory */
-              *((int*)(*mem)) = 0;
-              sem_post(*sem);
-              exit(0);
-           }
+           /* a new format goes first into the segment */
            ptr = *mem+sizeof(int);
-           memclean(ptr, size);
-           while (c > 0 && sz <= size) {
-              memcpy(ptr, buf, c);
-              ptr += c;
-              memclean(buf, blocksize);
-              c = read(inp, buf, blocksize);
-              sz += c;
+           cap = size;
+           hdrflag = 0;
+           if (fmtnext) {
+              memcpy(ptr, &fmt, sizeof(struct streamfmt));
+              ptr += sizeof(struct streamfmt);
+              cap -= sizeof(struct streamfmt);
+              hdrflag = STREAM_SEGFMT;
+              fmtnext = 0;
            }
-           *((int*)(*mem)) = sz - c;
-           sz = c;
+           /* read directly into the segment, at most a block at once */
+           for (sz = 0; c > 0 && sz < cap; ) {
+              if (framed)
+                 c = stream_read(&sin, ptr+sz,
+                                 cap-sz < blocksize ? cap-sz : blocksize);
+              else
+                 c = read(inp, ptr+sz, cap-sz < blocksize ? cap-sz : blocksize);
+              if (c == STREAM_NEWFMT) {
+                 fmt = sin.fmt;
+                 c = 1;
+                 if (sz > 0) {
+                    /* finish this segment, format goes to the next */
+                    fmtnext = 1;
+                    break;
+                 }
+                 if (! hdrflag) {
+                    ptr += sizeof(struct streamfmt);
+                    cap -= sizeof(struct streamfmt);
+                    hdrflag = STREAM_SEGFMT;
+                 }
+                 memcpy(ptr-sizeof(struct streamfmt), &fmt,
+                        sizeof(struct streamfmt));
+              } else if (c > 0)
+                 sz += c;
+           }
+           if (c < 0 && framed) {
+              fprintf(stderr, "writeloop: Invalid framed input.\n");
+              exit(27);
+           }
+           /* clean only the part which was not overwritten */
+           if (sz < cap)
+              memclean(ptr+sz, cap-sz);
+           /* done if empty, this indicates the end to the reader */
+           *((int*)(*mem)) = sz | hdrflag;
            sem_post(*sem);
+           if (sz == 0 && ! hdrflag)
+              exit(0);
            fname++;
            tmpname++;
            mem++;
@@ -331,6 +512,9 @@ int main(int argc, char *argv[])
     } else {
         if (verbose)
           fprintf(stderr, "writing to files.\n");
+        /* wake up when catloop deletes a file */
+        if (dirwatch_init(&dw, fnames, IN_DELETE, 50000) < 0 && verbose)
+          fprintf(stderr, "writeloop: Cannot use inotify, polling.\n");
         sz = 0;
         memclean(buf, blocksize);
         c = read(inp, buf, blocksize);
@@ -340,9 +524,11 @@ int main(int argc, char *argv[])
               fname = fnames;
               tmpname = tmpnames;
            }
-           /* take short naps until next file can be written */
-           while (access(*fname, R_OK) == 0)
-             usleep(50000);
+           /* wait until next file can be written */
+           waited = dirwatch_wait(&dw, *fname, 0);
+           if (verbose)
+             fprintf(stderr, "writeloop: Waited %lld usec for %s.\n",
+                             waited/1000, *fname);
            outfile = open(*tmpname, O_WRONLY|O_CREAT|O_NOATIME, 00444);
            if (!outfile) {
               fprintf(stderr, "writeloop: Cannot open for writing: %s.\n", *fname);